@@ -0,0 +1,522 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_BINARY_FILE_PARSER_H
+#define SRC_BINARY_FILE_PARSER_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "src/file_parser.h"
+#include "src/lock.h"
+
+// Binary CSR training format, native byte order:
+//
+//   BinaryFileHeader
+//   block 0 .. block_num - 1, each 8-byte aligned:
+//     BinaryBlockHeader
+//     float    labels[row_num]            (padded to 8 bytes)
+//     uint64_t offsets[row_num + 1]       (into this block's indices/values)
+//     uint32_t or uint64_t indices[nnz]   (padded to 8 bytes)
+//     float    values[nnz]                (padded to 8 bytes)
+//
+// The bias term is not stored, readers add it like the text parsers do.
+
+#define BINARY_FILE_MAGIC "FTRLCSR1"
+
+struct BinaryFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t index_width;
+	uint64_t line_cnt;
+	uint64_t feat_num;
+	uint64_t block_num;
+	uint64_t reserved;
+};
+
+struct BinaryBlockHeader {
+	uint64_t row_num;
+	uint64_t nnz;
+};
+
+inline size_t binary_align(size_t n) {
+	return (n + 7) & ~static_cast<size_t>(7);
+}
+
+inline size_t binary_block_size(const BinaryBlockHeader& block, size_t index_width) {
+	return sizeof(BinaryBlockHeader)
+		+ binary_align(block.row_num * sizeof(float))
+		+ (block.row_num + 1) * sizeof(uint64_t)
+		+ binary_align(block.nnz * index_width)
+		+ binary_align(block.nnz * sizeof(float));
+}
+
+// Check whether path starts with the binary format magic
+inline bool is_binary_file(const char* path) {
+	FILE* fp = fopen(path, "rb");
+	if (!fp) return false;
+
+	char magic[8];
+	bool res = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+		&& memcmp(magic, BINARY_FILE_MAGIC, sizeof(magic)) == 0;
+	fclose(fp);
+	return res;
+}
+
+// BinaryFileWriter: write samples to binary CSR format block by block
+class BinaryFileWriter {
+public:
+	BinaryFileWriter() : file_desc_(NULL), index_width_(4),
+		line_cnt_(0), feat_num_(0), block_num_(0) {}
+	virtual ~BinaryFileWriter() { Close(); }
+
+	bool Open(const char* path, bool index64 = false);
+	bool Close();
+
+	// Append a sample, x[0] must be the bias term added by the parsers
+	template<typename T>
+	bool Write(T y, const std::vector<std::pair<size_t, T> >& x);
+
+	size_t line_cnt() const { return line_cnt_; }
+	size_t feat_num() const { return feat_num_; }
+
+private:
+	bool FlushBlock();
+	bool WritePadded(const void* data, size_t size);
+
+private:
+	enum { kBlockRows = 65536 };
+
+	FILE* file_desc_;
+	size_t index_width_;
+	size_t line_cnt_;
+	size_t feat_num_;
+	size_t block_num_;
+
+	std::vector<float> labels_;
+	std::vector<uint64_t> offsets_;
+	std::vector<uint64_t> indices_;
+	std::vector<float> values_;
+};
+
+// BinaryFileParser: read binary CSR format through a read-only mapping,
+// worker threads claim whole blocks and copy rows out without locking
+template<typename T>
+class BinaryFileParser : public FileParserBase<T> {
+public:
+	BinaryFileParser();
+	virtual ~BinaryFileParser();
+
+	virtual bool OpenFile(const char* path);
+	virtual bool CloseFile();
+
+	virtual bool ReadSample(T& y, std::vector<std::pair<size_t, T> >& x);
+	virtual bool ReadSampleMultiThread(T& y, std::vector<std::pair<size_t, T> >& x);
+
+	virtual bool ReadProblemInfo(size_t& line_cnt, size_t& feat_num);
+
+	virtual size_t BlockCount() const { return blocks_.size(); }
+	virtual bool SetBlockOrder(const std::vector<size_t>& order);
+
+protected:
+	struct Block {
+		size_t row_num;
+		const float* labels;
+		const uint64_t* offsets;
+		const void* indices;
+		const float* values;
+	};
+
+	struct Cursor {
+		size_t open_id;
+		const Block* block;
+		size_t row;
+	};
+
+	bool ClaimBlock(Cursor& cursor);
+	bool NextSample(Cursor& cursor, T& y, std::vector<std::pair<size_t, T> >& x);
+
+protected:
+	int fd_;
+	const char* data_;
+	size_t size_;
+	BinaryFileHeader header_;
+
+	std::vector<Block> blocks_;
+	// blocks are claimed in this order if not empty
+	std::vector<size_t> order_;
+	std::atomic<size_t> next_block_;
+
+	// sequential cursor of ReadSample, see MmapFileParser
+	Cursor seq_;
+	std::atomic<bool> seq_pending_;
+	size_t open_id_;
+
+	SpinLock lock_;
+
+	static std::atomic<size_t> open_counter_;
+	static thread_local Cursor local_;
+};
+
+
+
+inline bool BinaryFileWriter::Open(const char* path, bool index64) {
+	Close();
+
+	file_desc_ = fopen(path, "wb");
+	if (!file_desc_) {
+		return false;
+	}
+
+	index_width_ = index64 ? sizeof(uint64_t) : sizeof(uint32_t);
+	line_cnt_ = feat_num_ = block_num_ = 0;
+	labels_.clear();
+	indices_.clear();
+	values_.clear();
+	offsets_.assign(1, 0);
+
+	// placeholder, rewritten by Close
+	BinaryFileHeader header;
+	memset(&header, 0, sizeof(header));
+	return fwrite(&header, sizeof(header), 1, file_desc_) == 1;
+}
+
+template<typename T>
+bool BinaryFileWriter::Write(T y, const std::vector<std::pair<size_t, T> >& x) {
+	if (!file_desc_) return false;
+
+	if (index_width_ == sizeof(uint32_t)) {
+		for (size_t i = 1; i < x.size(); ++i) {
+			if (x[i].first > UINT32_MAX) return false;
+		}
+	}
+
+	for (size_t i = 1; i < x.size(); ++i) {
+		size_t idx = x[i].first;
+		indices_.push_back(idx);
+		values_.push_back(static_cast<float>(x[i].second));
+		if (idx + 1 > feat_num_) feat_num_ = idx + 1;
+	}
+
+	labels_.push_back(static_cast<float>(y));
+	offsets_.push_back(indices_.size());
+	++line_cnt_;
+
+	if (labels_.size() >= kBlockRows) {
+		return FlushBlock();
+	}
+	return true;
+}
+
+inline bool BinaryFileWriter::WritePadded(const void* data, size_t size) {
+	static const char zeros[8] = {0};
+	if (size > 0 && fwrite(data, size, 1, file_desc_) != 1) {
+		return false;
+	}
+	size_t pad = binary_align(size) - size;
+	return pad == 0 || fwrite(zeros, pad, 1, file_desc_) == 1;
+}
+
+inline bool BinaryFileWriter::FlushBlock() {
+	if (labels_.empty()) return true;
+
+	BinaryBlockHeader block;
+	block.row_num = labels_.size();
+	block.nnz = indices_.size();
+
+	bool suc = WritePadded(&block, sizeof(block))
+		&& WritePadded(labels_.data(), labels_.size() * sizeof(float))
+		&& WritePadded(offsets_.data(), offsets_.size() * sizeof(uint64_t));
+
+	if (index_width_ == sizeof(uint32_t)) {
+		std::vector<uint32_t> narrow(indices_.begin(), indices_.end());
+		suc = suc && WritePadded(narrow.data(), narrow.size() * sizeof(uint32_t));
+	} else {
+		suc = suc && WritePadded(indices_.data(), indices_.size() * sizeof(uint64_t));
+	}
+	suc = suc && WritePadded(values_.data(), values_.size() * sizeof(float));
+
+	++block_num_;
+	labels_.clear();
+	indices_.clear();
+	values_.clear();
+	offsets_.assign(1, 0);
+	return suc;
+}
+
+inline bool BinaryFileWriter::Close() {
+	if (!file_desc_) return true;
+
+	bool suc = FlushBlock();
+
+	BinaryFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BINARY_FILE_MAGIC, sizeof(header.magic));
+	header.version = 1;
+	header.index_width = static_cast<uint32_t>(index_width_);
+	header.line_cnt = line_cnt_;
+	header.feat_num = std::max(feat_num_, (size_t)1);
+	header.block_num = block_num_;
+
+	suc = suc && fseek(file_desc_, 0, SEEK_SET) == 0
+		&& fwrite(&header, sizeof(header), 1, file_desc_) == 1;
+	suc = (fclose(file_desc_) == 0) && suc;
+	file_desc_ = NULL;
+	return suc;
+}
+
+
+
+template<typename T>
+std::atomic<size_t> BinaryFileParser<T>::open_counter_(0);
+
+template<typename T>
+thread_local typename BinaryFileParser<T>::Cursor BinaryFileParser<T>::local_;
+
+template<typename T>
+BinaryFileParser<T>::BinaryFileParser()
+: fd_(-1), data_(NULL), size_(0), next_block_(0), seq_pending_(false), open_id_(0) {
+	memset(&header_, 0, sizeof(header_));
+	seq_.open_id = 0;
+	seq_.block = NULL;
+	seq_.row = 0;
+}
+
+template<typename T>
+BinaryFileParser<T>::~BinaryFileParser() {
+	CloseFile();
+}
+
+template<typename T>
+bool BinaryFileParser<T>::OpenFile(const char* path) {
+	CloseFile();
+
+	fd_ = open(path, O_RDONLY);
+	if (fd_ < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd_, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(BinaryFileHeader)) {
+		CloseFile();
+		return false;
+	}
+
+	size_ = static_cast<size_t>(st.st_size);
+	void* addr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if (addr == MAP_FAILED) {
+		CloseFile();
+		return false;
+	}
+	data_ = reinterpret_cast<const char*>(addr);
+	madvise(addr, size_, MADV_SEQUENTIAL);
+
+	memcpy(&header_, data_, sizeof(header_));
+	if (memcmp(header_.magic, BINARY_FILE_MAGIC, sizeof(header_.magic)) != 0
+			|| (header_.index_width != sizeof(uint32_t)
+				&& header_.index_width != sizeof(uint64_t))) {
+		CloseFile();
+		return false;
+	}
+
+	// sizes are bounded by the file before they are multiplied, and rows
+	// must lie within their block, so that no read leaves the mapping
+	size_t pos = sizeof(BinaryFileHeader);
+	size_t line_cnt = 0;
+	for (size_t i = 0; i < header_.block_num; ++i) {
+		if (pos + sizeof(BinaryBlockHeader) > size_) break;
+
+		const BinaryBlockHeader* bh = reinterpret_cast<const BinaryBlockHeader*>(data_ + pos);
+		if (bh->row_num > size_ / sizeof(uint64_t) || bh->nnz > size_ / sizeof(uint32_t)) {
+			break;
+		}
+		size_t block_size = binary_block_size(*bh, header_.index_width);
+		if (block_size > size_ - pos) break;
+
+		Block block;
+		const char* p = data_ + pos + sizeof(BinaryBlockHeader);
+		block.row_num = bh->row_num;
+		block.labels = reinterpret_cast<const float*>(p);
+		p += binary_align(bh->row_num * sizeof(float));
+		block.offsets = reinterpret_cast<const uint64_t*>(p);
+		p += (bh->row_num + 1) * sizeof(uint64_t);
+		block.indices = p;
+		p += binary_align(bh->nnz * header_.index_width);
+		block.values = reinterpret_cast<const float*>(p);
+
+		bool rows_valid = block.offsets[0] == 0 && block.offsets[bh->row_num] == bh->nnz;
+		for (size_t r = 0; r < bh->row_num && rows_valid; ++r) {
+			rows_valid = block.offsets[r] <= block.offsets[r + 1];
+		}
+		if (!rows_valid) break;
+
+		blocks_.push_back(block);
+		line_cnt += bh->row_num;
+		pos += block_size;
+	}
+
+	if (blocks_.size() != header_.block_num || line_cnt != header_.line_cnt) {
+		fprintf(stderr, "truncated or corrupt binary file %s\n", path);
+		CloseFile();
+		return false;
+	}
+
+	order_.clear();
+	next_block_ = 0;
+	open_id_ = ++open_counter_;
+	seq_.open_id = open_id_;
+	seq_.block = NULL;
+	seq_pending_ = false;
+	return true;
+}
+
+template<typename T>
+bool BinaryFileParser<T>::CloseFile() {
+	if (data_) {
+		munmap(const_cast<char*>(data_), size_);
+		data_ = NULL;
+	}
+
+	if (fd_ >= 0) {
+		close(fd_);
+		fd_ = -1;
+	}
+
+	size_ = 0;
+	blocks_.clear();
+	order_.clear();
+	next_block_ = 0;
+	open_id_ = 0;
+	seq_.block = NULL;
+	seq_pending_ = false;
+	return true;
+}
+
+template<typename T>
+bool BinaryFileParser<T>::ReadProblemInfo(size_t& line_cnt, size_t& feat_num) {
+	if (!data_) return false;
+
+	line_cnt = header_.line_cnt;
+	feat_num = header_.feat_num;
+	return true;
+}
+
+template<typename T>
+bool BinaryFileParser<T>::SetBlockOrder(const std::vector<size_t>& order) {
+	if (!FileParserBase<T>::IsBlockOrder(order, BlockCount())) {
+		return false;
+	}
+
+	order_ = order;
+	return true;
+}
+
+template<typename T>
+bool BinaryFileParser<T>::ClaimBlock(Cursor& cursor) {
+	if (&cursor != &seq_ && seq_pending_.load(std::memory_order_acquire)) {
+		std::lock_guard<SpinLock> lock(lock_);
+		if (seq_.block && seq_.row < seq_.block->row_num) {
+			cursor.block = seq_.block;
+			cursor.row = seq_.row;
+			seq_.block = NULL;
+			seq_pending_ = false;
+			return true;
+		}
+	}
+
+	size_t block = next_block_.fetch_add(1, std::memory_order_relaxed);
+	if (block >= blocks_.size()) {
+		return false;
+	}
+	if (!order_.empty()) {
+		block = order_[block];
+	}
+
+	cursor.block = &blocks_[block];
+	cursor.row = 0;
+	return true;
+}
+
+template<typename T>
+bool BinaryFileParser<T>::NextSample(Cursor& cursor, T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	if (cursor.open_id != open_id_) {
+		cursor.open_id = open_id_;
+		cursor.block = NULL;
+	}
+
+	if ((!cursor.block || cursor.row >= cursor.block->row_num) && !ClaimBlock(cursor)) {
+		return false;
+	}
+
+	const Block& block = *cursor.block;
+	size_t row = cursor.row++;
+
+	y = static_cast<T>(block.labels[row]);
+	if (y < 0) y = 0;
+
+	x.clear();
+	// add bias term
+	x.push_back(std::make_pair((size_t)0, (T)1));
+
+	size_t begin = block.offsets[row];
+	size_t end = block.offsets[row + 1];
+	if (header_.index_width == sizeof(uint32_t)) {
+		const uint32_t* indices = reinterpret_cast<const uint32_t*>(block.indices);
+		for (size_t i = begin; i < end; ++i) {
+			x.push_back(std::make_pair((size_t)indices[i], (T)block.values[i]));
+		}
+	} else {
+		const uint64_t* indices = reinterpret_cast<const uint64_t*>(block.indices);
+		for (size_t i = begin; i < end; ++i) {
+			x.push_back(std::make_pair((size_t)indices[i], (T)block.values[i]));
+		}
+	}
+
+	return true;
+}
+
+template<typename T>
+bool BinaryFileParser<T>::ReadSample(T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	std::lock_guard<SpinLock> lock(lock_);
+	bool suc = NextSample(seq_, y, x);
+	seq_pending_.store(seq_.block && seq_.row < seq_.block->row_num,
+		std::memory_order_release);
+	return suc;
+}
+
+template<typename T>
+bool BinaryFileParser<T>::ReadSampleMultiThread(T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	return NextSample(local_, y, x);
+}
+
+
+#endif // SRC_BINARY_FILE_PARSER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,83 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_CHECKPOINT_H
+#define SRC_CHECKPOINT_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// Checkpointer: periodic checkpoints written by a thread of their own while
+// training goes on. One training thread polls Due with the samples trained
+// so far and Starts a save when it is due, a checkpoint still being written
+// puts the next one off.
+class Checkpointer {
+public:
+	Checkpointer() : seconds_(0), samples_(0), last_samples_(0), running_(false) {}
+	~Checkpointer() { Wait(); }
+
+	// every seconds or every samples, 0 for never
+	void Initialize(double seconds, size_t samples) {
+		seconds_ = seconds;
+		samples_ = samples;
+		last_samples_ = 0;
+		last_time_ = Clock::now();
+	}
+
+	bool enabled() const { return seconds_ > 0 || samples_ > 0; }
+
+	bool Due(size_t samples) const {
+		if (!enabled() || running_) return false;
+		if (samples_ > 0 && samples - last_samples_ >= samples_) return true;
+		return seconds_ > 0
+			&& std::chrono::duration<double>(Clock::now() - last_time_).count() >= seconds_;
+	}
+
+	// Run save in the background, samples as given to Due
+	void Start(const std::function<void()>& save, size_t samples) {
+		Wait();
+		last_samples_ = samples;
+		last_time_ = Clock::now();
+		running_ = true;
+		thread_ = std::thread([this, save] {
+			save();
+			running_ = false;
+		});
+	}
+
+	void Wait() {
+		if (thread_.joinable()) thread_.join();
+	}
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	double seconds_;
+	size_t samples_;
+	size_t last_samples_;
+	Clock::time_point last_time_;
+	std::atomic<bool> running_;
+	std::thread thread_;
+};
+
+#endif // SRC_CHECKPOINT_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
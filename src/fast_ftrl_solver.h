@@ -23,16 +23,22 @@
 
 #include <algorithm>
 #include <functional>
+#include <new>
 #include <utility>
 #include <vector>
 #include "src/ftrl_solver.h"
 #include "src/lock.h"
 
-enum { kParamGroupSize = 10, kFetchStep = 3, kPushStep = 3 };
+enum { kFetchStep = 3, kPushStep = 3 };
 
-inline size_t calc_group_num(size_t n) {
-	return (n + kParamGroupSize - 1) / kParamGroupSize;
-}
+// Group step counters of a sparse store are shared by hashing
+enum { kSparseGroupSlots = 1 << 16 };
+
+// Groups share up to this many locks, each in its own cache line
+enum { kDefaultLockStripes = 1 << 16 };
+
+// Largest group one push or fetch may copy under its lock
+enum { kMaxGroupSize = 1 << 16 };
 
 template<typename T>
 class FtrlParamServer : public FtrlSolver<T> {
@@ -47,19 +53,62 @@ public:
 		T l1,
 		T l2,
 		size_t n,
-		T dropout = 0);
+		T dropout = 0,
+		bool sparse = false,
+		bool compact = false);
 
 	virtual bool Initialize(const char* path);
 
-	bool FetchParamGroup(T* n, T* z, size_t group);
+	bool FetchParamGroup(FtrlParamStore<T>& params, size_t group);
+
+	bool FetchParam(FtrlParamStore<T>& params);
+
+	bool PushParamGroup(FtrlParamStore<T>& params, size_t group);
+
+	bool PushParam(FtrlParamStore<T>& params);
+
+	// Coordinates per group, rounded up to a power of two so that groups of
+	// a dense store never straddle cache lines, 0 is a cache line of them.
+	// Both take effect at Initialize
+	void set_group_size(size_t size) { group_request_ = size; }
+	// Locks shared by groups, rounded up to a power of two
+	void set_lock_stripes(size_t num) { lock_request_ = num; }
+
+	size_t group_size() const { return (size_t)1 << group_shift_; }
+	size_t group_of(size_t idx) const { return idx >> group_shift_; }
+	size_t lock_num() const { return lock_mask_ + 1; }
+
+	// slot of group's step counter
+	size_t group_slot(size_t group) const {
+		return group < param_group_num_ ? group : group % param_group_num_;
+	}
+
+	size_t param_group_num() const { return param_group_num_; }
+
+protected:
+	// whole groups, read like FetchParamGroup
+	virtual void CopyParams(size_t start, size_t num, char* buf);
+	virtual void ReadParams(size_t start, size_t num, FtrlParam<T>* out);
+
+private:
+	bool InitGroups();
+
+	// func(pos, end) for each piece of [start, end) within a group, run
+	// again while a writer of the group races it
+	template<class Func>
+	void ReadGroups(size_t start, size_t end, const Func& func);
 
-	bool FetchParam(T* n, T* z);
+	void PushCoordinate(FtrlParamStore<T>& params, size_t idx);
 
-	bool PushParamGroup(T* n, T* z, size_t group);
+	SeqLock& group_lock(size_t group) { return lock_slots_[group & lock_mask_]; }
 
 private:
+	size_t group_request_;
+	size_t lock_request_;
+	size_t group_shift_;
 	size_t param_group_num_;
-	SpinLock* lock_slots_;
+	size_t lock_mask_;
+	PaddedSeqLock* lock_slots_;
 };
 
 template<typename T>
@@ -82,40 +131,103 @@ public:
 		T l1,
 		T l2,
 		size_t n,
-		T dropout = 0) { return false; }
+		T dropout = 0,
+		bool sparse = false,
+		bool compact = false) { return false; }
 
 	bool Initialize(const char* path) { return false; }
 
 	T Update(const std::vector<std::pair<size_t, T> >& x, T y) { return false; }
 
+	T Update(const std::vector<std::pair<size_t, T> >& x, T y,
+		FtrlScratch<T>& scratch) { return false; }
+
+	// Update with a scratch of the calling thread
 	T Update(
 		const std::vector<std::pair<size_t, T> >& x,
 		T y,
 		FtrlParamServer<T>* param_server);
 
+	T Update(
+		const std::vector<std::pair<size_t, T> >& x,
+		T y,
+		FtrlParamServer<T>* param_server,
+		FtrlScratch<T>& scratch);
+
 	bool PushParam(FtrlParamServer<T>* param_server);
 
+	// Initialize takes the selection of param_server
+	void SelectUpdate(bool binary, bool in_range);
+
+private:
+	template<class Policy>
+	T UpdateImpl(
+		const std::vector<std::pair<size_t, T> >& x,
+		T y,
+		FtrlParamServer<T>* param_server,
+		FtrlScratch<T>& scratch);
+
+	typedef T (FtrlWorker<T>::*UpdateFunc)(const std::vector<std::pair<size_t, T> >&, T,
+		FtrlParamServer<T>*, FtrlScratch<T>&);
+
+	struct UpdateSelect {
+		typedef UpdateFunc Func;
+		template<class Policy>
+		static Func Get() { return &FtrlWorker<T>::template UpdateImpl<Policy>; }
+	};
+
 private:
 	size_t param_group_num_;
 	size_t* param_group_step_;
 	size_t push_step_;
 	size_t fetch_step_;
 
-	T * n_update_;
-	T * z_update_;
+	FtrlParamStore<T> param_update_;
+	UpdateFunc worker_update_;
 };
 
 
 
 template<typename T>
 FtrlParamServer<T>::FtrlParamServer()
-: FtrlSolver<T>(), param_group_num_(0), lock_slots_(NULL) {}
+: FtrlSolver<T>(), group_request_(0), lock_request_(kDefaultLockStripes), group_shift_(0),
+param_group_num_(0), lock_mask_(0), lock_slots_(NULL) {}
 
 template<typename T>
 FtrlParamServer<T>::~FtrlParamServer() {
-	if (lock_slots_) {
-		delete [] lock_slots_;
+	param_free(lock_slots_);
+}
+
+template<typename T>
+bool FtrlParamServer<T>::InitGroups() {
+	param_free(lock_slots_);
+	lock_slots_ = NULL;
+
+	FtrlParamStore<T>& params = FtrlSolver<T>::params_;
+	size_t size = group_request_;
+	if (size == 0) {
+		size = kCacheLineSize / (params.compact() ? sizeof(CompactParam) : sizeof(FtrlParam<T>));
 	}
+	group_shift_ = 0;
+	while (((size_t)1 << group_shift_) < size) ++group_shift_;
+
+	size_t lock_bound = lock_request_;
+	if (params.sparse()) {
+		param_group_num_ = kSparseGroupSlots;
+	} else {
+		param_group_num_ = (params.feat_num() + group_size() - 1) >> group_shift_;
+		lock_bound = std::min(lock_bound, param_group_num_);
+	}
+	size_t num = 1;
+	while (num < lock_bound) num <<= 1;
+	lock_mask_ = num - 1;
+
+	// placed like the parameters they guard, aligned to a line
+	lock_slots_ = reinterpret_cast<PaddedSeqLock*>(
+		param_alloc(num * sizeof(PaddedSeqLock)));
+	if (!lock_slots_) return false;
+	for (size_t i = 0; i < num; ++i) new (lock_slots_ + i) PaddedSeqLock();
+	return true;
 }
 
 template<typename T>
@@ -125,13 +237,16 @@ bool FtrlParamServer<T>::Initialize(
 		T l1,
 		T l2,
 		size_t n,
-		T dropout) {
-	if (!FtrlSolver<T>::Initialize(alpha, beta, l1, l2, n, dropout)) {
+		T dropout,
+		bool sparse,
+		bool compact) {
+	if (!FtrlSolver<T>::Initialize(alpha, beta, l1, l2, n, dropout, sparse, compact)) {
 		return false;
 	}
 
-	param_group_num_ = calc_group_num(n);
-	lock_slots_ = new SpinLock[param_group_num_];
+	if (!InitGroups()) {
+		return false;
+	}
 
 	FtrlSolver<T>::init_ = true;
 	return true;
@@ -143,52 +258,152 @@ bool FtrlParamServer<T>::Initialize(const char* path) {
 		return false;
 	}
 
-	param_group_num_ = calc_group_num(FtrlSolver<T>::feat_num_);
-	lock_slots_ = new SpinLock[param_group_num_];
+	if (!InitGroups()) {
+		return false;
+	}
 
 	FtrlSolver<T>::init_ = true;
 	return true;
 }
 
 template<typename T>
-bool FtrlParamServer<T>::FetchParamGroup(T* n, T* z, size_t group) {
+template<class Func>
+void FtrlParamServer<T>::ReadGroups(size_t start, size_t end, const Func& func) {
+	for (size_t pos = start; pos < end; ) {
+		size_t group = group_of(pos);
+		size_t group_end = std::min(end, (group + 1) << group_shift_);
+		SeqLock& lock = group_lock(group);
+		uint64_t seq;
+		do {
+			seq = lock.read_begin();
+			func(pos, group_end);
+		} while (lock.read_retry(seq));
+		pos = group_end;
+	}
+}
+
+template<typename T>
+void FtrlParamServer<T>::CopyParams(size_t start, size_t num, char* buf) {
+	size_t bytes = FtrlSolver<T>::compact() ? sizeof(CompactParam) : sizeof(FtrlParam<T>);
+	ReadGroups(start, start + num, [&] (size_t pos, size_t end) {
+		FtrlSolver<T>::CopyParams(pos, end - pos, buf + (pos - start) * bytes);
+	});
+}
+
+template<typename T>
+void FtrlParamServer<T>::ReadParams(size_t start, size_t num, FtrlParam<T>* out) {
+	ReadGroups(start, start + num, [&] (size_t pos, size_t end) {
+		FtrlSolver<T>::ReadParams(pos, end - pos, out + (pos - start));
+	});
+}
+
+template<typename T>
+bool FtrlParamServer<T>::FetchParamGroup(FtrlParamStore<T>& params, size_t group) {
 	if (!FtrlSolver<T>::init_) return false;
 
-	size_t start = group * kParamGroupSize;
-	size_t end = std::min((group + 1) * kParamGroupSize, FtrlSolver<T>::feat_num_);
+	FtrlParamStore<T>& server = FtrlSolver<T>::params_;
+	size_t start = group << group_shift_;
+	size_t end = (group + 1) << group_shift_;
+	if (!server.sparse()) end = std::min(end, server.feat_num());
+
+	// fetches never block each other, only a push racing the copy repeats it
+	SeqLock& lock = group_lock(group);
+	uint64_t seq;
+	do {
+		seq = lock.read_begin();
+		if (!server.sparse()) {
+			params.CopyRange(server, start, end);
+			continue;
+		}
 
-	std::lock_guard<SpinLock> lock(lock_slots_[group]);
-	for (size_t i = start; i < end; ++i) {
-		n[i] = FtrlSolver<T>::n_[i];
-		z[i] = FtrlSolver<T>::z_[i];
-	}
+		// coordinates unknown to server drop local changes, as dense copies do
+		FtrlParam<T> param, local;
+		for (size_t i = start; i < end; ++i) {
+			if (server.Get(i, param) || params.Get(i, local)) {
+				params.Set(i, param);
+			}
+		}
+	} while (lock.read_retry(seq));
 
 	return true;
 }
 
 template<typename T>
-bool FtrlParamServer<T>::FetchParam(T* n, T* z) {
+bool FtrlParamServer<T>::FetchParam(FtrlParamStore<T>& params) {
 	if (!FtrlSolver<T>::init_) return false;
 
-	for (size_t i = 0; i < param_group_num_; ++i) {
-		FetchParamGroup(n, z, i);
+	if (!FtrlSolver<T>::params_.sparse()) {
+		for (size_t i = 0; i < param_group_num_; ++i) {
+			FetchParamGroup(params, i);
+		}
+		return true;
 	}
+
+	if (!params.InitializeSparse(FtrlSolver<T>::params_.size())) {
+		return false;
+	}
+	FtrlSolver<T>::params_.ForEach([&params] (size_t idx, const FtrlParam<T>& param) {
+		params.Set(idx, param);
+	});
 	return true;
 }
 
 template<typename T>
-bool FtrlParamServer<T>::PushParamGroup(T* n, T* z, size_t group) {
+void FtrlParamServer<T>::PushCoordinate(FtrlParamStore<T>& params, size_t idx) {
+	FtrlParam<T> delta;
+	if (!params.Get(idx, delta) || (delta.n == 0 && delta.z == 0)) return;
+
+	FtrlSolver<T>::params_.Modify(idx, [&delta] (FtrlParam<T>& param) {
+		param.n += delta.n;
+		param.z += delta.z;
+	});
+
+	delta.n = delta.z = 0;
+	params.Set(idx, delta);
+}
+
+template<typename T>
+bool FtrlParamServer<T>::PushParamGroup(FtrlParamStore<T>& params, size_t group) {
 	if (!FtrlSolver<T>::init_) return false;
 
-	size_t start = group * kParamGroupSize;
-	size_t end = std::min((group + 1) * kParamGroupSize, FtrlSolver<T>::feat_num_);
+	FtrlParamStore<T>& server = FtrlSolver<T>::params_;
+	size_t start = group << group_shift_;
+	size_t end = (group + 1) << group_shift_;
+
+	std::lock_guard<SeqLock> lock(group_lock(group));
+	if (!server.sparse()) {
+		end = std::min(end, server.feat_num());
+		server.AddRange(params, start, end);
+		return true;
+	}
 
-	std::lock_guard<SpinLock> lock(lock_slots_[group]);
 	for (size_t i = start; i < end; ++i) {
-		FtrlSolver<T>::n_[i] += n[i];
-		FtrlSolver<T>::z_[i] += z[i];
-		n[i] = 0;
-		z[i] = 0;
+		PushCoordinate(params, i);
+	}
+
+	return true;
+}
+
+template<typename T>
+bool FtrlParamServer<T>::PushParam(FtrlParamStore<T>& params) {
+	if (!FtrlSolver<T>::init_) return false;
+
+	if (!FtrlSolver<T>::params_.sparse()) {
+		for (size_t i = 0; i < param_group_num_; ++i) {
+			PushParamGroup(params, i);
+		}
+		return true;
+	}
+
+	// walk pending updates rather than the whole index space
+	std::vector<size_t> pending;
+	params.ForEach([&pending] (size_t idx, const FtrlParam<T>& param) {
+		if (param.n != 0 || param.z != 0) pending.push_back(idx);
+	});
+
+	for (size_t idx : pending) {
+		std::lock_guard<SeqLock> lock(group_lock(group_of(idx)));
+		PushCoordinate(params, idx);
 	}
 
 	return true;
@@ -198,21 +413,13 @@ bool FtrlParamServer<T>::PushParamGroup(T* n, T* z, size_t group) {
 template<typename T>
 FtrlWorker<T>::FtrlWorker()
 : FtrlSolver<T>(), param_group_num_(0), param_group_step_(NULL),
-push_step_(0), fetch_step_(0), n_update_(NULL), z_update_(NULL) {}
+push_step_(0), fetch_step_(0), worker_update_(NULL) {}
 
 template<typename T>
 FtrlWorker<T>::~FtrlWorker() {
 	if (param_group_step_) {
 		delete [] param_group_step_;
 	}
-
-	if (n_update_) {
-		delete [] n_update_;
-	}
-
-	if (z_update_) {
-		delete [] z_update_;
-	}
 }
 
 template<typename T>
@@ -224,20 +431,28 @@ bool FtrlWorker<T>::Initialize(
 	FtrlSolver<T>::beta_ = param_server->beta();
 	FtrlSolver<T>::l1_ = param_server->l1();
 	FtrlSolver<T>::l2_ = param_server->l2();
-	FtrlSolver<T>::feat_num_ = param_server->feat_num();
 	FtrlSolver<T>::dropout_ = param_server->dropout();
+	FtrlSolver<T>::fast_math_ = param_server->fast_math();
+
+	bool suc = false;
+	if (param_server->sparse()) {
+		suc = param_update_.InitializeSparse()
+			&& FtrlSolver<T>::params_.InitializeSparse();
+	} else {
+		size_t feat_num = param_server->feat_num();
+		bool compact = param_server->compact();
+		suc = param_update_.InitializeDense(feat_num, compact)
+			&& FtrlSolver<T>::params_.InitializeDense(feat_num, compact);
+	}
+	if (!suc) {
+		return false;
+	}
+	param_server->FetchParam(FtrlSolver<T>::params_);
+	FtrlSolver<T>::ShareAdmission(param_server->admission());
+	SelectUpdate(param_server->binary_input(), param_server->in_range_input());
 
-	n_update_ = new T[FtrlSolver<T>::feat_num_];
-	z_update_ = new T[FtrlSolver<T>::feat_num_];
-	set_float_zero(n_update_, FtrlSolver<T>::feat_num_);
-	set_float_zero(z_update_, FtrlSolver<T>::feat_num_);
-
-	FtrlSolver<T>::n_ = new T[FtrlSolver<T>::feat_num_];
-	FtrlSolver<T>::z_ = new T[FtrlSolver<T>::feat_num_];
-	param_server->FetchParam(FtrlSolver<T>::n_, FtrlSolver<T>::z_);
-
-	param_group_num_ = calc_group_num(FtrlSolver<T>::feat_num_);
-	param_group_step_ = new size_t[param_group_num_];
+	param_group_num_ = param_server->param_group_num();
+	param_group_step_ = new size_t[std::max(param_group_num_, (size_t)1)];
 	for (size_t i = 0; i < param_group_num_; ++i) param_group_step_[i] = 0;
 
 	push_step_ = push_step;
@@ -251,7 +466,7 @@ template<typename T>
 bool FtrlWorker<T>::Reset(FtrlParamServer<T>* param_server) {
 	if (!FtrlSolver<T>::init_) return 0;
 
-	param_server->FetchParam(FtrlSolver<T>::n_, FtrlSolver<T>::z_);
+	param_server->FetchParam(FtrlSolver<T>::params_);
 
 	for (size_t i = 0; i < param_group_num_; ++i) {
 		param_group_step_[i] = 0;
@@ -264,58 +479,68 @@ T FtrlWorker<T>::Update(
 		const std::vector<std::pair<size_t, T> >& x,
 		T y,
 		FtrlParamServer<T>* param_server) {
+	return Update(x, y, param_server, FtrlSolver<T>::local_scratch_);
+}
+
+template<typename T>
+T FtrlWorker<T>::Update(
+		const std::vector<std::pair<size_t, T> >& x,
+		T y,
+		FtrlParamServer<T>* param_server,
+		FtrlScratch<T>& scratch) {
 	if (!FtrlSolver<T>::init_) return 0;
 
-	std::vector<std::pair<size_t, T> > weights;
-	std::vector<T> gradients;
-	T wTx = 0.;
+	return (this->*worker_update_)(x, y, param_server, scratch);
+}
 
-	for (auto& item : x) {
-		if (util_greater(FtrlSolver<T>::dropout_, (T)0)) {
-			T rand_prob = FtrlSolver<T>::uniform_dist_(FtrlSolver<T>::rand_generator_);
-			if (rand_prob < FtrlSolver<T>::dropout_) {
-				continue;
-			}
-		}
-		size_t idx = item.first;
-		if (idx >= FtrlSolver<T>::feat_num_) continue;
+template<typename T>
+void FtrlWorker<T>::SelectUpdate(bool binary, bool in_range) {
+	FtrlSolver<T>::SelectUpdate(binary, in_range);
+	worker_update_ = select_policy<UpdateSelect>(
+		util_greater(FtrlSolver<T>::dropout_, (T)0), binary, !in_range);
+}
 
-		T val = FtrlSolver<T>::GetWeight(idx);
-		weights.push_back(std::make_pair(idx, val));
-		gradients.push_back(item.second);
-		wTx += val * item.second;
-	}
+template<typename T>
+template<class Policy>
+T FtrlWorker<T>::UpdateImpl(
+		const std::vector<std::pair<size_t, T> >& x,
+		T y,
+		FtrlParamServer<T>* param_server,
+		FtrlScratch<T>& scratch) {
+	bool simd = FtrlSolver<T>::simd_;
+	size_t num = FtrlSolver<T>::template GatherParams<Policy>(x, scratch, true);
+	T wTx = ftrl_weights<Policy::binary>(scratch.n.data(), scratch.z.data(),
+		scratch.value.data(), num, FtrlSolver<T>::kernel_param(), scratch.weight.data(), simd);
 
-	T pred = sigmoid(wTx);
+	T pred = FtrlSolver<T>::Sigmoid(wTx);
 	T grad = pred - y;
-	std::transform(gradients.begin(), gradients.end(), gradients.begin(),
-			std::bind1st(std::multiplies<T>(), grad));
-
-	for (size_t k = 0; k < weights.size(); ++k) {
-		size_t i = weights[k].first;
-		size_t g = i / kParamGroupSize;
-
-		if (param_group_step_[g] % fetch_step_ == 0) {
-			param_server->FetchParamGroup(
-				FtrlSolver<T>::n_,
-				FtrlSolver<T>::z_,
-				g);
+	// increments use the state read above, before groups are fetched
+	ftrl_deltas<Policy::binary>(scratch.n.data(), scratch.z.data(), scratch.weight.data(),
+		scratch.value.data(), grad, num, FtrlSolver<T>::alpha_, simd);
+
+	for (size_t k = 0; k < num; ++k) {
+		size_t i = scratch.index[k];
+		size_t g = param_server->group_of(i);
+		size_t& step = param_group_step_[param_server->group_slot(g)];
+
+		if (step % fetch_step_ == 0) {
+			param_server->FetchParamGroup(FtrlSolver<T>::params_, g);
 		}
 
-		T w_i = weights[k].second;
-		T grad_i = gradients[k];
-		T sigma = (sqrt(FtrlSolver<T>::n_[i] + grad_i * grad_i)
-			- sqrt(FtrlSolver<T>::n_[i])) / FtrlSolver<T>::alpha_;
-		FtrlSolver<T>::z_[i] += grad_i - sigma * w_i;
-		FtrlSolver<T>::n_[i] += grad_i * grad_i;
-		z_update_[i] += grad_i - sigma * w_i;
-		n_update_[i] += grad_i * grad_i;
-
-		if (param_group_step_[g] % push_step_ == 0) {
-			param_server->PushParamGroup(n_update_, z_update_, g);
+		T delta_n = scratch.n[k];
+		T delta_z = scratch.z[k];
+		auto apply = [&] (FtrlParam<T>& param) {
+			param.z += delta_z;
+			param.n += delta_n;
+		};
+		FtrlSolver<T>::params_.Modify(i, apply);
+		param_update_.Modify(i, apply);
+
+		if (step % push_step_ == 0) {
+			param_server->PushParamGroup(param_update_, g);
 		}
 
-		param_group_step_[g] += 1;
+		step += 1;
 	}
 
 	return pred;
@@ -325,11 +550,7 @@ template<typename T>
 bool FtrlWorker<T>::PushParam(FtrlParamServer<T>* param_server) {
 	if (!FtrlSolver<T>::init_) return false;
 
-	for (size_t i = 0; i < param_group_num_; ++i) {
-		param_server->PushParamGroup(n_update_, z_update_, i);
-	}
-
-	return true;
+	return param_server->PushParam(param_update_);
 }
 
 
@@ -0,0 +1,118 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef SRC_FAST_RANDOM_H
+#define SRC_FAST_RANDOM_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// next output of the splitmix64 stream at state, which spreads even
+// consecutive states over all 64 bits
+inline uint64_t splitmix64(uint64_t& state) {
+	state += 0x9e3779b97f4a7c15ULL;
+	uint64_t z = state;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// xoshiro256++ by Blackman and Vigna, a few cycles per draw and 32 bytes of
+// state, so every thread can own one. Usable with <random> and <algorithm>.
+class Xoshiro256 {
+public:
+	typedef uint64_t result_type;
+
+	explicit Xoshiro256(uint64_t seed = 0) {
+		Seed(seed);
+	}
+
+	// state from splitmix64, which never leaves it all zero
+	void Seed(uint64_t seed) {
+		for (size_t i = 0; i < 4; ++i) s_[i] = splitmix64(seed);
+	}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+	result_type operator()() {
+		uint64_t result = Rotl(s_[0] + s_[3], 23) + s_[0];
+		uint64_t t = s_[1] << 17;
+		s_[2] ^= s_[0];
+		s_[3] ^= s_[1];
+		s_[1] ^= s_[2];
+		s_[0] ^= s_[3];
+		s_[2] ^= t;
+		s_[3] = Rotl(s_[3], 45);
+		return result;
+	}
+
+private:
+	static uint64_t Rotl(uint64_t x, int k) {
+		return (x << k) | (x >> (64 - k));
+	}
+
+private:
+	uint64_t s_[4];
+};
+
+// DropoutSampler: independent drops of a feature stream at a given rate.
+// A draw is cut into four 16-bit lanes, each compared with the rate scaled
+// to 2^16, so four features share one draw and no floating point is
+// involved. The rate is kept to 1/65536.
+class DropoutSampler {
+public:
+	DropoutSampler() : rate_(0), threshold_(0), bits_(0), lanes_(0) {
+	}
+
+	void Reset(double rate) {
+		rate_ = rate;
+		double threshold = std::floor(rate * kLaneRange + 0.5);
+		threshold_ = static_cast<uint32_t>(std::min(std::max(threshold, 0.), (double)kLaneRange));
+		lanes_ = 0;
+	}
+
+	double rate() const { return rate_; }
+
+	bool Drop(Xoshiro256& rng) {
+		if (lanes_ == 0) {
+			bits_ = rng();
+			lanes_ = kLanes;
+		}
+
+		uint32_t lane = static_cast<uint32_t>(bits_ & (kLaneRange - 1));
+		bits_ >>= kLaneBits;
+		--lanes_;
+		return lane < threshold_;
+	}
+
+private:
+	enum { kLaneBits = 16, kLanes = 64 / kLaneBits, kLaneRange = 1 << kLaneBits };
+
+	double rate_;
+	uint32_t threshold_;
+	uint64_t bits_;
+	size_t lanes_;
+};
+
+#endif // SRC_FAST_RANDOM_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,128 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#ifndef SRC_FEATURE_ADMISSION_H
+#define SRC_FEATURE_ADMISSION_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "src/param_alloc.h"
+
+enum { kDefaultAdmitBits = 24, kMinAdmitBits = 10, kMaxAdmitBits = 34, kMaxAdmitCount = 255 };
+
+// FeatureAdmission: count-min sketch of feature occurrences, a feature is
+// admitted to the model once it has been counted min_count times, so rare
+// features never get state. The counters of a feature share a cache line
+// and saturate at min_count, which keeps counts independent of the order
+// threads add them in. Collisions can only admit a feature early.
+class FeatureAdmission {
+public:
+	FeatureAdmission() : counters_(NULL), line_mask_(0), min_count_(0) {
+	}
+
+	~FeatureAdmission() {
+		param_free(counters_);
+	}
+
+	// 2^bits one-byte counters
+	bool Initialize(size_t min_count, size_t bits) {
+		if (min_count == 0 || min_count > kMaxAdmitCount
+				|| bits < kMinAdmitBits || bits > kMaxAdmitBits) {
+			return false;
+		}
+
+		size_t bytes = (size_t)1 << bits;
+		void* ptr = param_alloc(bytes);
+		if (!ptr) {
+			return false;
+		}
+
+		param_free(counters_);
+		counters_ = reinterpret_cast<std::atomic<uint8_t>*>(ptr);
+		line_mask_ = bytes / kLineBytes - 1;
+		min_count_ = static_cast<uint8_t>(min_count);
+		return true;
+	}
+
+	size_t min_count() const { return min_count_; }
+
+	// Count an occurrence of idx, true if idx is admitted with it
+	bool Admit(size_t idx) {
+		uint64_t hash = HashKey(idx);
+		std::atomic<uint8_t>* line = Line(hash);
+
+		uint8_t estimate = min_count_;
+		for (size_t r = 0; r < kRows; ++r) {
+			std::atomic<uint8_t>& counter = line[Slot(hash, r)];
+			uint8_t c = counter.load(std::memory_order_relaxed);
+			while (c < min_count_
+					&& !counter.compare_exchange_weak(c, c + 1, std::memory_order_relaxed)) {
+			}
+			if (c < min_count_) ++c;
+			estimate = std::min(estimate, c);
+		}
+
+		return estimate >= min_count_;
+	}
+
+	// idx has been counted min_count times, without counting it again
+	bool Admitted(size_t idx) const {
+		uint64_t hash = HashKey(idx);
+		const std::atomic<uint8_t>* line = Line(hash);
+		for (size_t r = 0; r < kRows; ++r) {
+			if (line[Slot(hash, r)].load(std::memory_order_relaxed) < min_count_) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	enum { kLineBytes = 64, kRows = 4 };
+
+	static uint64_t HashKey(size_t idx) {
+		uint64_t h = idx;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	// low bits pick the line, the top 24 bits a counter of each row in it
+	std::atomic<uint8_t>* Line(uint64_t hash) const {
+		return counters_ + (hash & line_mask_) * kLineBytes;
+	}
+
+	static size_t Slot(uint64_t hash, size_t row) {
+		return row * (kLineBytes / kRows) + ((hash >> (40 + row * 6)) & (kLineBytes / kRows - 1));
+	}
+
+private:
+	std::atomic<uint8_t>* counters_;
+	size_t line_mask_;
+	uint8_t min_count_;
+};
+
+#endif // SRC_FEATURE_ADMISSION_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,84 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_FEATURE_HASH_H
+#define SRC_FEATURE_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Feature hashing shared by training parsers and LRModel, both sides must
+// map a feature name to the same index or served predictions are garbage.
+
+enum { kMinHashBits = 1, kMaxHashBits = 32 };
+
+// MurmurHash64A by Austin Appleby, fixed seed so models stay valid across runs
+inline uint64_t hash_bytes(const char* data, size_t len) {
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	uint64_t h = 0x9747b28c9747b28cULL ^ (len * m);
+
+	const char* p = data;
+	const char* end = data + (len & ~(size_t)7);
+	for (; p != end; p += 8) {
+		uint64_t k;
+		memcpy(&k, p, sizeof(k));
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+		h ^= k;
+		h *= m;
+	}
+
+	switch (len & 7) {
+	case 7: h ^= uint64_t(static_cast<unsigned char>(p[6])) << 48;  // fall through
+	case 6: h ^= uint64_t(static_cast<unsigned char>(p[5])) << 40;  // fall through
+	case 5: h ^= uint64_t(static_cast<unsigned char>(p[4])) << 32;  // fall through
+	case 4: h ^= uint64_t(static_cast<unsigned char>(p[3])) << 24;  // fall through
+	case 3: h ^= uint64_t(static_cast<unsigned char>(p[2])) << 16;  // fall through
+	case 2: h ^= uint64_t(static_cast<unsigned char>(p[1])) << 8;   // fall through
+	case 1: h ^= uint64_t(static_cast<unsigned char>(p[0]));
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+	return h;
+}
+
+// Map feature name in [begin, end) to [1, 2^hash_bits), 0 is kept for bias.
+// Numeric IDs are hashed by their text, so "42" and "042" differ.
+inline size_t hash_feature(const char* begin, const char* end, size_t hash_bits) {
+	uint64_t slots = ((uint64_t)1 << hash_bits) - 1;
+	return static_cast<size_t>(1 + hash_bytes(begin, end - begin) % slots);
+}
+
+inline size_t hash_feature(const std::string& name, size_t hash_bits) {
+	return hash_feature(name.data(), name.data() + name.size(), hash_bits);
+}
+
+inline bool valid_hash_bits(size_t hash_bits) {
+	return hash_bits >= kMinHashBits && hash_bits <= kMaxHashBits;
+}
+
+#endif // SRC_FEATURE_HASH_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
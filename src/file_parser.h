@@ -27,11 +27,13 @@
 #include <utility>
 #include <vector>
 #include "src/lock.h"
+#include "src/feature_hash.h"
+#include "src/sample_tokenizer.h"
 
 template<typename T>
 class FileParserBase {
 public:
-	FileParserBase() {}
+	FileParserBase() : hash_bits_(0) {}
 	virtual ~FileParserBase() {}
 
 public:
@@ -41,8 +43,31 @@ public:
 	virtual bool ReadSample(T& y, std::vector<std::pair<size_t, T> >& x) = 0;
 	virtual bool ReadSampleMultiThread(T& y, std::vector<std::pair<size_t, T> >& x) = 0;
 
+	// Report instance and feature count without a scan, if the format stores them
+	virtual bool ReadProblemInfo(size_t& line_cnt, size_t& feat_num) { return false; }
+
+	// Block access of parsers with random access, call right after OpenFile.
+	// Split input at byte offsets, first is 0 and last is file size
+	virtual bool SetBlockIndex(const std::vector<size_t>& offsets) { return false; }
+
+	// Number of blocks handed out to readers, 0 for streamed input
+	virtual size_t BlockCount() const { return 0; }
+
+	// Hand out blocks in order, a permutation of [0, BlockCount())
+	virtual bool SetBlockOrder(const std::vector<size_t>& order) { return false; }
+
+	// Hash feature names into [1, 2^hash_bits) instead of reading numeric
+	// indices, 0 turns hashing off. Binary files keep their stored indices
+	void SetHashBits(size_t hash_bits) { hash_bits_ = hash_bits; }
+	size_t hash_bits() const { return hash_bits_; }
+
 public:
 	static bool FileExists(const char* path);
+
+	static bool IsBlockOrder(const std::vector<size_t>& order, size_t block_num);
+
+protected:
+	size_t hash_bits_;
 };
 
 // FileParser: parse training file with LIBSVM-format
@@ -108,6 +133,19 @@ bool FileParserBase<T>::FileExists(const char* path) {
 	return false;
 }
 
+template<typename T>
+bool FileParserBase<T>::IsBlockOrder(const std::vector<size_t>& order, size_t block_num) {
+	if (order.size() != block_num) return false;
+
+	std::vector<bool> seen(block_num, false);
+	for (size_t block : order) {
+		if (block >= block_num || seen[block]) return false;
+		seen[block] = true;
+	}
+
+	return true;
+}
+
 
 
 
@@ -195,57 +233,18 @@ char* FileParser<T>::ReadLine(char *buf, size_t& buf_size) {
 	return ReadLineImpl(buf, buf_size);
 }
 
+// Parse a LIBSVM-format line
 template<typename T>
-T string_to_real(const char *nptr, char **endptr);
-
-template<>
-float string_to_real<float> (const char *nptr, char **endptr) {
-	return strtof(nptr, endptr);
-}
-
-template<>
-double string_to_real<double> (const char *nptr, char **endptr) {
-	return strtod(nptr, endptr);
+bool parse_sample(char* buf, T& y,
+		std::vector<std::pair<size_t, T> >& x, size_t hash_bits = 0) {
+	if (buf == NULL) return false;
+	return tokenize_sample(buf, buf + strlen(buf), y, x, hash_bits);
 }
 
 template<typename T>
 bool FileParser<T>::ParseSample(char* buf, T& y,
 		std::vector<std::pair<size_t, T> >& x) {
-	if (buf == NULL) return false;
-
-	char *endptr, *ptr;
-	char *p = strtok_r(buf, " \t\n", &ptr);
-	if (p == NULL) return false;
-
-	y = string_to_real<T> (p, &endptr);
-	if (endptr == p || *endptr != '\0') return false;
-	if (y < 0) y = 0;
-
-	x.clear();
-	// add bias term
-	x.push_back(std::make_pair((size_t)0, (T)1));
-	while (1) {
-		char *idx = strtok_r(NULL, ":", &ptr);
-		char *val = strtok_r(NULL, " \t", &ptr);
-		if (val == NULL) break;
-
-		bool error_found = false;
-		size_t k = (size_t) strtol(idx, &endptr, 10);
-		if (endptr == idx || *endptr != '\0' || static_cast<int>(k) < 0) {
-			error_found = true;
-		}
-
-		T v = string_to_real<T> (val, &endptr);
-		if (endptr == val || (*endptr != '\0' && !isspace(*endptr))) {
-			error_found = true;
-		}
-
-		if (!error_found) {
-			x.push_back(std::make_pair(k, v));
-		}
-	}
-
-	return true;
+	return parse_sample(buf, y, x, this->hash_bits_);
 }
 
 template<typename T>
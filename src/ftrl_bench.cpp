@@ -0,0 +1,621 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "src/fast_ftrl_solver.h"
+#include "src/ftrl_solver.h"
+#include "src/ftrl_train.h"
+#include "src/lock.h"
+#include "src/parser_factory.h"
+#include "src/stopwatch.h"
+#include "src/util.h"
+
+// Heap allocations of the process, update mode checks the hot path makes none
+static std::atomic<size_t> g_alloc_count(0);
+
+void* operator new(size_t size) {
+	g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+	void* ptr = malloc(size ? size : 1);
+	if (!ptr) throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+
+void print_usage() {
+	printf("Usage: ./ftrl_bench mode [options]\n"
+		"modes:\n"
+		"parser -f input_file : parse input file only and report throughput\n"
+		"update -f input_file : run single thread updates over samples held in memory,"
+		" by the general and the specialized update path of the solver,"
+		" report throughput and heap allocations per sample after a warm-up pass,"
+		" fails if there are any\n"
+		"groups -f input_file : run async updates of 1, 2, 4 up to --thread workers over"
+		" samples held in memory, for parameter groups of 1 to 64 coordinates each,"
+		" report throughput and train loss\n"
+		"kernel : run single thread updates over random samples with 8 to 256 features"
+		" each, report samples/s of scalar and vector kernels\n"
+		"accuracy [-f input_file] : compare fast_sigmoid, fast_exp and fast_log with the"
+		" exact functions on a dense grid and report their cost, with input file also"
+		" train exact and fast math solvers side by side, fails if errors exceed tolerance\n"
+		"options:\n"
+		"--thread num : set thread num, default is single thread. 0 will use hardware concurrency\n"
+		"--repeat num : set number of repeated runs, default 3\n"
+		"--param-store store : set parameter store of update and groups mode, dense, sparse"
+		" or bf16, default dense\n"
+		"--lock-stripes num : set number of group locks of groups mode, default 65536\n"
+		"--feat-num num : set feature space of kernel mode, default 1048576\n"
+		"--dropout dropout : set dropout rate of update mode, default 0\n"
+		"--huge-pages pages : back parameter arrays with huge pages, thp, explicit or off,"
+		" default off\n"
+		"--numa placement : place parameter arrays, interleave, first-touch or off,"
+		" default off\n"
+		"--double-precision : set to use double precision, default false\n"
+		"--help : print this help\n"
+	);
+}
+
+template<typename T>
+bool bench_parser(const char* input_file, size_t num_threads, size_t repeat) {
+	struct stat st;
+	if (stat(input_file, &st) != 0) {
+		fprintf(stderr, "cannot open %s\n", input_file);
+		return false;
+	}
+	double bytes = static_cast<double>(st.st_size);
+
+	for (size_t r = 0; r < repeat; ++r) {
+		std::unique_ptr<FileParserBase<T> > parser(create_file_parser<T>(input_file));
+		if (!parser->OpenFile(input_file)) {
+			fprintf(stderr, "cannot open %s\n", input_file);
+			return false;
+		}
+
+		size_t count = 0;
+		size_t nnz = 0;
+		SpinLock lock;
+		auto parse_worker = [&](size_t i) {
+			std::vector<std::pair<size_t, T> > local_x;
+			T local_y;
+			size_t local_count = 0;
+			size_t local_nnz = 0;
+			while (parser->ReadSampleMultiThread(local_y, local_x)) {
+				local_nnz += local_x.size();
+				++local_count;
+			} {
+				std::lock_guard<SpinLock> lockguard(lock);
+				count += local_count;
+				nnz += local_nnz;
+			}
+		};
+
+		StopWatch timer;
+		util_parallel_run(parse_worker, num_threads);
+		double elapsed = timer.StopTimer();
+		parser->CloseFile();
+
+		fprintf(stdout,
+			"run=%zu instances=[%zu] nnz=[%zu] time=[%.3f] throughput=[%.3f GB/s] [%.2f M samples/s]\n",
+			r, count, nnz, elapsed,
+			bytes / elapsed / 1e9,
+			count / elapsed / 1e6);
+	}
+
+	return true;
+}
+
+// Time one pass of update over samples, count heap allocations made meanwhile
+template<typename T, typename Func>
+bool run_update_pass(const char* name, size_t run,
+		const std::vector<std::pair<T, std::vector<std::pair<size_t, T> > > >& samples,
+		const Func& update) {
+	size_t alloc_start = g_alloc_count.load();
+	T loss = 0;
+	StopWatch timer;
+	for (auto& sample : samples) {
+		loss += calc_loss(sample.first, update(sample.second, sample.first));
+	}
+	double elapsed = timer.StopTimer();
+	size_t allocs = g_alloc_count.load() - alloc_start;
+
+	fprintf(stdout,
+		"%s run=%zu instances=[%zu] time=[%.3f] [%.2f M samples/s]"
+		" train-loss=[%.6f] allocs=[%zu] [%.4f per sample]\n",
+		name, run, samples.size(), elapsed,
+		samples.size() / elapsed / 1e6,
+		static_cast<float>(loss) / samples.size(),
+		allocs, static_cast<double>(allocs) / samples.size());
+	return allocs == 0;
+}
+
+// Read all samples of input_file, feat_num is one past the largest index
+template<typename T>
+bool load_samples(const char* input_file,
+		std::vector<std::pair<T, std::vector<std::pair<size_t, T> > > >& samples,
+		size_t& feat_num) {
+	std::unique_ptr<FileParserBase<T> > parser(create_file_parser<T>(input_file));
+	if (!parser->OpenFile(input_file)) {
+		fprintf(stderr, "cannot open %s\n", input_file);
+		return false;
+	}
+
+	std::vector<std::pair<size_t, T> > x;
+	T y;
+	feat_num = 0;
+	while (parser->ReadSample(y, x)) {
+		for (auto& item : x) {
+			if (item.first + 1 > feat_num) feat_num = item.first + 1;
+		}
+		samples.push_back(std::make_pair(y, x));
+	}
+	parser->CloseFile();
+	if (samples.empty()) {
+		fprintf(stderr, "no sample in %s\n", input_file);
+		return false;
+	}
+	return true;
+}
+
+template<typename T>
+bool bench_update(const char* input_file, size_t repeat, bool sparse, bool compact,
+		T dropout) {
+	std::vector<std::pair<T, std::vector<std::pair<size_t, T> > > > samples;
+	size_t feat_num = 0;
+	if (!load_samples(input_file, samples, feat_num)) return false;
+
+	FtrlSolver<T> solver;
+	FtrlParamServer<T> param_server;
+	FtrlWorker<T> worker;
+	if (!solver.Initialize(DEFAULT_ALPHA, DEFAULT_BETA, DEFAULT_L1, DEFAULT_L2,
+				sparse ? 0 : feat_num, dropout, sparse, compact)
+			|| !param_server.Initialize(DEFAULT_ALPHA, DEFAULT_BETA, DEFAULT_L1, DEFAULT_L2,
+				sparse ? 0 : feat_num, dropout, sparse, compact)
+			|| !worker.Initialize(&param_server)) {
+		fprintf(stderr, "failed to allocate parameters of %zu features\n", feat_num);
+		return false;
+	}
+
+	// updates specialized to the samples as trainers select them, every
+	// index is below feat_num
+	bool binary = true;
+	for (auto& sample : samples) {
+		for (auto& item : sample.second) binary = binary && item.second == 1;
+	}
+	worker.SelectUpdate(binary, !sparse);
+
+	FtrlScratch<T> scratch;
+	auto solver_update = [&] (const std::vector<std::pair<size_t, T> >& x, T y) {
+		return solver.Update(x, y, scratch);
+	};
+	auto worker_update = [&] (const std::vector<std::pair<size_t, T> >& x, T y) {
+		return worker.Update(x, y, &param_server, scratch);
+	};
+
+	// warm-up grows scratch buffers and the sparse store to their final size
+	run_update_pass("solver-warmup", 0, samples, solver_update);
+	run_update_pass("worker-warmup", 0, samples, worker_update);
+
+	bool suc = true;
+	for (size_t r = 0; r < repeat; ++r) {
+		solver.SelectUpdate(false, false);
+		suc = run_update_pass("solver-general", r, samples, solver_update) && suc;
+		solver.SelectUpdate(binary, !sparse);
+		suc = run_update_pass("solver", r, samples, solver_update) && suc;
+		suc = run_update_pass("worker", r, samples, worker_update) && suc;
+	}
+
+	if (!suc) {
+		fprintf(stderr, "heap allocations found in steady-state updates\n");
+	}
+	return suc;
+}
+
+// Best pass of num_threads workers updating a server of groups of group_size
+// coordinates, worker i takes every num_threads-th sample from i
+template<typename T>
+void bench_group_size(
+		const std::vector<std::pair<T, std::vector<std::pair<size_t, T> > > >& samples,
+		size_t feat_num, bool binary, bool sparse, bool compact, size_t num_threads,
+		size_t group_size, size_t lock_stripes, size_t repeat) {
+	double best = 0;
+	double loss = 0;
+	size_t locks = 0;
+	for (size_t r = 0; r < std::max(repeat, (size_t)1); ++r) {
+		FtrlParamServer<T> param_server;
+		param_server.set_group_size(group_size);
+		param_server.set_lock_stripes(lock_stripes);
+		std::vector<FtrlWorker<T> > workers(num_threads);
+		bool suc = param_server.Initialize(DEFAULT_ALPHA, DEFAULT_BETA, DEFAULT_L1, DEFAULT_L2,
+			sparse ? 0 : feat_num, 0, sparse, compact);
+		for (size_t i = 0; i < num_threads && suc; ++i) {
+			suc = workers[i].Initialize(&param_server);
+			workers[i].SelectUpdate(binary, !sparse);
+		}
+		if (!suc) {
+			fprintf(stderr, "failed to allocate parameters of %zu features\n", feat_num);
+			return;
+		}
+
+		std::vector<double> losses(num_threads, 0);
+		auto worker_func = [&] (size_t i) {
+			FtrlScratch<T> scratch;
+			for (size_t k = i; k < samples.size(); k += num_threads) {
+				T pred = workers[i].Update(samples[k].second, samples[k].first,
+					&param_server, scratch);
+				losses[i] += calc_loss(samples[k].first, pred);
+			}
+			workers[i].PushParam(&param_server);
+		};
+
+		StopWatch timer;
+		util_parallel_run(worker_func, num_threads);
+		double rate = samples.size() / timer.StopTimer();
+		if (rate > best) {
+			best = rate;
+			loss = 0;
+			for (double l : losses) loss += l;
+			loss /= samples.size();
+		}
+		locks = param_server.lock_num();
+		group_size = param_server.group_size();
+	}
+
+	fprintf(stdout, "threads=[%zu] group=[%zu] locks=[%zu] [%.2f M samples/s]"
+		" train-loss=[%.6f]\n", num_threads, group_size, locks, best / 1e6, loss);
+}
+
+template<typename T>
+bool bench_groups(const char* input_file, size_t num_threads, size_t repeat,
+		bool sparse, bool compact, size_t lock_stripes) {
+	std::vector<std::pair<T, std::vector<std::pair<size_t, T> > > > samples;
+	size_t feat_num = 0;
+	if (!load_samples(input_file, samples, feat_num)) return false;
+
+	bool binary = true;
+	for (auto& sample : samples) {
+		for (auto& item : sample.second) binary = binary && item.second == 1;
+	}
+
+	if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+	for (size_t threads = 1; ; threads = std::min(threads * 2, num_threads)) {
+		for (size_t group_size = 1; group_size <= 64; group_size *= 2) {
+			bench_group_size(samples, feat_num, binary, sparse, compact, threads,
+				group_size, lock_stripes, repeat);
+		}
+		if (threads == num_threads) break;
+	}
+	return true;
+}
+
+// Tolerances of bench_accuracy: absolute error of sigmoid, relative error of
+// exp and of the log loss, absolute gap of mean train loss between solvers
+#define SIGMOID_TOLERANCE 1e-6
+#define EXP_TOLERANCE 1e-6
+#define LOSS_TOLERANCE 1e-6
+#define TRAIN_LOSS_TOLERANCE 1e-4
+
+// Best time per call of func over inputs, in ns
+template<typename T, typename Func>
+double time_per_call(const std::vector<T>& inputs, size_t repeat, const Func& func) {
+	double best = 0;
+	volatile T sink = 0;
+	for (size_t r = 0; r < std::max(repeat, (size_t)1); ++r) {
+		T sum = 0;
+		StopWatch timer;
+		for (T v : inputs) {
+			sum += func(v);
+		}
+		double elapsed = timer.StopTimer() * 1e9 / inputs.size();
+		if (r == 0 || elapsed < best) best = elapsed;
+		sink = sink + sum;
+	}
+	return best;
+}
+
+bool report_accuracy(const char* name, double err, double tolerance,
+		double exact_ns, double fast_ns) {
+	bool suc = err <= tolerance;
+	fprintf(stdout, "%s max-error=[%.3g] tolerance=[%.3g] exact=[%.2f ns] fast=[%.2f ns]"
+		" speedup=[%.2f] %s\n", name, err, tolerance, exact_ns, fast_ns,
+		exact_ns / fast_ns, suc ? "ok" : "FAILED");
+	return suc;
+}
+
+template<typename T>
+bool bench_accuracy(const char* input_file, size_t repeat) {
+	enum { kGridSize = 1 << 22 };
+	bool suc = true;
+
+	// sigmoid and exp over the range of safe_exp and a little beyond, errors
+	// against double precision libm
+	std::vector<T> xs(kGridSize);
+	for (size_t i = 0; i < xs.size(); ++i) {
+		xs[i] = static_cast<T>(-40. + 80. * i / (xs.size() - 1));
+	}
+	double sigmoid_err = 0;
+	double exp_err = 0;
+	for (T v : xs) {
+		double exact = sigmoid(static_cast<double>(v));
+		sigmoid_err = std::max(sigmoid_err, std::fabs(fast_sigmoid(v) - exact));
+		exact = safe_exp(static_cast<double>(v));
+		exp_err = std::max(exp_err, std::fabs(fast_exp(v) - exact) / exact);
+	}
+	suc = report_accuracy("sigmoid", sigmoid_err, SIGMOID_TOLERANCE,
+		time_per_call(xs, repeat, [](T v) { return sigmoid(v); }),
+		time_per_call(xs, repeat, [](T v) { return fast_sigmoid(v); })) && suc;
+	suc = report_accuracy("exp", exp_err, EXP_TOLERANCE,
+		time_per_call(xs, repeat, [](T v) { return safe_exp(v); }),
+		time_per_call(xs, repeat, [](T v) { return fast_exp(v); })) && suc;
+
+	// log loss of predictions spread log-uniformly over (MIN_SIGMOID, 1], error
+	// relative to the loss where it exceeds 1, absolute below
+	std::vector<T> preds(kGridSize);
+	for (size_t i = 0; i < preds.size(); ++i) {
+		preds[i] = static_cast<T>(std::exp(std::log(MIN_SIGMOID) * i / (preds.size() - 1)));
+	}
+	double loss_err = 0;
+	for (T p : preds) {
+		double exact = calc_loss(1., static_cast<double>(p));
+		double err = std::fabs(calc_loss_fast((T)1, p) - exact) / std::max(exact, 1.);
+		loss_err = std::max(loss_err, err);
+	}
+	suc = report_accuracy("log-loss", loss_err, LOSS_TOLERANCE,
+		time_per_call(preds, repeat, [](T p) { return calc_loss((T)1, p); }),
+		time_per_call(preds, repeat, [](T p) { return calc_loss_fast((T)1, p); })) && suc;
+
+	if (input_file == NULL) return suc;
+
+	std::vector<std::pair<T, std::vector<std::pair<size_t, T> > > > samples;
+	size_t feat_num = 0;
+	if (!load_samples(input_file, samples, feat_num)) return false;
+
+	// one pass of progressive validation, each solver scored before its update
+	FtrlSolver<T> solver[2];
+	double loss[2] = {0, 0};
+	double pred_gap = 0;
+	for (int fast = 0; fast < 2; ++fast) {
+		if (!solver[fast].Initialize(DEFAULT_ALPHA, DEFAULT_BETA, DEFAULT_L1, DEFAULT_L2,
+				feat_num, 0)) {
+			fprintf(stderr, "failed to allocate parameters of %zu features\n", feat_num);
+			return false;
+		}
+		solver[fast].set_fast_math(fast == 1);
+	}
+	FtrlScratch<T> scratch;
+	for (auto& sample : samples) {
+		T pred[2];
+		for (int fast = 0; fast < 2; ++fast) {
+			pred[fast] = solver[fast].Update(sample.second, sample.first, scratch);
+			loss[fast] += calc_loss(sample.first, pred[fast]);
+		}
+		pred_gap = std::max(pred_gap, std::fabs(static_cast<double>(pred[1] - pred[0])));
+	}
+	loss[0] /= samples.size();
+	loss[1] /= samples.size();
+	double loss_gap = std::fabs(loss[1] - loss[0]);
+	bool train_suc = loss_gap <= TRAIN_LOSS_TOLERANCE;
+	fprintf(stdout, "train instances=[%zu] exact-loss=[%.6f] fast-loss=[%.6f] gap=[%.3g]"
+		" tolerance=[%.3g] max-pred-gap=[%.3g] %s\n", samples.size(), loss[0], loss[1],
+		loss_gap, TRAIN_LOSS_TOLERANCE, pred_gap, train_suc ? "ok" : "FAILED");
+	return suc && train_suc;
+}
+
+template<typename T>
+bool bench_kernel(size_t feat_num, size_t repeat) {
+	enum { kTotalNnz = 1 << 23 };
+	const size_t feat_counts[] = {8, 16, 32, 64, 128, 256};
+
+	FtrlSolver<T> solver;
+	if (feat_num == 0 || !solver.Initialize(DEFAULT_ALPHA, DEFAULT_BETA,
+			DEFAULT_L1, DEFAULT_L2, feat_num, 0)) {
+		fprintf(stderr, "failed to allocate parameters of %zu features\n", feat_num);
+		return false;
+	}
+
+	fprintf(stdout, "simd=[%s] feat_num=[%zu]\n", ftrl_simd_name(), feat_num);
+	fprintf(stdout, "%s\n", param_alloc_report().c_str());
+	std::mt19937 rng(1);
+	std::uniform_int_distribution<size_t> feat_dist(1, feat_num - 1);
+	FtrlScratch<T> scratch;
+	for (size_t feats : feat_counts) {
+		// same number of coordinates for every sample size
+		std::vector<std::vector<std::pair<size_t, T> > > samples(kTotalNnz / feats);
+		std::vector<T> labels(samples.size());
+		for (size_t i = 0; i < samples.size(); ++i) {
+			samples[i].push_back(std::make_pair((size_t)0, (T)1));
+			for (size_t k = 1; k < feats; ++k) {
+				samples[i].push_back(std::make_pair(feat_dist(rng), (T)1));
+			}
+			labels[i] = (T)(rng() & 1);
+		}
+
+		double rate[2] = {0, 0};
+		for (int simd = 0; simd < 2; ++simd) {
+			solver.set_simd(simd == 1);
+			for (size_t r = 0; r < repeat; ++r) {
+				StopWatch timer;
+				for (size_t i = 0; i < samples.size(); ++i) {
+					solver.Update(samples[i], labels[i], scratch);
+				}
+				rate[simd] = std::max(rate[simd], samples.size() / timer.StopTimer());
+			}
+		}
+
+		fprintf(stdout, "features=[%zu] scalar=[%.2f M samples/s] simd=[%.2f M samples/s]"
+			" speedup=[%.2f]\n", feats, rate[0] / 1e6, rate[1] / 1e6, rate[1] / rate[0]);
+	}
+
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	int opt;
+	int opt_idx = 0;
+
+	static struct option long_options[] = {
+		{"thread", required_argument, NULL, 'n'},
+		{"repeat", required_argument, NULL, 'r'},
+		{"param-store", required_argument, NULL, 'w'},
+		{"feat-num", required_argument, NULL, 'k'},
+		{"dropout", required_argument, NULL, 'd'},
+		{"lock-stripes", required_argument, NULL, 'l'},
+		{"huge-pages", required_argument, NULL, 'F'},
+		{"numa", required_argument, NULL, 'G'},
+		{"double-precision", no_argument, NULL, 'x'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	if (argc < 2) {
+		print_usage();
+		exit(1);
+	}
+	std::string mode = argv[1];
+
+	std::string input_file;
+	size_t num_threads = 1;
+	size_t repeat = 3;
+	bool double_precision = false;
+	bool sparse = false;
+	bool compact = false;
+	double dropout = 0;
+	size_t feat_num = 1 << 20;
+	size_t lock_stripes = kDefaultLockStripes;
+
+	optind = 2;
+	while ((opt = getopt_long(argc, argv, "f:h", long_options, &opt_idx)) != -1) {
+		switch (opt) {
+		case 'f':
+			input_file = optarg;
+			break;
+		case 'n':
+			num_threads = (size_t)atoi(optarg);
+			break;
+		case 'r':
+			repeat = (size_t)atoi(optarg);
+			break;
+		case 'x':
+			double_precision = true;
+			break;
+		case 'w':
+			sparse = strcmp(optarg, "sparse") == 0;
+			compact = strcmp(optarg, "bf16") == 0;
+			break;
+		case 'k':
+			feat_num = (size_t)atol(optarg);
+			break;
+		case 'd':
+			dropout = atof(optarg);
+			break;
+		case 'l':
+			lock_stripes = std::max((size_t)atol(optarg), (size_t)1);
+			break;
+		case 'F':
+			if (!parse_param_pages(optarg, param_alloc_policy().pages)) {
+				fprintf(stderr, "huge pages must be thp, explicit or off\n");
+				exit(1);
+			}
+			break;
+		case 'G':
+			if (!parse_param_numa(optarg, param_alloc_policy().numa)) {
+				fprintf(stderr, "numa placement must be interleave, first-touch or off\n");
+				exit(1);
+			}
+			break;
+		case 'h':
+		default:
+			print_usage();
+			exit(0);
+		}
+	}
+
+	bool suc = false;
+	if (mode == "parser") {
+		if (input_file.size() == 0) {
+			print_usage();
+			exit(1);
+		}
+
+		if (double_precision) {
+			suc = bench_parser<double>(input_file.c_str(), num_threads, repeat);
+		} else {
+			suc = bench_parser<float>(input_file.c_str(), num_threads, repeat);
+		}
+	} else if (mode == "update") {
+		if (input_file.size() == 0) {
+			print_usage();
+			exit(1);
+		}
+
+		if (double_precision) {
+			suc = bench_update<double>(input_file.c_str(), repeat, sparse, compact, dropout);
+		} else {
+			suc = bench_update<float>(input_file.c_str(), repeat, sparse, compact, dropout);
+		}
+	} else if (mode == "groups") {
+		if (input_file.size() == 0) {
+			print_usage();
+			exit(1);
+		}
+
+		if (double_precision) {
+			suc = bench_groups<double>(input_file.c_str(), num_threads, repeat, sparse,
+				compact, lock_stripes);
+		} else {
+			suc = bench_groups<float>(input_file.c_str(), num_threads, repeat, sparse,
+				compact, lock_stripes);
+		}
+	} else if (mode == "kernel") {
+		if (double_precision) {
+			suc = bench_kernel<double>(feat_num, repeat);
+		} else {
+			suc = bench_kernel<float>(feat_num, repeat);
+		}
+	} else if (mode == "accuracy") {
+		const char* path = input_file.empty() ? NULL : input_file.c_str();
+		if (double_precision) {
+			suc = bench_accuracy<double>(path, repeat);
+		} else {
+			suc = bench_accuracy<float>(path, repeat);
+		}
+	} else {
+		print_usage();
+		exit(1);
+	}
+
+	return suc ? 0 : 1;
+}
+/* vim: set ts=4 sw=4 tw=0 noet :*/
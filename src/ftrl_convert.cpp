@@ -0,0 +1,192 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "src/binary_file_parser.h"
+#include "src/ftrl_solver.h"
+#include "src/model_file.h"
+#include "src/parser_factory.h"
+#include "src/stopwatch.h"
+
+void print_usage() {
+	printf("Usage: ./ftrl_convert -f input_file -o output_file [options]\n"
+		"   or: ./ftrl_convert --compact base_state -o output_file delta...\n"
+		"Convert LibSVM file to binary format read directly by ftrl_train and ftrl_predict,"
+		" or merge deltas saved by ftrl_train into the binary state they apply to\n"
+		"options:\n"
+		"-f input_file : set LibSVM input file. You can read sample from stdin by set '-f stdin'\n"
+		"-o output_file : set binary output file\n"
+		"--index64 : store feature index with 64 bits, default 32 bits\n"
+		"--hash-bits bits : hash feature names into 2^bits indices, see ftrl_train\n"
+		"--compact base_state : apply the deltas given after the options, in order,"
+		" to base_state and save the result to output_file\n"
+		"--help : print this help\n"
+	);
+}
+
+// Load base, apply deltas of it in order and save the state to output
+template<typename T>
+bool compact_state(const char* base, const std::vector<std::string>& deltas,
+		const char* output) {
+	FtrlSolver<T> solver;
+	solver.set_verify_state(true);
+	if (!solver.Initialize(base)) return false;
+
+	for (const std::string& delta : deltas) {
+		ModelFileHeader header;
+		if (!read_model_header(delta.c_str(), header)) {
+			fprintf(stderr, "%s is not a binary delta\n", delta.c_str());
+			return false;
+		}
+		if (header.base_checksum != solver.loaded_checksum()) {
+			fprintf(stderr, "%s is a delta of another state than %s\n", delta.c_str(), base);
+			return false;
+		}
+		if (!solver.ApplyDelta(delta.c_str())) return false;
+	}
+
+	return solver.SaveModelDetail(output);
+}
+
+int main(int argc, char* argv[]) {
+	int opt;
+	int opt_idx = 0;
+
+	static struct option long_options[] = {
+		{"index64", no_argument, NULL, 'w'},
+		{"hash-bits", required_argument, NULL, 'y'},
+		{"compact", required_argument, NULL, 'c'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	std::string input_file;
+	std::string output_file;
+	bool index64 = false;
+	size_t hash_bits = 0;
+	std::string base_state;
+
+	while ((opt = getopt_long(argc, argv, "f:o:h", long_options, &opt_idx)) != -1) {
+		switch (opt) {
+		case 'f':
+			input_file = optarg;
+			break;
+		case 'o':
+			output_file = optarg;
+			break;
+		case 'w':
+			index64 = true;
+			break;
+		case 'y':
+			hash_bits = (size_t)atoi(optarg);
+			if (!valid_hash_bits(hash_bits)) {
+				fprintf(stderr, "hash bits must be in [%d, %d]\n", kMinHashBits, kMaxHashBits);
+				exit(1);
+			}
+			break;
+		case 'c':
+			base_state = optarg;
+			break;
+		case 'h':
+		default:
+			print_usage();
+			exit(0);
+		}
+	}
+
+	if (base_state.size() > 0 && output_file.size() > 0) {
+		ModelFileHeader header;
+		if (!read_model_header(base_state.c_str(), header) || !header.is_state()) {
+			fprintf(stderr, "%s is not a binary state\n", base_state.c_str());
+			exit(1);
+		}
+
+		std::vector<std::string> deltas(argv + optind, argv + argc);
+		StopWatch timer;
+		// deltas hold FtrlParam of the real type, value_bytes of a bf16 state
+		// tells it only in files of older builds, which saved float ones
+		bool real_double = header.real_bytes != 0 ? header.real_bytes == sizeof(double)
+			: header.value_bytes == sizeof(FtrlParam<double>);
+		bool suc = real_double
+			? compact_state<double>(base_state.c_str(), deltas, output_file.c_str())
+			: compact_state<float>(base_state.c_str(), deltas, output_file.c_str());
+		if (!suc) {
+			fprintf(stderr, "failed to compact %s\n", base_state.c_str());
+			exit(1);
+		}
+
+		fprintf(stdout, "deltas=[%zu] time=[%.2f]\n", deltas.size(), timer.StopTimer());
+		return 0;
+	}
+
+	if (input_file.size() == 0 || output_file.size() == 0) {
+		print_usage();
+		exit(1);
+	}
+
+	std::unique_ptr<FileParserBase<float> > parser(
+		create_file_parser<float>(input_file.c_str(), hash_bits));
+	if (!parser->OpenFile(input_file.c_str())) {
+		fprintf(stderr, "cannot open %s\n", input_file.c_str());
+		exit(1);
+	}
+
+	BinaryFileWriter writer;
+	if (!writer.Open(output_file.c_str(), index64)) {
+		fprintf(stderr, "cannot open %s\n", output_file.c_str());
+		exit(1);
+	}
+
+	StopWatch timer;
+	std::vector<std::pair<size_t, float> > x;
+	float y;
+	while (parser->ReadSample(y, x)) {
+		if (!writer.Write(y, x)) {
+			fprintf(stderr, "\nfailed to write sample %zu, "
+				"use --index64 for feature index beyond 32 bits\n", writer.line_cnt());
+			exit(1);
+		}
+
+		if (writer.line_cnt() % 1000000 == 0) {
+			fprintf(stdout, "converted=[%zu] time=[%.2f]\r",
+				writer.line_cnt(), timer.StopTimer());
+			fflush(stdout);
+		}
+	}
+	parser->CloseFile();
+
+	size_t line_cnt = writer.line_cnt();
+	size_t feat_num = writer.feat_num();
+	if (!writer.Close()) {
+		fprintf(stderr, "\nfailed to write %s\n", output_file.c_str());
+		exit(1);
+	}
+
+	fprintf(stdout, "instances=[%zu] features=[%zu] time=[%.2f]\n",
+		line_cnt, feat_num, timer.StopTimer());
+	return 0;
+}
+/* vim: set ts=4 sw=4 tw=0 noet :*/
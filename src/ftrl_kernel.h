@@ -0,0 +1,321 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_FTRL_KERNEL_H
+#define SRC_FTRL_KERNEL_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+// gcc 12 reports _mm512_undefined_* placeholders inside the intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+// Branch-free FTRL-Proximal kernels over the coordinates of one sample,
+// packed into arrays by the solver. AVX-512 or AVX2 is used when the build
+// targets it (-march=native), the scalar loop otherwise and for tails.
+// With kBinary all feature values are 1 and v is not read.
+
+template<typename T>
+struct FtrlKernelParam {
+	T alpha;
+	T beta;
+	T l1;
+	T l2;
+};
+
+// Weight of one coordinate, zero when |z| <= l1 as util_less_equal decides
+template<typename T>
+inline T ftrl_weight(T n, T z, const FtrlKernelParam<T>& p) {
+	T abs_z = std::fabs(z);
+	T w = (std::copysign(p.l1, z) - z) / ((p.beta + std::sqrt(n)) / p.alpha + p.l2);
+	return abs_z - p.l1 < std::numeric_limits<T>::epsilon() ? 0 : w;
+}
+
+// w[k] from n[k], z[k] for k < num, returns sum of w[k] * v[k]
+template<bool kBinary, typename T>
+T ftrl_weights_scalar(const T* n, const T* z, const T* v, size_t num,
+		const FtrlKernelParam<T>& p, T* w) {
+	T wTx = 0;
+	for (size_t k = 0; k < num; ++k) {
+		w[k] = ftrl_weight(n[k], z[k], p);
+		wTx += kBinary ? w[k] : w[k] * v[k];
+	}
+	return wTx;
+}
+
+// With g = grad * v[k], replace n[k] by the increment g^2 and z[k] by
+// g - sigma * w[k]. sigma = (sqrt(n + g^2) - sqrt(n)) / alpha is taken as
+// g^2 / ((sqrt(n + g^2) + sqrt(n)) * alpha), which does not cancel in
+// float once n is large; the floor keeps 0 / 0 out when n = g = 0.
+template<bool kBinary, typename T>
+void ftrl_deltas_scalar(T* n, T* z, const T* w, const T* v, T grad,
+		size_t num, T alpha) {
+	const T floor = std::numeric_limits<T>::min();
+	for (size_t k = 0; k < num; ++k) {
+		T g = kBinary ? grad : grad * v[k];
+		T g2 = g * g;
+		T sigma = g2 / std::max((std::sqrt(n[k] + g2) + std::sqrt(n[k])) * alpha, floor);
+		z[k] = g - sigma * w[k];
+		n[k] = g2;
+	}
+}
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+
+// Lane operations shared by the vector kernels
+template<typename T>
+struct SimdOps;
+
+#if defined(__AVX512F__)
+
+template<>
+struct SimdOps<float> {
+	typedef __m512 V;
+	enum { kWidth = 16 };
+	static V load(const float* p) { return _mm512_loadu_ps(p); }
+	static void store(float* p, V a) { _mm512_storeu_ps(p, a); }
+	static V set1(float a) { return _mm512_set1_ps(a); }
+	static V zero() { return _mm512_setzero_ps(); }
+	static V add(V a, V b) { return _mm512_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm512_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm512_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm512_div_ps(a, b); }
+	static V max(V a, V b) { return _mm512_max_ps(a, b); }
+	static V sqrt(V a) { return _mm512_sqrt_ps(a); }
+	static V fmadd(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+	static V fnmadd(V a, V b, V c) { return _mm512_fnmadd_ps(a, b, c); }
+	static V abs(V a) { return _mm512_abs_ps(a); }
+	// magnitude of a with sign of b
+	static V copysign(V a, V b) {
+		const __m512i sign = _mm512_set1_epi32(0x80000000);
+		return _mm512_castsi512_ps(_mm512_or_si512(
+			_mm512_andnot_si512(sign, _mm512_castps_si512(a)),
+			_mm512_and_si512(sign, _mm512_castps_si512(b))));
+	}
+	// a < b ? 0 : w
+	static V zero_if_less(V a, V b, V w) {
+		return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(a, b, _CMP_NLT_UQ), w);
+	}
+	static float sum(V a) { return _mm512_reduce_add_ps(a); }
+};
+
+template<>
+struct SimdOps<double> {
+	typedef __m512d V;
+	enum { kWidth = 8 };
+	static V load(const double* p) { return _mm512_loadu_pd(p); }
+	static void store(double* p, V a) { _mm512_storeu_pd(p, a); }
+	static V set1(double a) { return _mm512_set1_pd(a); }
+	static V zero() { return _mm512_setzero_pd(); }
+	static V add(V a, V b) { return _mm512_add_pd(a, b); }
+	static V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+	static V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+	static V div(V a, V b) { return _mm512_div_pd(a, b); }
+	static V max(V a, V b) { return _mm512_max_pd(a, b); }
+	static V sqrt(V a) { return _mm512_sqrt_pd(a); }
+	static V fmadd(V a, V b, V c) { return _mm512_fmadd_pd(a, b, c); }
+	static V fnmadd(V a, V b, V c) { return _mm512_fnmadd_pd(a, b, c); }
+	static V abs(V a) { return _mm512_abs_pd(a); }
+	static V copysign(V a, V b) {
+		const __m512i sign = _mm512_set1_epi64(0x8000000000000000LL);
+		return _mm512_castsi512_pd(_mm512_or_si512(
+			_mm512_andnot_si512(sign, _mm512_castpd_si512(a)),
+			_mm512_and_si512(sign, _mm512_castpd_si512(b))));
+	}
+	static V zero_if_less(V a, V b, V w) {
+		return _mm512_maskz_mov_pd(_mm512_cmp_pd_mask(a, b, _CMP_NLT_UQ), w);
+	}
+	static double sum(V a) { return _mm512_reduce_add_pd(a); }
+};
+
+#else
+
+template<>
+struct SimdOps<float> {
+	typedef __m256 V;
+	enum { kWidth = 8 };
+	static V load(const float* p) { return _mm256_loadu_ps(p); }
+	static void store(float* p, V a) { _mm256_storeu_ps(p, a); }
+	static V set1(float a) { return _mm256_set1_ps(a); }
+	static V zero() { return _mm256_setzero_ps(); }
+	static V add(V a, V b) { return _mm256_add_ps(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static V div(V a, V b) { return _mm256_div_ps(a, b); }
+	static V max(V a, V b) { return _mm256_max_ps(a, b); }
+	static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+#if defined(__FMA__)
+	static V fmadd(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+	static V fnmadd(V a, V b, V c) { return _mm256_fnmadd_ps(a, b, c); }
+#else
+	static V fmadd(V a, V b, V c) { return add(mul(a, b), c); }
+	static V fnmadd(V a, V b, V c) { return sub(c, mul(a, b)); }
+#endif
+	static V abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a); }
+	static V copysign(V a, V b) {
+		const V sign = _mm256_set1_ps(-0.f);
+		return _mm256_or_ps(_mm256_andnot_ps(sign, a), _mm256_and_ps(sign, b));
+	}
+	static V zero_if_less(V a, V b, V w) {
+		return _mm256_andnot_ps(_mm256_cmp_ps(a, b, _CMP_LT_OQ), w);
+	}
+	static float sum(V a) {
+		__m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+		s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+		s = _mm_add_ss(s, _mm_movehdup_ps(s));
+		return _mm_cvtss_f32(s);
+	}
+};
+
+template<>
+struct SimdOps<double> {
+	typedef __m256d V;
+	enum { kWidth = 4 };
+	static V load(const double* p) { return _mm256_loadu_pd(p); }
+	static void store(double* p, V a) { _mm256_storeu_pd(p, a); }
+	static V set1(double a) { return _mm256_set1_pd(a); }
+	static V zero() { return _mm256_setzero_pd(); }
+	static V add(V a, V b) { return _mm256_add_pd(a, b); }
+	static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+	static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+	static V div(V a, V b) { return _mm256_div_pd(a, b); }
+	static V max(V a, V b) { return _mm256_max_pd(a, b); }
+	static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+#if defined(__FMA__)
+	static V fmadd(V a, V b, V c) { return _mm256_fmadd_pd(a, b, c); }
+	static V fnmadd(V a, V b, V c) { return _mm256_fnmadd_pd(a, b, c); }
+#else
+	static V fmadd(V a, V b, V c) { return add(mul(a, b), c); }
+	static V fnmadd(V a, V b, V c) { return sub(c, mul(a, b)); }
+#endif
+	static V abs(V a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.), a); }
+	static V copysign(V a, V b) {
+		const V sign = _mm256_set1_pd(-0.);
+		return _mm256_or_pd(_mm256_andnot_pd(sign, a), _mm256_and_pd(sign, b));
+	}
+	static V zero_if_less(V a, V b, V w) {
+		return _mm256_andnot_pd(_mm256_cmp_pd(a, b, _CMP_LT_OQ), w);
+	}
+	static double sum(V a) {
+		__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a), _mm256_extractf128_pd(a, 1));
+		return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+	}
+};
+
+#endif  // __AVX512F__
+
+#define FTRL_SIMD_KERNELS 1
+
+template<bool kBinary, typename T>
+T ftrl_weights_simd(const T* n, const T* z, const T* v, size_t num,
+		const FtrlKernelParam<T>& p, T* w) {
+	typedef SimdOps<T> S;
+	typedef typename S::V V;
+	const V alpha = S::set1(p.alpha);
+	const V beta = S::set1(p.beta);
+	const V l1 = S::set1(p.l1);
+	const V l2 = S::set1(p.l2);
+	const V eps = S::set1(std::numeric_limits<T>::epsilon());
+
+	V acc = S::zero();
+	size_t k = 0;
+	for (; k + S::kWidth <= num; k += S::kWidth) {
+		V vn = S::load(n + k);
+		V vz = S::load(z + k);
+		V denom = S::add(S::div(S::add(beta, S::sqrt(vn)), alpha), l2);
+		V vw = S::div(S::sub(S::copysign(l1, vz), vz), denom);
+		vw = S::zero_if_less(S::sub(S::abs(vz), l1), eps, vw);
+		S::store(w + k, vw);
+		acc = kBinary ? S::add(vw, acc) : S::fmadd(vw, S::load(v + k), acc);
+	}
+
+	if (!kBinary) v += k;
+	return S::sum(acc) + ftrl_weights_scalar<kBinary>(n + k, z + k, v, num - k, p, w + k);
+}
+
+template<bool kBinary, typename T>
+void ftrl_deltas_simd(T* n, T* z, const T* w, const T* v, T grad,
+		size_t num, T alpha) {
+	typedef SimdOps<T> S;
+	typedef typename S::V V;
+	const V vgrad = S::set1(grad);
+	const V valpha = S::set1(alpha);
+	const V floor = S::set1(std::numeric_limits<T>::min());
+
+	size_t k = 0;
+	for (; k + S::kWidth <= num; k += S::kWidth) {
+		V vn = S::load(n + k);
+		V g = kBinary ? vgrad : S::mul(vgrad, S::load(v + k));
+		V g2 = S::mul(g, g);
+		V denom = S::mul(S::add(S::sqrt(S::add(vn, g2)), S::sqrt(vn)), valpha);
+		V sigma = S::div(g2, S::max(denom, floor));
+		S::store(z + k, S::fnmadd(sigma, S::load(w + k), g));
+		S::store(n + k, g2);
+	}
+
+	if (!kBinary) v += k;
+	ftrl_deltas_scalar<kBinary>(n + k, z + k, w + k, v, grad, num - k, alpha);
+}
+
+#endif  // __AVX512F__ || __AVX2__
+
+// Vector kernels when compiled in, simd is set and num fills a vector,
+// scalar loops otherwise
+template<bool kBinary = false, typename T>
+inline T ftrl_weights(const T* n, const T* z, const T* v, size_t num,
+		const FtrlKernelParam<T>& p, T* w, bool simd) {
+#if defined(FTRL_SIMD_KERNELS)
+	if (simd && num >= SimdOps<T>::kWidth) return ftrl_weights_simd<kBinary>(n, z, v, num, p, w);
+#endif
+	return ftrl_weights_scalar<kBinary>(n, z, v, num, p, w);
+}
+
+template<bool kBinary = false, typename T>
+inline void ftrl_deltas(T* n, T* z, const T* w, const T* v, T grad,
+		size_t num, T alpha, bool simd) {
+#if defined(FTRL_SIMD_KERNELS)
+	if (simd && num >= SimdOps<T>::kWidth) {
+		return ftrl_deltas_simd<kBinary>(n, z, w, v, grad, num, alpha);
+	}
+#endif
+	ftrl_deltas_scalar<kBinary>(n, z, w, v, grad, num, alpha);
+}
+
+// Name of the vector instruction set kernels are built for
+inline const char* ftrl_simd_name() {
+#if defined(__AVX512F__)
+	return "avx512";
+#elif defined(__AVX2__)
+	return "avx2";
+#else
+	return "none";
+#endif
+}
+
+#endif // SRC_FTRL_KERNEL_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
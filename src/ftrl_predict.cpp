@@ -20,16 +20,19 @@
 
 #include <unistd.h>
 #include <cstdlib>
+#include <memory>
 #include <utility>
 #include <vector>
 #include "src/file_parser.h"
 #include "src/ftrl_solver.h"
+#include "src/parser_factory.h"
 #include "src/util.h"
 
 void print_usage(int argc, char* argv[]) {
 	printf("Usage:\n");
-	printf("\t%s -t test_file -m model -o output_file\n", argv[0]);
+	printf("\t%s -t test_file -m model -o output_file [-b hash_bits]\n", argv[0]);
 	printf("\tYou can read test sample from stdin by set '-t stdin'\n");
+	printf("\tSet -b to the --hash-bits the model was trained with\n");
 }
 
 double calc_auc(const std::vector<std::pair<double, unsigned> >& scores) {
@@ -76,8 +79,9 @@ int main(int argc, char* argv[]) {
 	std::string test_file;
 	std::string model_file;
 	std::string output_file;
+	size_t hash_bits = 0;
 
-	while ((ch = getopt(argc, argv, "t:m:o:h")) != -1) {
+	while ((ch = getopt(argc, argv, "t:m:o:b:h")) != -1) {
 		switch (ch) {
 		case 't':
 			test_file = optarg;
@@ -88,6 +92,13 @@ int main(int argc, char* argv[]) {
 		case 'o':
 			output_file = optarg;
 			break;
+		case 'b':
+			hash_bits = (size_t)atoi(optarg);
+			if (!valid_hash_bits(hash_bits)) {
+				fprintf(stderr, "hash bits must be in [%d, %d]\n", kMinHashBits, kMaxHashBits);
+				exit(1);
+			}
+			break;
 		case 'h':
 		default:
 			print_usage(argc, argv);
@@ -101,20 +112,24 @@ int main(int argc, char* argv[]) {
 	}
 
 	LRModel<double> model;
-	model.Initialize(model_file.c_str());
+	if (!model.Initialize(model_file.c_str(), hash_bits)) {
+		fprintf(stderr, "failed to load model %s\n", model_file.c_str());
+		exit(1);
+	}
 
 	double y = 0.;
 	std::vector<std::pair<size_t, double> > x;
 	FILE* wfp = fopen(output_file.c_str(), "w");
 	size_t cnt = 0, correct = 0;
 	double loss = 0.;
-	FileParser<double> parser;
-	parser.OpenFile(test_file.c_str());
+	std::unique_ptr<FileParserBase<double> > parser(
+		create_file_parser<double>(test_file.c_str(), hash_bits));
+	parser->OpenFile(test_file.c_str());
 
 	std::vector<std::pair<double, unsigned> > pred_scores;
 
 	while (1) {
-		bool res = parser.ReadSample(y, x);
+		bool res = parser->ReadSample(y, x);
 		if (!res) break;
 
 		double pred = model.Predict(x);
@@ -149,7 +164,7 @@ int main(int argc, char* argv[]) {
 		printf("AUC = %lf\n", auc);
 	}
 
-	parser.CloseFile();
+	parser->CloseFile();
 	fclose(wfp);
 
 	return 0;
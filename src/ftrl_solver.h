@@ -22,15 +22,24 @@
 #define SRC_FTRL_SOLVER_H
 
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <limits>
-#include <random>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
+#include "src/feature_admission.h"
+#include "src/fast_random.h"
+#include "src/feature_hash.h"
+#include "src/ftrl_kernel.h"
+#include "src/model_file.h"
+#include "src/param_store.h"
+#include "src/sparse_weights.h"
 #include "src/util.h"
 
 #define DEFAULT_ALPHA 0.15
@@ -38,6 +47,78 @@
 #define DEFAULT_L1 1.
 #define DEFAULT_L2 1.
 
+// Per-sample working buffers of Update, owned by the calling thread and
+// reused so that steady-state training does no heap allocation. Coordinates
+// of a sample are packed here for the kernels of ftrl_kernel.h.
+template<typename T>
+struct FtrlScratch {
+	std::vector<size_t> index;
+	std::vector<T> value;
+	// state of coordinates, replaced by their increments
+	std::vector<T> n;
+	std::vector<T> z;
+	std::vector<T> weight;
+
+	// dropout draws of the thread, scratches are seeded in creation order
+	Xoshiro256 rng;
+	DropoutSampler dropout;
+
+	FtrlScratch() : rng(NextSeed()) {}
+
+	void SeedDropout(uint64_t seed) {
+		rng.Seed(seed);
+		dropout.Reset(dropout.rate());
+	}
+
+	bool Drop(double rate) {
+		if (rate != dropout.rate()) dropout.Reset(rate);
+		return dropout.Drop(rng);
+	}
+
+	static uint64_t NextSeed() {
+		static std::atomic<uint64_t> seq(0);
+		return seq++;
+	}
+
+	void Reserve(size_t num) {
+		if (index.size() >= num) return;
+		index.resize(num);
+		value.resize(num);
+		n.resize(num);
+		z.resize(num);
+		weight.resize(num);
+	}
+};
+
+// Compile-time switches of the update path: dropout draws, feature values
+// all 1, and indices that may fall outside the store
+template<bool kDropout, bool kBinary, bool kChecked>
+struct FtrlPolicy {
+	static const bool dropout = kDropout;
+	static const bool binary = kBinary;
+	static const bool checked = kChecked;
+};
+
+// Select::Func instantiated by Select::Get<Policy>() for the policy of the
+// run-time flags, so that they are tested once rather than per feature
+template<class Select, bool kDropout, bool kBinary>
+typename Select::Func select_policy(bool checked) {
+	return checked ? Select::template Get<FtrlPolicy<kDropout, kBinary, true> >()
+		: Select::template Get<FtrlPolicy<kDropout, kBinary, false> >();
+}
+
+template<class Select, bool kDropout>
+typename Select::Func select_policy(bool binary, bool checked) {
+	return binary ? select_policy<Select, kDropout, true>(checked)
+		: select_policy<Select, kDropout, false>(checked);
+}
+
+template<class Select>
+typename Select::Func select_policy(bool dropout, bool binary, bool checked) {
+	return dropout ? select_policy<Select, true>(binary, checked)
+		: select_policy<Select, false>(binary, checked);
+}
+
 template<typename T>
 class FtrlSolver {
 public:
@@ -51,66 +132,219 @@ public:
 		T l1,
 		T l2,
 		size_t n,
-		T dropout = 0);
+		T dropout = 0,
+		bool sparse = false,
+		bool compact = false);
 
+	// State saved by SaveModelDetail, binary state of a dense store is
+	// mapped rather than read
 	virtual bool Initialize(const char* path);
 
+	// Keep features out of the model until counted min_count times by a
+	// sketch of 2^bits counters, solvers sharing admission count together
+	bool InitializeAdmission(size_t min_count, size_t bits);
+	void ShareAdmission(const std::shared_ptr<FeatureAdmission>& admission) {
+		admission_ = admission;
+	}
+	const std::shared_ptr<FeatureAdmission>& admission() { return admission_; }
+
+	// Specialize Update to the training input: binary if every feature value
+	// is 1, in_range if every index fits the store. Initialize selects the
+	// general path, dropout is taken from the solver
+	virtual void SelectUpdate(bool binary, bool in_range);
+	bool binary_input() { return binary_input_; }
+	bool in_range_input() { return in_range_input_; }
+
+	// Update with a scratch of the calling thread
 	virtual T Update(const std::vector<std::pair<size_t, T> >& x, T y);
+	virtual T Update(const std::vector<std::pair<size_t, T> >& x, T y,
+		FtrlScratch<T>& scratch);
 	virtual T Predict(const std::vector<std::pair<size_t, T> >& x);
 
+	// Mini-batch steps: Gradient appends (index, gradient) of the stored
+	// coordinates of x at current weights and returns the prediction,
+	// ApplyGradients takes one FTRL step per index of summed gradients
+	T Gradient(const std::vector<std::pair<size_t, T> >& x, T y,
+		FtrlScratch<T>& scratch, std::vector<std::pair<size_t, T> >& grads);
+	void ApplyGradients(const std::pair<size_t, T>* grads, size_t num,
+		FtrlScratch<T>& scratch);
+
+	// Binary files of model_file.h written in parallel chunks, or text with
+	// set_text_model. The state file of a shared mapping is flushed in place
 	virtual bool SaveModelAll(const char* path);
 	virtual bool SaveModel(const char* path);
 	virtual bool SaveModelDetail(const char* path);
 
+	// State with the input position of training, written by the calling
+	// thread alone while others may go on training, so it may mix updates
+	// made during the copy
+	bool SaveCheckpoint(const char* path, size_t epoch, size_t samples);
+
+	// Checkpoint or delta copied by Take* while no thread trains, so that it
+	// is the state at its input position, and written later by WriteSnapshot
+	struct StateSnapshot {
+		ModelFileHeader header;
+		std::vector<uint64_t> index;
+		std::vector<char> values;
+	};
+	bool TakeCheckpoint(StateSnapshot& snapshot, size_t epoch, size_t samples);
+	bool TakeDelta(StateSnapshot& snapshot, uint8_t channel, uint64_t base_checksum,
+		size_t epoch = 0, size_t samples = 0);
+	bool WriteSnapshot(const char* path, StateSnapshot& snapshot, size_t num_threads = 1);
+
+	// Mark coordinates changed from now on, for SaveDelta
+	bool TrackChanges() { return params_.TrackDirty(); }
+
+	// (index, n, z) of the coordinates changed since the last delta of
+	// channel, a bit of kDirty*, or since TrackChanges. base_checksum is that
+	// of the state it applies to
+	bool SaveDelta(const char* path, uint8_t channel, uint64_t base_checksum,
+		size_t epoch = 0, size_t samples = 0, size_t num_threads = 0);
+
+	// Overwrite coordinates by the records of a delta, header receives its
+	// header if not NULL
+	bool ApplyDelta(const char* path, ModelFileHeader* header = NULL);
+
+	// checksum of the binary state given to Initialize, 0 for text or none
+	uint64_t loaded_checksum() { return loaded_checksum_; }
+
 public:
 	T alpha() { return alpha_; }
 	T beta() { return beta_; }
 	T l1() { return l1_; }
 	T l2() { return l2_; }
-	size_t feat_num() { return feat_num_; }
+	size_t feat_num() { return params_.feat_num(); }
 	T dropout() { return dropout_; }
+	bool sparse() { return params_.sparse(); }
+	bool compact() { return params_.compact(); }
+
+	// vector kernels of ftrl_kernel.h, if built in, or scalar loops
+	bool simd() { return simd_; }
+	void set_simd(bool simd) { simd_ = simd; }
+
+	// fast_sigmoid of util.h rather than the libm one
+	bool fast_math() { return fast_math_; }
+	void set_fast_math(bool fast_math) { fast_math_ = fast_math; }
+
+	// binary state given to Initialize is mapped shared, so updates are
+	// written back to the file by the page cache, rather than copy-on-write
+	bool shared_state() { return shared_state_; }
+	void set_shared_state(bool shared) { shared_state_ = shared; }
+
+	// checksum of a mapped dense state is verified by Initialize, which reads
+	// all of it, otherwise only its size is checked so that it starts at once
+	bool verify_state() { return verify_state_; }
+	void set_verify_state(bool verify) { verify_state_ = verify; }
+
+	// model and state are saved as text, as by older versions
+	bool text_model() { return text_model_; }
+	void set_text_model(bool text) { text_model_ = text; }
+
+	// model holds (index, weight) of non-zero weights only, as it always
+	// does for sparse store
+	bool sparse_model() { return sparse_model_ || params_.sparse(); }
+	void set_sparse_model(bool sparse) { sparse_model_ = sparse; }
 
 protected:
 	enum {kPrecision = 8};
 
 protected:
 	T GetWeight(size_t idx);
+	T GetWeight(const FtrlParam<T>& param);
+
+	bool InitializeState(const char* path, const ModelFileHeader& header);
+
+	// header of a binary model file of this solver, arrays left empty
+	ModelFileHeader ModelHeader(const char* magic);
+	void SetStateLayout(ModelFileHeader& header, size_t count);
+	bool SaveWeights(const char* path);
+	bool SaveState(const char* path);
+	bool WriteState(const char* path, ModelFileHeader& header, size_t num_threads);
+
+	// Copy coordinates [start, start + num) of a dense store to buf as they
+	// are stored, while other threads may update them
+	virtual void CopyParams(size_t start, size_t num, char* buf);
+	// the same, decoded
+	virtual void ReadParams(size_t start, size_t num, FtrlParam<T>* out);
+
+	T Sigmoid(T wTx) const {
+		return fast_math_ ? fast_sigmoid(wTx) : sigmoid(wTx);
+	}
+
+	FtrlKernelParam<T> kernel_param() const {
+		FtrlKernelParam<T> param = {alpha_, beta_, l1_, l2_};
+		return param;
+	}
+
+	// Pack stored coordinates of x into scratch, returns their number.
+	// Dropout draws from scratch. With admit, coordinates without state are
+	// counted and skipped until admitted. Binary policies leave values out
+	template<class Policy>
+	size_t GatherParams(const std::vector<std::pair<size_t, T> >& x,
+		FtrlScratch<T>& scratch, bool admit);
+	size_t GatherParams(const std::vector<std::pair<size_t, T> >& x,
+		FtrlScratch<T>& scratch, bool dropout, bool admit);
+
+	template<class Policy>
+	T UpdateImpl(const std::vector<std::pair<size_t, T> >& x, T y,
+		FtrlScratch<T>& scratch);
+
+	typedef T (FtrlSolver<T>::*UpdateFunc)(const std::vector<std::pair<size_t, T> >&, T,
+		FtrlScratch<T>&);
+
+	struct UpdateSelect {
+		typedef UpdateFunc Func;
+		template<class Policy>
+		static Func Get() { return &FtrlSolver<T>::template UpdateImpl<Policy>; }
+	};
+
+	// stored coordinates sorted by index
+	void SortedParams(std::vector<std::pair<size_t, FtrlParam<T> > >& params);
+
+	// non-zero weights sorted by index, in parallel for dense store
+	void NonZeroWeights(std::vector<uint64_t>& index, std::vector<T>& weights);
 
 protected:
 	T alpha_;
 	T beta_;
 	T l1_;
 	T l2_;
-	size_t feat_num_;
 	T dropout_;
 
-	T * n_;
-	T * z_;
+	// dense array of feat_num coordinates, or hash table of those seen
+	FtrlParamStore<T> params_;
+	std::shared_ptr<FeatureAdmission> admission_;
 
 	bool init_;
-
-	std::mt19937 rand_generator_;
-	std::uniform_real_distribution<T> uniform_dist_;
+	bool simd_;
+	bool fast_math_;
+	bool shared_state_;
+	bool verify_state_;
+	bool text_model_;
+	bool sparse_model_;
+	uint64_t loaded_checksum_;
+
+	bool binary_input_;
+	bool in_range_input_;
+	UpdateFunc update_;
+
+	static thread_local FtrlScratch<T> local_scratch_;
 };
 
 
 
 template<typename T>
-FtrlSolver<T>::FtrlSolver()
-: alpha_(0), beta_(0), l1_(0), l2_(0), feat_num_(0),
-dropout_(0), n_(NULL), z_(NULL), init_(false),
-uniform_dist_(0.0, std::nextafter(1.0, std::numeric_limits<T>::max())) {}
+thread_local FtrlScratch<T> FtrlSolver<T>::local_scratch_;
 
 template<typename T>
-FtrlSolver<T>::~FtrlSolver() {
-	if (n_) {
-		delete [] n_;
-	}
+FtrlSolver<T>::FtrlSolver()
+: alpha_(0), beta_(0), l1_(0), l2_(0),
+dropout_(0), init_(false), simd_(true), fast_math_(FTRL_FAST_MATH_DEFAULT),
+shared_state_(false), verify_state_(false), text_model_(false),
+sparse_model_(false), loaded_checksum_(0), binary_input_(false), in_range_input_(false), update_(NULL) {}
 
-	if (z_) {
-		delete [] z_;
-	}
-}
+template<typename T>
+FtrlSolver<T>::~FtrlSolver() {}
 
 template<typename T>
 void set_float_zero(T* x, size_t n) {
@@ -126,120 +360,324 @@ bool FtrlSolver<T>::Initialize(
 		T l1,
 		T l2,
 		size_t n,
-		T dropout) {
+		T dropout,
+		bool sparse,
+		bool compact) {
 	alpha_ = alpha;
 	beta_ = beta;
 	l1_ = l1;
 	l2_ = l2;
-	feat_num_ = n;
 	dropout_ = dropout;
 
-	n_ = new T[feat_num_];
-	z_ = new T[feat_num_];
-	set_float_zero(n_, n);
-	set_float_zero(z_, n);
+	// n is only a size hint for sparse store
+	bool suc = sparse ? params_.InitializeSparse(n) : params_.InitializeDense(n, compact);
+	if (!suc) {
+		return false;
+	}
+	SelectUpdate(false, false);
 	init_ = true;
 	return init_;
 }
 
 template<typename T>
 bool FtrlSolver<T>::Initialize(const char* path) {
+	ModelFileHeader state;
+	if (read_model_header(path, state)) {
+		return InitializeState(path, state);
+	}
+
 	std::fstream fin;
 	fin.open(path, std::ios::in);
 	if (!fin.is_open()) {
 		return false;
 	}
 
-	fin >> alpha_ >> beta_ >> l1_ >> l2_ >> feat_num_ >> dropout_;
-	if (!fin || fin.eof()) {
+	// header, ended by "sparse" or "bf16" for models of those stores
+	std::string line;
+	std::getline(fin, line);
+	std::istringstream header(line);
+	size_t feat_num = 0;
+	std::string store;
+	header >> alpha_ >> beta_ >> l1_ >> l2_ >> feat_num >> dropout_;
+	if (!header || fin.eof()) {
 		fin.close();
 		return false;
 	}
+	header >> store;
+
+	if (store == "sparse") {
+		if (!params_.InitializeSparse()) {
+			fin.close();
+			return false;
+		}
+
+		size_t idx;
+		FtrlParam<T> param;
+		while (fin >> idx >> param.n >> param.z) {
+			if (!params_.Set(idx, param)) {
+				fin.close();
+				return false;
+			}
+		}
+
+		bool suc = fin.eof();
+		fin.close();
+		SelectUpdate(false, false);
+		init_ = suc;
+		return init_;
+	}
 
-	n_ = new T[feat_num_];
-	z_ = new T[feat_num_];
+	if (!params_.InitializeDense(feat_num, store == "bf16")) {
+		fin.close();
+		return false;
+	}
 
-	for (size_t i = 0; i < feat_num_; ++i) {
-		fin >> n_[i];
+	FtrlParam<T> param;
+	for (size_t i = 0; i < feat_num; ++i) {
+		fin >> param.n;
 		if (!fin || fin.eof()) {
 			fin.close();
 			return false;
 		}
+		param.z = 0;
+		params_.Set(i, param);
 	}
 
-	for (size_t i = 0; i < feat_num_; ++i) {
-		fin >> z_[i];
+	for (size_t i = 0; i < feat_num; ++i) {
+		params_.Get(i, param);
+		fin >> param.z;
 		if (!fin || fin.eof()) {
 			fin.close();
 			return false;
 		}
+		params_.Set(i, param);
 	}
 
 	fin.close();
+	SelectUpdate(false, false);
 	init_ = true;
 	return init_;
 }
 
 template<typename T>
-T FtrlSolver<T>::GetWeight(size_t idx) {
-    if (idx >= feat_num_) {
-        return 0;
-    }
+bool FtrlSolver<T>::InitializeState(const char* path, const ModelFileHeader& header) {
+	if (!header.is_state()) {
+		fprintf(stderr, "%s holds weights, start from the .save state\n", path);
+		return false;
+	}
+	if (header.delta()) {
+		fprintf(stderr, "%s is a delta, merge it into its base by ftrl_convert --compact\n",
+			path);
+		return false;
+	}
 
-	T sign = 1.;
-	T val = 0.;
-	if (z_[idx] < 0) {
-		sign = -1.;
+	bool compact = header.compact();
+	size_t value_bytes = compact ? sizeof(CompactParam) : sizeof(FtrlParam<T>);
+	if (header.value_bytes != value_bytes) {
+		fprintf(stderr, "%s holds %u bytes per coordinate, %zu expected,"
+			" check --double-precision\n", path, header.value_bytes, value_bytes);
+		return false;
 	}
 
-	if (util_less_equal(sign * z_[idx], l1_)) {
-		val = 0.;
+	if (header.sparse()) {
+		ModelFileMap file;
+		if (!file.Open(path) || !params_.InitializeSparse(header.count)) {
+			return false;
+		}
+
+		const FtrlParam<T>* params = reinterpret_cast<const FtrlParam<T>*>(file.values());
+		for (size_t i = 0; i < header.count; ++i) {
+			if (!params_.Set(file.index()[i], params[i])) {
+				return false;
+			}
+		}
 	} else {
-		val = (sign * l1_ - z_[idx]) / ((beta_ + sqrt(n_[idx])) / alpha_ + l2_);
+		if (!params_.InitializeMapped(path, kModelHeaderSize, header.feat_num,
+				compact, shared_state_)) {
+			return false;
+		}
+
+		if (verify_state_ && model_checksum(header, params_.raw()) != header.checksum) {
+			fprintf(stderr, "%s fails its checksum\n", path);
+			params_.Clear();
+			return false;
+		}
 	}
 
-	return val;
+	alpha_ = static_cast<T>(header.alpha);
+	beta_ = static_cast<T>(header.beta);
+	l1_ = static_cast<T>(header.l1);
+	l2_ = static_cast<T>(header.l2);
+	dropout_ = static_cast<T>(header.dropout);
+	loaded_checksum_ = header.checksum;
+	SelectUpdate(false, false);
+	init_ = true;
+	return init_;
 }
 
 template<typename T>
-T FtrlSolver<T>::Update(const std::vector<std::pair<size_t, T> >& x, T y) {
-	if (!init_) return 0;
+bool FtrlSolver<T>::InitializeAdmission(size_t min_count, size_t bits) {
+	std::shared_ptr<FeatureAdmission> admission(new FeatureAdmission());
+	if (!admission->Initialize(min_count, bits)) {
+		return false;
+	}
 
-	std::vector<std::pair<size_t, T> > weights;
-	std::vector<T> gradients;
-	T wTx = 0.;
+	admission_ = admission;
+	return true;
+}
+
+template<typename T>
+T FtrlSolver<T>::GetWeight(size_t idx) {
+	FtrlParam<T> param;
+	if (!params_.Get(idx, param)) {
+		return 0;
+	}
+
+	return GetWeight(param);
+}
+
+template<typename T>
+T FtrlSolver<T>::GetWeight(const FtrlParam<T>& param) {
+	return ftrl_weight(param.n, param.z, kernel_param());
+}
 
+template<typename T>
+void FtrlSolver<T>::SelectUpdate(bool binary, bool in_range) {
+	binary_input_ = binary;
+	in_range_input_ = in_range;
+	update_ = select_policy<UpdateSelect>(util_greater(dropout_, (T)0), binary, !in_range);
+}
+
+template<typename T>
+template<class Policy>
+size_t FtrlSolver<T>::GatherParams(const std::vector<std::pair<size_t, T> >& x,
+		FtrlScratch<T>& scratch, bool admit) {
+	scratch.Reserve(x.size());
+	FeatureAdmission* admission = admit ? admission_.get() : NULL;
+	const FtrlParam<T>* dense = params_.dense();
+
+	size_t num = 0;
+	FtrlParam<T> param;
 	for (auto& item : x) {
-		if (util_greater(dropout_, (T)0)) {
-			T rand_prob = uniform_dist_(rand_generator_);
-			if (rand_prob < dropout_) {
-				continue;
+		if (Policy::dropout && scratch.Drop(dropout_)) continue;
+		size_t idx = item.first;
+		if (!Policy::checked && dense) {
+			param = dense[idx];
+		} else {
+			if (Policy::checked && !params_.InRange(idx)) continue;
+			params_.Get(idx, param);
+		}
+		// coordinates with state were admitted already
+		if (admission && param.n == 0 && !admission->Admit(idx)) continue;
+
+		scratch.index[num] = idx;
+		if (!Policy::binary) scratch.value[num] = item.second;
+		scratch.n[num] = param.n;
+		scratch.z[num] = param.z;
+		++num;
+	}
+
+	return num;
+}
+
+template<typename T>
+size_t FtrlSolver<T>::GatherParams(const std::vector<std::pair<size_t, T> >& x,
+		FtrlScratch<T>& scratch, bool dropout, bool admit) {
+	if (dropout && util_greater(dropout_, (T)0)) {
+		return GatherParams<FtrlPolicy<true, false, true> >(x, scratch, admit);
+	}
+	return GatherParams<FtrlPolicy<false, false, true> >(x, scratch, admit);
+}
+
+template<typename T>
+void FtrlSolver<T>::SortedParams(std::vector<std::pair<size_t, FtrlParam<T> > >& params) {
+	params.clear();
+	params.reserve(params_.size());
+	params_.ForEach([&params] (size_t idx, const FtrlParam<T>& param) {
+		params.push_back(std::make_pair(idx, param));
+	});
+
+	if (params_.sparse()) {
+		std::sort(params.begin(), params.end(),
+			[] (const std::pair<size_t, FtrlParam<T> >& a,
+				const std::pair<size_t, FtrlParam<T> >& b) { return a.first < b.first; });
+	}
+}
+
+template<typename T>
+void FtrlSolver<T>::NonZeroWeights(std::vector<uint64_t>& index, std::vector<T>& weights) {
+	index.clear();
+	weights.clear();
+	if (params_.sparse()) {
+		std::vector<std::pair<size_t, FtrlParam<T> > > params;
+		SortedParams(params);
+		for (auto& item : params) {
+			T w = GetWeight(item.second);
+			if (w == 0) continue;
+			index.push_back(item.first);
+			weights.push_back(w);
+		}
+		return;
+	}
+
+	// blocks of features scanned by threads, then joined in order
+	const size_t block = 1 << 16;
+	size_t feat_num = params_.feat_num();
+	size_t num_blocks = (feat_num + block - 1) / block;
+	std::vector<std::vector<uint64_t> > block_index(num_blocks);
+	std::vector<std::vector<T> > block_weights(num_blocks);
+	size_t threads = model_io_threads(num_blocks, 0);
+	util_parallel_run([&] (size_t tid) {
+		for (size_t b = tid; b < num_blocks; b += threads) {
+			size_t end = std::min(feat_num, (b + 1) * block);
+			for (size_t i = b * block; i < end; ++i) {
+				T w = GetWeight(i);
+				if (w == 0) continue;
+				block_index[b].push_back(i);
+				block_weights[b].push_back(w);
 			}
 		}
-		size_t idx = item.first;
-		if (idx >= feat_num_) continue;
+	}, threads);
 
-		T val = GetWeight(idx);
-		weights.push_back(std::make_pair(idx, val));
-		gradients.push_back(item.second);
-		wTx += val * item.second;
+	for (size_t b = 0; b < num_blocks; ++b) {
+		index.insert(index.end(), block_index[b].begin(), block_index[b].end());
+		weights.insert(weights.end(), block_weights[b].begin(), block_weights[b].end());
 	}
+}
 
-	T pred = sigmoid(wTx);
-	T grad = pred - y;
-	std::transform(
-		gradients.begin(),
-		gradients.end(),
-		gradients.begin(),
-		std::bind1st(std::multiplies<T>(), grad));
+template<typename T>
+T FtrlSolver<T>::Update(const std::vector<std::pair<size_t, T> >& x, T y) {
+	return Update(x, y, local_scratch_);
+}
 
-	for (size_t k = 0; k < weights.size(); ++k) {
-		size_t i = weights[k].first;
-		T w_i = weights[k].second;
-		T grad_i = gradients[k];
-		T sigma = (sqrt(n_[i] + grad_i * grad_i) - sqrt(n_[i])) / alpha_;
-		z_[i] += grad_i - sigma * w_i;
-		n_[i] += grad_i * grad_i;
+template<typename T>
+T FtrlSolver<T>::Update(const std::vector<std::pair<size_t, T> >& x, T y,
+		FtrlScratch<T>& scratch) {
+	if (!init_) return 0;
+
+	return (this->*update_)(x, y, scratch);
+}
+
+template<typename T>
+template<class Policy>
+T FtrlSolver<T>::UpdateImpl(const std::vector<std::pair<size_t, T> >& x, T y,
+		FtrlScratch<T>& scratch) {
+	size_t num = GatherParams<Policy>(x, scratch, true);
+	T wTx = ftrl_weights<Policy::binary>(scratch.n.data(), scratch.z.data(),
+		scratch.value.data(), num, kernel_param(), scratch.weight.data(), simd_);
+
+	T pred = Sigmoid(wTx);
+	T grad = pred - y;
+	ftrl_deltas<Policy::binary>(scratch.n.data(), scratch.z.data(), scratch.weight.data(),
+		scratch.value.data(), grad, num, alpha_, simd_);
+
+	for (size_t k = 0; k < num; ++k) {
+		T delta_n = scratch.n[k];
+		T delta_z = scratch.z[k];
+		params_.Modify(scratch.index[k], [&] (FtrlParam<T>& param) {
+			param.z += delta_z;
+			param.n += delta_n;
+		});
 	}
 
 	return pred;
@@ -249,20 +687,77 @@ template<typename T>
 T FtrlSolver<T>::Predict(const std::vector<std::pair<size_t, T> >& x) {
 	if (!init_) return 0;
 
-	T wTx = 0.;
-	for (auto& item : x) {
-		size_t idx = item.first;
-		T val = GetWeight(idx);
-		wTx += val * item.second;
+	FtrlScratch<T>& scratch = local_scratch_;
+	size_t num = GatherParams(x, scratch, false, false);
+	T wTx = ftrl_weights(scratch.n.data(), scratch.z.data(), scratch.value.data(), num,
+		kernel_param(), scratch.weight.data(), simd_);
+
+	T pred = Sigmoid(wTx);
+	return pred;
+}
+
+template<typename T>
+T FtrlSolver<T>::Gradient(const std::vector<std::pair<size_t, T> >& x, T y,
+		FtrlScratch<T>& scratch, std::vector<std::pair<size_t, T> >& grads) {
+	if (!init_) return 0;
+
+	// coordinates not admitted yet weigh 0, they are only counted here and
+	// ApplyGradients decides on the counts of the whole batch
+	size_t num = GatherParams(x, scratch, true, false);
+	T wTx = ftrl_weights(scratch.n.data(), scratch.z.data(), scratch.value.data(), num,
+		kernel_param(), scratch.weight.data(), simd_);
+
+	T pred = Sigmoid(wTx);
+	T grad = pred - y;
+	for (size_t k = 0; k < num; ++k) {
+		if (admission_ && scratch.n[k] == 0) admission_->Admit(scratch.index[k]);
+		grads.push_back(std::make_pair(scratch.index[k], grad * scratch.value[k]));
 	}
 
-	T pred = sigmoid(wTx);
 	return pred;
 }
 
+template<typename T>
+void FtrlSolver<T>::ApplyGradients(const std::pair<size_t, T>* grads, size_t num,
+		FtrlScratch<T>& scratch) {
+	if (!init_) return;
+
+	scratch.Reserve(num);
+	size_t total = num;
+	FtrlParam<T> param;
+	num = 0;
+	for (size_t k = 0; k < total; ++k) {
+		size_t idx = grads[k].first;
+		params_.Get(idx, param);
+		if (admission_ && param.n == 0 && !admission_->Admitted(idx)) continue;
+
+		scratch.index[num] = idx;
+		scratch.value[num] = grads[k].second;
+		scratch.n[num] = param.n;
+		scratch.z[num] = param.z;
+		++num;
+	}
+
+	// a unit loss gradient scaled by value is the summed gradient
+	ftrl_weights(scratch.n.data(), scratch.z.data(), scratch.value.data(), num,
+		kernel_param(), scratch.weight.data(), simd_);
+	ftrl_deltas(scratch.n.data(), scratch.z.data(), scratch.weight.data(), scratch.value.data(),
+		(T)1, num, alpha_, simd_);
+
+	for (size_t k = 0; k < num; ++k) {
+		T delta_n = scratch.n[k];
+		T delta_z = scratch.z[k];
+		params_.Modify(scratch.index[k], [&] (FtrlParam<T>& param) {
+			param.z += delta_z;
+			param.n += delta_n;
+		});
+	}
+}
+
 template<typename T>
 bool FtrlSolver<T>::SaveModel(const char* path) {
 	if (!init_) return false;
+	if (!text_model_) return SaveWeights(path);
 
 	std::fstream fout;
 	std::ios_base::sync_with_stdio(false);
@@ -273,9 +768,20 @@ bool FtrlSolver<T>::SaveModel(const char* path) {
 	}
 
 	fout << std::fixed << std::setprecision(kPrecision);
-	for (size_t i = 0; i < feat_num_; ++i) {
-		T w = GetWeight(i);
-		fout << w << "\n";
+	if (sparse_model()) {
+		// "index\tweight" lines of non-zero weights
+		std::vector<uint64_t> index;
+		std::vector<T> weights;
+		NonZeroWeights(index, weights);
+		for (size_t i = 0; i < index.size(); ++i) {
+			fout << index[i] << "\t" << weights[i] << "\n";
+		}
+	} else {
+		size_t feat_num = params_.feat_num();
+		for (size_t i = 0; i < feat_num; ++i) {
+			T w = GetWeight(i);
+			fout << w << "\n";
+		}
 	}
 
 	fout.close();
@@ -285,6 +791,7 @@ bool FtrlSolver<T>::SaveModel(const char* path) {
 template<typename T>
 bool FtrlSolver<T>::SaveModelDetail(const char* path) {
 	if (!init_) return false;
+	if (!text_model_) return SaveState(path);
 
 	std::fstream fout;
 	std::ios_base::sync_with_stdio(false);
@@ -296,20 +803,298 @@ bool FtrlSolver<T>::SaveModelDetail(const char* path) {
 
 	fout << std::fixed << std::setprecision(kPrecision);
 	fout << alpha_ << "\t" << beta_ << "\t" << l1_ << "\t"
-		<< l2_ << "\t" << feat_num_ << "\t" << dropout_ << "\n";
+		<< l2_ << "\t" << params_.feat_num() << "\t" << dropout_;
+
+	if (params_.sparse()) {
+		// "index\tn\tz" lines of stored coordinates
+		fout << "\tsparse\n";
+		std::vector<std::pair<size_t, FtrlParam<T> > > params;
+		SortedParams(params);
+		for (auto& item : params) {
+			fout << item.first << "\t" << item.second.n << "\t" << item.second.z << "\n";
+		}
+	} else {
+		if (params_.compact()) {
+			// every digit of a float, so bfloat16 state loads back exactly
+			fout << "\tbf16";
+			fout << std::defaultfloat << std::setprecision(std::numeric_limits<float>::max_digits10);
+		}
+		fout << "\n";
 
-	for (size_t i = 0; i < feat_num_; ++i) {
-		fout << n_[i] << "\n";
-	}
+		FtrlParam<T> param;
+		size_t feat_num = params_.feat_num();
+		for (size_t i = 0; i < feat_num; ++i) {
+			params_.Get(i, param);
+			fout << param.n << "\n";
+		}
 
-	for (size_t i = 0; i < feat_num_; ++i) {
-		fout << z_[i] << "\n";
+		for (size_t i = 0; i < feat_num; ++i) {
+			params_.Get(i, param);
+			fout << param.z << "\n";
+		}
 	}
 
 	fout.close();
 	return true;
 }
 
+template<typename T>
+ModelFileHeader FtrlSolver<T>::ModelHeader(const char* magic) {
+	ModelFileHeader header = make_model_header(magic);
+	header.real_bytes = sizeof(T);
+	header.feat_num = params_.feat_num();
+	header.alpha = alpha_;
+	header.beta = beta_;
+	header.l1 = l1_;
+	header.l2 = l2_;
+	header.dropout = dropout_;
+	return header;
+}
+
+template<typename T>
+bool FtrlSolver<T>::SaveWeights(const char* path) {
+	ModelFileHeader header = ModelHeader(MODEL_WEIGHT_MAGIC);
+	header.value_bytes = sizeof(T);
+
+	if (!sparse_model()) {
+		// weights of each chunk are computed by the thread writing it
+		header.count = header.feat_num;
+		return write_model_file(path, header,
+			[this] (size_t, size_t begin, size_t bytes, char* buf) {
+				T* w = reinterpret_cast<T*>(buf);
+				size_t start = begin / sizeof(T);
+				for (size_t i = 0; i < bytes / sizeof(T); ++i) {
+					w[i] = GetWeight(start + i);
+				}
+				return buf;
+			});
+	}
+
+	std::vector<uint64_t> index;
+	std::vector<T> weights;
+	NonZeroWeights(index, weights);
+
+	header.flags = kModelSparse;
+	header.count = index.size();
+	return write_model_file(path, header,
+		[&index, &weights] (size_t section, size_t begin, size_t, char*) {
+			const char* data = section == 0 ? reinterpret_cast<const char*>(index.data())
+				: reinterpret_cast<const char*>(weights.data());
+			return data + begin;
+		});
+}
+
+template<typename T>
+bool FtrlSolver<T>::SaveState(const char* path) {
+	ModelFileHeader header = ModelHeader(MODEL_STATE_MAGIC);
+	if (!params_.sparse() && params_.MapsShared(path)) {
+		// updated in place, only the checksum is stale
+		SetStateLayout(header, header.feat_num);
+		return params_.Sync()
+			&& update_model_checksum(path, model_checksum(header, params_.raw()));
+	}
+
+	return WriteState(path, header, 0);
+}
+
+template<typename T>
+bool FtrlSolver<T>::SaveCheckpoint(const char* path, size_t epoch, size_t samples) {
+	if (!init_) return false;
+
+	// later deltas hold what changes from here on
+	if (params_.tracks_dirty()) params_.ClearDirty(kDirtyCheckpoint);
+
+	ModelFileHeader header = ModelHeader(MODEL_STATE_MAGIC);
+	header.epoch = epoch;
+	header.samples = samples;
+	return WriteState(path, header, 1);
+}
+
+template<typename T>
+void FtrlSolver<T>::SetStateLayout(ModelFileHeader& header, size_t count) {
+	header.value_bytes = params_.compact() ? sizeof(CompactParam) : sizeof(FtrlParam<T>);
+	header.flags = (params_.compact() ? kModelCompact : 0)
+		| (params_.sparse() ? kModelSparse : 0);
+	header.count = count;
+}
+
+template<typename T>
+bool FtrlSolver<T>::TakeDelta(StateSnapshot& snapshot, uint8_t channel,
+		uint64_t base_checksum, size_t epoch, size_t samples) {
+	if (!init_ || !params_.tracks_dirty()) return false;
+
+	// marks are cleared before the coordinates they cover are read
+	std::vector<uint64_t>& index = snapshot.index;
+	std::vector<FtrlParam<T> > values;
+	index.clear();
+	if (params_.sparse()) {
+		std::vector<bool> hit(params_.dirty_slots());
+		for (size_t i = 0; i < hit.size(); ++i) hit[i] = params_.TakeDirty(i, channel);
+
+		std::vector<std::pair<size_t, FtrlParam<T> > > params;
+		params_.ForEach([&] (size_t idx, const FtrlParam<T>& param) {
+			if (hit[params_.DirtySlot(idx)]) params.push_back(std::make_pair(idx, param));
+		});
+		std::sort(params.begin(), params.end(),
+			[] (const std::pair<size_t, FtrlParam<T> >& a,
+				const std::pair<size_t, FtrlParam<T> >& b) { return a.first < b.first; });
+		for (auto& item : params) {
+			index.push_back(item.first);
+			values.push_back(item.second);
+		}
+	} else {
+		const size_t group = (size_t)1 << kDirtyShift;
+		size_t feat_num = params_.feat_num();
+		std::vector<FtrlParam<T> > buf(group);
+		for (size_t i = 0; i < params_.dirty_slots(); ++i) {
+			if (!params_.TakeDirty(i, channel)) continue;
+
+			size_t start = i * group;
+			size_t num = std::min(group, feat_num - start);
+			ReadParams(start, num, buf.data());
+			for (size_t k = 0; k < num; ++k) {
+				if (buf[k].n == 0 && buf[k].z == 0) continue;
+				index.push_back(start + k);
+				values.push_back(buf[k]);
+			}
+		}
+	}
+
+	const char* data = reinterpret_cast<const char*>(values.data());
+	snapshot.values.assign(data, data + values.size() * sizeof(FtrlParam<T>));
+
+	ModelFileHeader& header = snapshot.header;
+	header = ModelHeader(MODEL_STATE_MAGIC);
+	header.value_bytes = sizeof(FtrlParam<T>);
+	header.flags = kModelSparse | kModelDelta;
+	header.count = index.size();
+	header.epoch = epoch;
+	header.samples = samples;
+	header.base_checksum = base_checksum;
+	return true;
+}
+
+template<typename T>
+bool FtrlSolver<T>::SaveDelta(const char* path, uint8_t channel, uint64_t base_checksum,
+		size_t epoch, size_t samples, size_t num_threads) {
+	StateSnapshot snapshot;
+	return TakeDelta(snapshot, channel, base_checksum, epoch, samples)
+		&& WriteSnapshot(path, snapshot, num_threads);
+}
+
+template<typename T>
+bool FtrlSolver<T>::TakeCheckpoint(StateSnapshot& snapshot, size_t epoch, size_t samples) {
+	if (!init_) return false;
+
+	if (params_.tracks_dirty()) params_.ClearDirty(kDirtyCheckpoint);
+
+	ModelFileHeader& header = snapshot.header;
+	header = ModelHeader(MODEL_STATE_MAGIC);
+	header.epoch = epoch;
+	header.samples = samples;
+	snapshot.index.clear();
+	if (!params_.sparse()) {
+		SetStateLayout(header, header.feat_num);
+		snapshot.values.resize(header.feat_num * header.value_bytes);
+		CopyParams(0, header.feat_num, snapshot.values.data());
+		return true;
+	}
+
+	std::vector<std::pair<size_t, FtrlParam<T> > > params;
+	SortedParams(params);
+	SetStateLayout(header, params.size());
+	snapshot.index.resize(params.size());
+	snapshot.values.resize(params.size() * sizeof(FtrlParam<T>));
+	FtrlParam<T>* values = reinterpret_cast<FtrlParam<T>*>(snapshot.values.data());
+	for (size_t i = 0; i < params.size(); ++i) {
+		snapshot.index[i] = params[i].first;
+		values[i] = params[i].second;
+	}
+	return true;
+}
+
+template<typename T>
+bool FtrlSolver<T>::WriteSnapshot(const char* path, StateSnapshot& snapshot,
+		size_t num_threads) {
+	// a dense state has its values only
+	const char* index = reinterpret_cast<const char*>(snapshot.index.data());
+	const char* values = snapshot.values.data();
+	bool sparse = snapshot.header.sparse();
+	return write_model_file(path, snapshot.header,
+		[index, values, sparse] (size_t section, size_t begin, size_t, char*) {
+			return (sparse && section == 0 ? index : values) + begin;
+		}, num_threads);
+}
+
+template<typename T>
+bool FtrlSolver<T>::ApplyDelta(const char* path, ModelFileHeader* header) {
+	if (!init_) return false;
+
+	ModelFileMap file;
+	if (!file.Open(path)) return false;
+	if (!file.header().delta() || file.header().value_bytes != sizeof(FtrlParam<T>)) {
+		fprintf(stderr, "%s is not a delta of %zu bytes per coordinate\n",
+			path, sizeof(FtrlParam<T>));
+		return false;
+	}
+
+	const FtrlParam<T>* values = reinterpret_cast<const FtrlParam<T>*>(file.values());
+	for (size_t i = 0; i < file.header().count; ++i) {
+		if (!params_.Set(file.index()[i], values[i])) {
+			fprintf(stderr, "%s changes feature %zu out of the model\n",
+				path, static_cast<size_t>(file.index()[i]));
+			return false;
+		}
+	}
+
+	if (header) *header = file.header();
+	return true;
+}
+
+template<typename T>
+void FtrlSolver<T>::ReadParams(size_t start, size_t num, FtrlParam<T>* out) {
+	for (size_t i = 0; i < num; ++i) params_.Get(start + i, out[i]);
+}
+
+template<typename T>
+void FtrlSolver<T>::CopyParams(size_t start, size_t num, char* buf) {
+	size_t bytes = params_.compact() ? sizeof(CompactParam) : sizeof(FtrlParam<T>);
+	memcpy(buf, params_.raw() + start * bytes, num * bytes);
+}
+
+template<typename T>
+bool FtrlSolver<T>::WriteState(const char* path, ModelFileHeader& header,
+		size_t num_threads) {
+	if (!params_.sparse()) {
+		// chunks are copied before they are hashed and written, as other
+		// threads may be training
+		SetStateLayout(header, header.feat_num);
+		size_t bytes = header.value_bytes;
+		return write_model_file(path, header,
+			[this, bytes] (size_t, size_t begin, size_t size, char* buf) {
+				CopyParams(begin / bytes, size / bytes, buf);
+				return buf;
+			}, num_threads);
+	}
+
+	std::vector<std::pair<size_t, FtrlParam<T> > > params;
+	SortedParams(params);
+	std::vector<uint64_t> index(params.size());
+	std::vector<FtrlParam<T> > values(params.size());
+	for (size_t i = 0; i < params.size(); ++i) {
+		index[i] = params[i].first;
+		values[i] = params[i].second;
+	}
+
+	SetStateLayout(header, params.size());
+	return write_model_file(path, header,
+		[&index, &values] (size_t section, size_t begin, size_t, char*) {
+			const char* data = section == 0 ? reinterpret_cast<const char*>(index.data())
+				: reinterpret_cast<const char*>(values.data());
+			return data + begin;
+		}, num_threads);
+}
+
 template<typename T>
 bool FtrlSolver<T>::SaveModelAll(const char* path) {
 	std::string model_detail = std::string(path) + ".save";
@@ -324,37 +1109,133 @@ public:
 	LRModel();
 	virtual ~LRModel();
 
-	bool Initialize(const char* path);
+	// Binary or text model, hash_bits > 0 for models trained with --hash-bits,
+	// fails if the model was trained with other hash bits
+	bool Initialize(const char* path, size_t hash_bits = 0);
 
 	T Predict(const std::vector<std::pair<size_t, T> >& x);
+
+	// Predict from feature names, hashed the same way as in training
+	T Predict(const std::vector<std::pair<std::string, T> >& x);
+
+private:
+	bool InitializeBinary(const char* path);
+	bool InitializeText(const char* path);
+
+	T GetWeight(size_t idx) const;
+
 private:
 	std::vector<T> model_;
+	// models of non-zero weights only
+	SparseWeights<T> sparse_model_;
+	bool sparse_;
+	size_t hash_bits_;
 	bool init_;
 };
 
 template<typename T>
-LRModel<T>::LRModel() : init_(false) {}
+LRModel<T>::LRModel() : sparse_(false), hash_bits_(0), init_(false) {}
 
 template<typename T>
 LRModel<T>::~LRModel() {}
 
 template<typename T>
-bool LRModel<T>::Initialize(const char* path) {
+bool LRModel<T>::Initialize(const char* path, size_t hash_bits) {
+	hash_bits_ = hash_bits;
+	ModelFileHeader header;
+	bool suc = read_model_header(path, header) ? InitializeBinary(path) : InitializeText(path);
+	if (!suc) {
+		return false;
+	}
+
+	// a dense model holds exactly 2^hash_bits weights, a sparse one only
+	// tells when its indices do not fit them
+	size_t extent = (size_t)1 << hash_bits_;
+	size_t size = sparse_ ? sparse_model_.end_index() : model_.size();
+	if (hash_bits_ > 0 && (sparse_ ? size > extent : size != extent)) {
+		fprintf(stderr, "model size %zu does not match %zu hash bits\n", size, hash_bits_);
+		return false;
+	}
+
+	init_ = true;
+	return init_;
+}
+
+template<typename T>
+bool LRModel<T>::InitializeBinary(const char* path) {
+	ModelFileMap file;
+	if (!file.Open(path)) {
+		return false;
+	}
+
+	const ModelFileHeader& header = file.header();
+	if (!header.is_weights()) {
+		fprintf(stderr, "%s holds solver state rather than weights\n", path);
+		return false;
+	}
+
+	// weights are saved in the precision of training
+	bool single = header.value_bytes == sizeof(float);
+	if (!single && header.value_bytes != sizeof(double)) {
+		return false;
+	}
+
+	const float* fw = reinterpret_cast<const float*>(file.values());
+	const double* dw = reinterpret_cast<const double*>(file.values());
+	model_.resize(header.count);
+	for (size_t i = 0; i < header.count; ++i) {
+		model_[i] = single ? static_cast<T>(fw[i]) : static_cast<T>(dw[i]);
+	}
+
+	sparse_ = header.sparse();
+	if (sparse_) {
+		sparse_model_.Initialize(file.index(), model_.data(), header.count);
+		std::vector<T>().swap(model_);
+	}
+	return true;
+}
+
+template<typename T>
+bool LRModel<T>::InitializeText(const char* path) {
 	std::fstream fin;
 	fin.open(path, std::ios::in);
 	if (!fin.is_open()) {
 		return false;
 	}
 
+	// two columns per line for sparse models
+	std::string line;
+	std::getline(fin, line);
+	std::istringstream first(line);
 	T w;
-	while (fin >> w) {
-		model_.push_back(w);
+	std::string extra;
+	first >> w >> extra;
+	sparse_ = !extra.empty();
+	fin.clear();
+	fin.seekg(0);
+
+	if (sparse_) {
+		uint64_t idx;
+		std::vector<std::pair<uint64_t, T> > pairs;
+		while (fin >> idx >> w) {
+			pairs.push_back(std::make_pair(idx, w));
+		}
+		sparse_model_.Initialize(pairs);
+	} else {
+		while (fin >> w) {
+			model_.push_back(w);
+		}
 	}
 
 	fin.close();
+	return true;
+}
 
-	init_ = true;
-	return init_;
+template<typename T>
+T LRModel<T>::GetWeight(size_t idx) const {
+	if (sparse_) return sparse_model_.Get(idx);
+
+	return idx < model_.size() ? model_[idx] : 0;
 }
 
 template<typename T>
@@ -363,8 +1244,21 @@ T LRModel<T>::Predict(const std::vector<std::pair<size_t, T> >& x) {
 
 	T wTx = 0.;
 	for (auto& item : x) {
-		if (item.first >= model_.size()) continue;
-		wTx += model_[item.first] * item.second;
+		wTx += GetWeight(item.first) * item.second;
+	}
+	T pred = sigmoid(wTx);
+	return pred;
+}
+
+template<typename T>
+T LRModel<T>::Predict(const std::vector<std::pair<std::string, T> >& x) {
+	if (!init_ || hash_bits_ == 0) return 0;
+
+	// add bias term
+	T wTx = GetWeight(0);
+	for (auto& item : x) {
+		size_t idx = hash_feature(item.first, hash_bits_);
+		wTx += GetWeight(idx) * item.second;
 	}
 	T pred = sigmoid(wTx);
 	return pred;
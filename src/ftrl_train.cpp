@@ -19,6 +19,7 @@
 // THE SOFTWARE.
 
 #include <getopt.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <iostream>
 #include <locale>
@@ -41,12 +42,62 @@ void print_usage() {
 		"--l2 l2 : set l2 param, default 1\n"
 		"--dropout dropout : set dropout rate, default 0\n"
 		"--sync-step step : set push/fetch step of async ftrl, default 3\n"
+		"--group-size num : set number of coordinates pushed and fetched together by"
+		" async ftrl, rounded up to a power of two, at most 65536, default a cache line of them\n"
+		"--lock-stripes num : set number of cache line padded locks shared by the groups"
+		" of async ftrl, default 65536\n"
 		"--burn-in fraction : set fraction of data used to burn-in with single"
 		" thread on async model, default 0\n"
-		"--start-from model_file : set to continue training from model_file\n"
+		"--start-from model_file : set to continue training from model_file, the .save"
+		" state of a previous run\n"
 		"--thread num : set thread num, default is single thread. 0 will use hardware concurrency\n"
 		"--feat-num num : when use stdin as input_file, set feature num, default is 0\n"
 		"--lock-free : lock-free multi-thread mode\n"
+		"--mini-batch size : synchronous mini-batch mode, the model only depends on"
+		" batch size and not on thread num, use a multiple of 128 per thread to scale\n"
+		"--parser-thread num : set number of dedicated parser threads feeding multi-thread"
+		" trainers, default 0 parses in trainer threads\n"
+		"--queue-depth num : set number of parsed sample batches buffered for trainers, default 64\n"
+		"--in-memory data : keep parsed data in memory across epochs, data is train, test or all\n"
+		"--mem-budget mb : set memory budget in MB for in-memory data, streaming from file"
+		" beyond it, default 4096\n"
+		"--shuffle-blocks : visit blocks of train data in a random order every epoch\n"
+		"--hash-bits bits : hash feature names (any string without blanks or ':') into"
+		" 2^bits weights, skips feature counting, default 0 reads numeric indices\n"
+		"--param-store store : set parameter store, dense array up to the largest index,"
+		" sparse hash table of features seen for huge ID spaces or bf16 dense array of"
+		" 16-bit state at half the memory, default dense\n"
+		"--admit-count count : give features weights only once seen count times,"
+		" counted by a count-min sketch, default 0 admits all\n"
+		"--admit-bits bits : set sketch size of --admit-count to 2^bits bytes, default 24\n"
+		"--fast-math : use approximate sigmoid in updates and log in train-loss,"
+		" default is exact unless built with -DFTRL_FAST_MATH\n"
+		"--exact-math : use libm sigmoid and log\n"
+		"--loss-sample num : report train-loss of every num-th sample only, default 1\n"
+		"--shared-state : map the binary state given to --start-from read-write, so that"
+		" training updates it in place through the page cache, default copy-on-write\n"
+		"--verify-state : verify the checksum of a dense binary state to start from, which"
+		" reads all of it before training rather than mapping it at once\n"
+		"--text-model : save model_file and model_file.save as text rather than"
+		" checksummed binary files written by all cores\n"
+		"--sparse-model : save (index, weight) of non-zero weights only, as always done"
+		" for --param-store sparse, much smaller with strong l1\n"
+		"--checkpoint-secs secs : save solver state and input position to"
+		" model_file.ckpt every secs seconds from a background thread\n"
+		"--checkpoint-samples num : save the checkpoint every num samples as well\n"
+		"--resume : continue from model_file.ckpt if a previous run left one, its"
+		" samples trained are skipped, exactly for single thread and --mini-batch,"
+		" approximately for async modes where samples in flight may be lost or repeated\n"
+		"--checkpoint-deltas num : follow a full checkpoint by up to num checkpoints"
+		" holding only the parameters changed since the one before, at most 1024, default 0\n"
+		"--save-delta : save model_file.save.delta of the parameters changed since"
+		" the binary state of --start-from instead of model_file.save, merge it by"
+		" ftrl_convert --compact\n"
+		"--huge-pages pages : back parameter arrays of 2MB and more with huge pages,"
+		" thp (transparent, by madvise), explicit (hugetlb pool, thp if it is empty)"
+		" or off, default off\n"
+		"--numa placement : place parameter arrays of 2MB and more, interleave over"
+		" all nodes, first-touch by the thread owning them or off, default off\n"
 		"--double-precision : set to use double precision, default false\n"
 		"--help : print this help\n"
 	);
@@ -56,10 +107,23 @@ template<typename T>
 bool train(const char* input_file, const char* test_file, const char* model_file,
 		const char* start_from_model, bool cache, T alpha, T beta, T l1, T l2, T dropout, size_t feat_num,
 		size_t epoch, size_t push_step, size_t fetch_step, size_t num_threads, T burn_in_phase,
-		bool lock_free) {
-	if (num_threads == 1) {
+		bool lock_free, size_t batch_size, const TrainOption& option) {
+	if (batch_size > 0) {
+		MiniBatchFtrlTrainer<T> trainer;
+		trainer.Initialize(epoch, num_threads, batch_size, cache);
+		trainer.SetOption(option);
+
+		if (start_from_model) {
+			trainer.Train(start_from_model,
+				model_file, input_file, test_file);
+		} else {
+			trainer.Train(alpha, beta, l1, l2, dropout,
+				model_file, input_file, test_file);
+		}
+	} else if (num_threads == 1) {
 		FtrlTrainer<T> trainer;
 		trainer.Initialize(epoch, cache);
+		trainer.SetOption(option);
 
 		if (start_from_model) {
 			trainer.Train(start_from_model,
@@ -71,6 +135,7 @@ bool train(const char* input_file, const char* test_file, const char* model_file
 	} else if (lock_free) {
 		LockFreeFtrlTrainer<T> trainer;
 		trainer.Initialize(epoch, num_threads, cache);
+		trainer.SetOption(option);
 
 		if (start_from_model) {
 			trainer.Train(start_from_model,
@@ -82,6 +147,7 @@ bool train(const char* input_file, const char* test_file, const char* model_file
 	} else {
 		FastFtrlTrainer<T> trainer;
 		trainer.Initialize(epoch, num_threads, cache, burn_in_phase, push_step, fetch_step);
+		trainer.SetOption(option);
 
 		if (start_from_model) {
 			trainer.Train(start_from_model,
@@ -113,6 +179,32 @@ int main(int argc, char* argv[]) {
 		{"thread", required_argument, NULL, 'n'},
 		{"feat-num", required_argument, NULL, 'k'},
 		{"lock-free", no_argument, NULL, 'q'},
+		{"mini-batch", required_argument, NULL, 'z'},
+		{"parser-thread", required_argument, NULL, 'p'},
+		{"queue-depth", required_argument, NULL, 'g'},
+		{"in-memory", required_argument, NULL, 'v'},
+		{"mem-budget", required_argument, NULL, 'j'},
+		{"shuffle-blocks", no_argument, NULL, 'o'},
+		{"hash-bits", required_argument, NULL, 'y'},
+		{"param-store", required_argument, NULL, 'w'},
+		{"admit-count", required_argument, NULL, 'A'},
+		{"admit-bits", required_argument, NULL, 'B'},
+		{"fast-math", no_argument, NULL, 'C'},
+		{"exact-math", no_argument, NULL, 'D'},
+		{"loss-sample", required_argument, NULL, 'E'},
+		{"shared-state", no_argument, NULL, 'I'},
+		{"verify-state", no_argument, NULL, 'R'},
+		{"text-model", no_argument, NULL, 'H'},
+		{"sparse-model", no_argument, NULL, 'J'},
+		{"checkpoint-secs", required_argument, NULL, 'K'},
+		{"checkpoint-samples", required_argument, NULL, 'L'},
+		{"resume", no_argument, NULL, 'M'},
+		{"checkpoint-deltas", required_argument, NULL, 'N'},
+		{"save-delta", no_argument, NULL, 'O'},
+		{"group-size", required_argument, NULL, 'P'},
+		{"lock-stripes", required_argument, NULL, 'Q'},
+		{"huge-pages", required_argument, NULL, 'F'},
+		{"numa", required_argument, NULL, 'G'},
 		{"double-precision", no_argument, NULL, 'x'},
 		{"help", no_argument, NULL, 'h'},
 		{0, 0, 0, 0}
@@ -136,6 +228,8 @@ int main(int argc, char* argv[]) {
 	size_t num_threads = 1;
     size_t feat_num = 0;
 	bool lock_free = false;
+	size_t batch_size = 0;
+	TrainOption option;
 
 	double burn_in_phase = 0;
 
@@ -188,9 +282,153 @@ int main(int argc, char* argv[]) {
 		case 'q':
 			lock_free = true;
 			break;
+		case 'z':
+			if (atoi(optarg) <= 0) {
+				fprintf(stderr, "mini-batch size must be positive\n");
+				exit(1);
+			}
+			batch_size = (size_t)atoi(optarg);
+			break;
 		case 'u':
 			burn_in_phase = atof(optarg);
 			break;
+		case 'p':
+			option.parser_threads = (size_t)atoi(optarg);
+			break;
+		case 'g':
+			if (atoi(optarg) <= 0) {
+				fprintf(stderr, "queue depth must be positive\n");
+				exit(1);
+			}
+			option.queue_depth = (size_t)atoi(optarg);
+			break;
+		case 'v':
+			if (strcmp(optarg, "train") == 0 || strcmp(optarg, "all") == 0) {
+				option.in_memory_train = true;
+			}
+			if (strcmp(optarg, "test") == 0 || strcmp(optarg, "all") == 0) {
+				option.in_memory_test = true;
+			}
+			break;
+		case 'j':
+			if (atol(optarg) <= 0 || (size_t)atol(optarg) > (SIZE_MAX >> 20)) {
+				fprintf(stderr, "memory budget must be a positive number of MB\n");
+				exit(1);
+			}
+			option.mem_budget = (size_t)atol(optarg);
+			break;
+		case 'o':
+			option.shuffle_blocks = true;
+			break;
+		case 'y':
+			option.hash_bits = (size_t)atoi(optarg);
+			if (!valid_hash_bits(option.hash_bits)) {
+				fprintf(stderr, "hash bits must be in [%d, %d]\n", kMinHashBits, kMaxHashBits);
+				exit(1);
+			}
+			break;
+		case 'w':
+			if (strcmp(optarg, "sparse") == 0) {
+				option.sparse_params = true;
+			} else if (strcmp(optarg, "bf16") == 0) {
+				option.compact_params = true;
+			} else if (strcmp(optarg, "dense") != 0) {
+				fprintf(stderr, "param store must be dense, sparse or bf16\n");
+				exit(1);
+			}
+			break;
+		case 'A':
+			option.admit_count = (size_t)atoi(optarg);
+			if (option.admit_count > kMaxAdmitCount) {
+				fprintf(stderr, "admit count must be at most %d\n", kMaxAdmitCount);
+				exit(1);
+			}
+			break;
+		case 'B':
+			option.admit_bits = (size_t)atoi(optarg);
+			if (option.admit_bits < kMinAdmitBits || option.admit_bits > kMaxAdmitBits) {
+				fprintf(stderr, "admit bits must be in [%d, %d]\n", kMinAdmitBits, kMaxAdmitBits);
+				exit(1);
+			}
+			break;
+		case 'C':
+			option.fast_math = true;
+			break;
+		case 'D':
+			option.fast_math = false;
+			break;
+		case 'E':
+			if (atoi(optarg) <= 0) {
+				fprintf(stderr, "loss sample must be positive\n");
+				exit(1);
+			}
+			option.loss_sample = (size_t)atoi(optarg);
+			break;
+		case 'H':
+			option.text_model = true;
+			break;
+		case 'I':
+			option.shared_state = true;
+			break;
+		case 'R':
+			option.verify_state = true;
+			break;
+		case 'J':
+			option.sparse_model = true;
+			break;
+		case 'K':
+			if (atof(optarg) < 0) {
+				fprintf(stderr, "checkpoint seconds must not be negative\n");
+				exit(1);
+			}
+			option.checkpoint_seconds = atof(optarg);
+			break;
+		case 'L':
+			if (atoll(optarg) < 0) {
+				fprintf(stderr, "checkpoint samples must not be negative\n");
+				exit(1);
+			}
+			option.checkpoint_samples = (size_t)atoll(optarg);
+			break;
+		case 'M':
+			option.resume = true;
+			break;
+		case 'N':
+			if (atoi(optarg) < 0 || atoi(optarg) > kMaxCheckpointDeltas) {
+				fprintf(stderr, "checkpoint deltas must be in [0, %d]\n", kMaxCheckpointDeltas);
+				exit(1);
+			}
+			option.checkpoint_deltas = (size_t)atoi(optarg);
+			break;
+		case 'O':
+			option.save_delta = true;
+			break;
+		case 'P':
+			if (atoi(optarg) <= 0 || atoi(optarg) > kMaxGroupSize) {
+				fprintf(stderr, "group size must be in [1, %d]\n", kMaxGroupSize);
+				exit(1);
+			}
+			option.group_size = (size_t)atoi(optarg);
+			break;
+		case 'Q':
+			option.lock_stripes = (size_t)atoi(optarg);
+			if (option.lock_stripes == 0) {
+				fprintf(stderr, "lock stripes must be positive\n");
+				exit(1);
+			}
+			break;
+		case 'F':
+			if (!parse_param_pages(optarg, param_alloc_policy().pages)) {
+				fprintf(stderr, "huge pages must be thp, explicit or off\n");
+				exit(1);
+			}
+			break;
+		case 'G':
+			if (!parse_param_numa(optarg, param_alloc_policy().numa)) {
+				fprintf(stderr, "numa placement must be interleave, first-touch or off\n");
+				exit(1);
+			}
+			break;
 		case 'r':
 			start_from_model = optarg;
 			break;
@@ -214,11 +452,11 @@ int main(int argc, char* argv[]) {
 	if (double_precision) {
 		train<double>(input_file.c_str(), ptest_file, model_file.c_str(),
 			pstart_from_model, cache, alpha, beta, l1, l2, dropout, feat_num,
-			epoch, push_step, fetch_step, num_threads, burn_in_phase, lock_free);
+			epoch, push_step, fetch_step, num_threads, burn_in_phase, lock_free, batch_size, option);
 	} else {
 		train<float>(input_file.c_str(), ptest_file, model_file.c_str(),
 			pstart_from_model, cache, alpha, beta, l1, l2, dropout, feat_num,
-			epoch, push_step, fetch_step, num_threads, burn_in_phase, lock_free);
+			epoch, push_step, fetch_step, num_threads, burn_in_phase, lock_free, batch_size, option);
 	}
 
 	return 0;
@@ -22,25 +22,395 @@
 #define SRC_FTRL_TRAIN_H
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <fstream>
+#include <memory>
+#include <random>
 #include <string>
 #include <utility>
 #include <vector>
+#include "src/checkpoint.h"
 #include "src/fast_ftrl_solver.h"
 #include "src/file_parser.h"
 #include "src/ftrl_solver.h"
+#include "src/in_memory_dataset.h"
+#include "src/parser_factory.h"
+#include "src/problem_cache.h"
+#include "src/sample_queue.h"
 #include "src/stopwatch.h"
 
+enum { kDefaultQueueDepth = 64, kDefaultMemBudget = 4096 };
+
+// samples trained between polls of the checkpoint interval
+enum { kCheckpointPoll = 4096 };
+
+// longest chain of delta checkpoints, all replayed by --resume
+enum { kMaxCheckpointDeltas = 1024 };
+
+// Options shared by trainers, defaults keep the original behavior
+struct TrainOption {
+	// threads dedicated to parsing, 0 lets trainer threads parse themselves
+	size_t parser_threads;
+	// number of parsed sample batches buffered between parsers and trainers
+	size_t queue_depth;
+	// keep parsed train/test data in memory across epochs
+	bool in_memory_train;
+	bool in_memory_test;
+	// MB shared by in-memory datasets, streaming is used beyond it
+	size_t mem_budget;
+	// visit train data blocks in a different random order every epoch
+	bool shuffle_blocks;
+	// hash feature names into 2^hash_bits weights, no counting pass, 0 is off
+	size_t hash_bits;
+	// keep parameters in a hash table of features seen rather than an array
+	// indexed up to the largest feature, no counting pass either
+	bool sparse_params;
+	// keep n and z of the dense array in bfloat16
+	bool compact_params;
+	// features get state once seen admit_count times, counted by a sketch
+	// of 2^admit_bits counters, 0 or 1 admits all
+	size_t admit_count;
+	size_t admit_bits;
+	// approximate sigmoid of updates and log of the reported train loss
+	bool fast_math;
+	// reported train loss is taken on every loss_sample-th row
+	size_t loss_sample;
+	// binary state to start from is mapped shared and updated in place
+	bool shared_state;
+	// checksum of a mapped binary state is verified before training
+	bool verify_state;
+	// save model and state as text rather than binary
+	bool text_model;
+	// model holds non-zero weights only
+	bool sparse_model;
+	// save <model>.ckpt every checkpoint_seconds or checkpoint_samples
+	double checkpoint_seconds;
+	size_t checkpoint_samples;
+	// continue from <model>.ckpt, if there is one
+	bool resume;
+	// up to checkpoint_deltas checkpoints after a full one only hold the
+	// coordinates changed since the one before, in <model>.ckpt.<k>
+	size_t checkpoint_deltas;
+	// save <model>.save.delta of the changes since the state started from
+	// rather than the whole <model>.save
+	bool save_delta;
+	// coordinates per group of async ftrl, 0 is a cache line of them, and
+	// number of locks the groups share
+	size_t group_size;
+	size_t lock_stripes;
+
+	TrainOption()
+	: parser_threads(0), queue_depth(kDefaultQueueDepth),
+	in_memory_train(false), in_memory_test(false), mem_budget(kDefaultMemBudget),
+	shuffle_blocks(false), hash_bits(0), sparse_params(false), compact_params(false),
+	admit_count(0), admit_bits(kDefaultAdmitBits),
+	fast_math(FTRL_FAST_MATH_DEFAULT), loss_sample(1), shared_state(false),
+	verify_state(false),
+	text_model(false), sparse_model(false), checkpoint_seconds(0), checkpoint_samples(0),
+	resume(false), checkpoint_deltas(0), save_delta(false), group_size(0),
+	lock_stripes(kDefaultLockStripes) {}
+
+	// feature number is learnt by a scan of the train file
+	bool count_features() const { return hash_bits == 0 && !sparse_params; }
+};
+
+// Dense store needs memory for every index up to the largest one
+inline void report_param_alloc_failure(size_t feat_num, const TrainOption& option) {
+	if (!option.sparse_params) {
+		fprintf(stderr, "failed to allocate parameters of %zu features,"
+			" try --param-store sparse for huge sparse ID spaces\n", feat_num);
+	}
+}
+
+// Apply math, model format and feature admission settings of option to solver
+template<typename T>
+bool setup_solver(FtrlSolver<T>& solver, const TrainOption& option) {
+	solver.set_fast_math(option.fast_math);
+	solver.set_text_model(option.text_model);
+	solver.set_sparse_model(option.sparse_model);
+	if ((option.checkpoint_deltas > 0 || option.save_delta) && !solver.TrackChanges()) {
+		fprintf(stderr, "failed to allocate change marks of parameters\n");
+		return false;
+	}
+	if (option.admit_count <= 1) return true;
+
+	if (!solver.InitializeAdmission(option.admit_count, option.admit_bits)) {
+		fprintf(stderr, "failed to set up feature admission of %zu counts and %zu bits\n",
+			option.admit_count, option.admit_bits);
+		return false;
+	}
+	return true;
+}
+
+// Checkpoint of a run, binary state holding the input position
+inline std::string checkpoint_path(const char* model_file) {
+	return std::string(model_file) + ".ckpt";
+}
+
+// k-th delta checkpoint after the full one
+inline std::string checkpoint_delta_path(const char* model_file, size_t k) {
+	return checkpoint_path(model_file) + "." + std::to_string(k);
+}
+
+// Where a resumed run starts, the first samples of epoch are skipped
+struct TrainPosition {
+	size_t epoch;
+	size_t samples;
+	bool resumed;
+
+	TrainPosition() : epoch(0), samples(0), resumed(false) {}
+};
+
+// Full checkpoint the delta checkpoints written since apply to, base_checksum
+// is 0 until there is one
+struct CheckpointChain {
+	uint64_t base_checksum;
+	size_t deltas;
+
+	CheckpointChain() : base_checksum(0), deltas(0) {}
+};
+
+// Start solver from the checkpoint of model_file with option.resume, if
+// there is one. A checkpoint is never mapped shared, so it stays valid
+template<typename T>
+bool resume_checkpoint(FtrlSolver<T>& solver, const char* model_file,
+		const TrainOption& option, TrainPosition& start, CheckpointChain& chain) {
+	start = TrainPosition();
+	chain = CheckpointChain();
+	if (!option.resume) return true;
+
+	std::string path = checkpoint_path(model_file);
+	ModelFileHeader header;
+	if (!read_model_header(path.c_str(), header)) {
+		fprintf(stdout, "no checkpoint %s, training from the start\n", path.c_str());
+		return true;
+	}
+
+	solver.set_shared_state(false);
+	solver.set_verify_state(option.verify_state);
+	bool suc = solver.Initialize(path.c_str());
+	solver.set_shared_state(option.shared_state);
+	if (!suc) {
+		fprintf(stderr, "failed to resume from %s\n", path.c_str());
+		return false;
+	}
+
+	start.epoch = header.epoch;
+	start.samples = header.samples;
+	start.resumed = true;
+
+	// deltas of an older full checkpoint are left behind by a crash
+	chain.base_checksum = header.checksum;
+	for (size_t k = 1; ; ++k) {
+		std::string delta = checkpoint_delta_path(model_file, k);
+		ModelFileHeader delta_header;
+		if (!read_model_header(delta.c_str(), delta_header)
+				|| delta_header.base_checksum != chain.base_checksum) {
+			break;
+		}
+		if (!solver.ApplyDelta(delta.c_str(), &delta_header)) {
+			fprintf(stderr, "failed to resume from %s\n", delta.c_str());
+			return false;
+		}
+		path = delta;
+		start.epoch = delta_header.epoch;
+		start.samples = delta_header.samples;
+		chain.deltas = k;
+	}
+
+	fprintf(stdout, "resumed from %s at epoch=%zu processed=[%zu]\n",
+		path.c_str(), start.epoch, start.samples);
+	return true;
+}
+
+// Drop the delta checkpoints of model_file from the k-th on
+inline void remove_checkpoint_deltas(const char* model_file, size_t k) {
+	while (remove(checkpoint_delta_path(model_file, k).c_str()) == 0) ++k;
+}
+
+// Skip samples of parser trained before the checkpoint, returns how many
+template<typename T>
+size_t skip_samples(FileParserBase<T>* parser, size_t num) {
+	std::vector<std::pair<size_t, T> > x;
+	T y;
+	size_t count = 0;
+	while (count < num && parser->ReadSample(y, x)) ++count;
+	return count;
+}
+
+// Save a checkpoint of solver at samples of epoch in the background,
+// total counts the samples of the run for the checkpoint interval. A delta
+// follows the full checkpoint of chain until option.checkpoint_deltas are
+// written, chain is updated by the background thread. With snapshot the
+// caller holds training still, so the state is copied here and is exactly
+// that at samples, the background thread copies it while training goes on
+// otherwise
+template<typename T>
+void start_checkpoint(Checkpointer& checkpointer, FtrlSolver<T>& solver,
+		const char* model_file, const TrainOption& option, CheckpointChain& chain,
+		size_t epoch, size_t samples, size_t total, bool snapshot) {
+	// no save runs when one is due, so chain is not changed meanwhile
+	bool delta = chain.base_checksum != 0 && chain.deltas < option.checkpoint_deltas;
+	std::string path = delta ? checkpoint_delta_path(model_file, chain.deltas + 1)
+		: checkpoint_path(model_file);
+
+	typedef typename FtrlSolver<T>::StateSnapshot StateSnapshot;
+	std::shared_ptr<StateSnapshot> state;
+	if (snapshot) {
+		state = std::make_shared<StateSnapshot>();
+		bool suc = delta
+			? solver.TakeDelta(*state, kDirtyCheckpoint, chain.base_checksum, epoch, samples)
+			: solver.TakeCheckpoint(*state, epoch, samples);
+		if (!suc) {
+			fprintf(stderr, "failed to copy checkpoint %s\n", path.c_str());
+			return;
+		}
+	}
+
+	std::string model = model_file;
+	bool track = option.checkpoint_deltas > 0;
+	uint64_t base_checksum = chain.base_checksum;
+	checkpointer.Start([&solver, &chain, state, model, path, delta, track, base_checksum,
+			epoch, samples] {
+		bool suc = false;
+		if (state) {
+			suc = solver.WriteSnapshot(path.c_str(), *state);
+		} else if (delta) {
+			suc = solver.SaveDelta(path.c_str(), kDirtyCheckpoint, base_checksum,
+				epoch, samples, 1);
+		} else {
+			suc = solver.SaveCheckpoint(path.c_str(), epoch, samples);
+		}
+		if (!suc) {
+			fprintf(stderr, "failed to save checkpoint %s\n", path.c_str());
+			return;
+		}
+
+		ModelFileHeader header;
+		if (delta) {
+			++chain.deltas;
+		} else if (track && read_model_header(path.c_str(), header)) {
+			remove_checkpoint_deltas(model.c_str(), 1);
+			chain.base_checksum = header.checksum;
+			chain.deltas = 0;
+		}
+	}, total);
+}
+
+// Save the model once the last checkpoint is written, which is dropped then.
+// With option.save_delta the state is saved as a delta of the binary state
+// trained from, which ftrl_convert --compact merges into it
+template<typename T>
+bool save_trained(FtrlSolver<T>& solver, Checkpointer& checkpointer,
+		const char* model_file, const TrainOption& option, const TrainPosition& start) {
+	checkpointer.Wait();
+
+	bool delta = option.save_delta && !option.text_model;
+	if (delta && (start.resumed || option.shared_state || solver.loaded_checksum() == 0)) {
+		fprintf(stdout, "no binary state to save a delta of, saving the full state\n");
+		delta = false;
+	}
+	if (!delta) {
+		if (!solver.SaveModelAll(model_file)) return false;
+	} else {
+		std::string path = std::string(model_file) + ".save.delta";
+		if (!solver.SaveModel(model_file)
+				|| !solver.SaveDelta(path.c_str(), kDirtyExport, solver.loaded_checksum())) {
+			return false;
+		}
+	}
+
+	if (checkpointer.enabled() || option.resume) {
+		remove_checkpoint_deltas(model_file, 1);
+		remove(checkpoint_path(model_file).c_str());
+	}
+	return true;
+}
+
+// Tell how parameter arrays are backed, unless by the default policy
+inline void report_param_alloc() {
+	if (!param_alloc_policy().is_default()) {
+		fprintf(stdout, "%s\n", param_alloc_report().c_str());
+	}
+}
+
+// Train input as learnt by the counting pass, feat_num is 0 if not counted
+struct TrainInput {
+	size_t feat_num;
+	bool binary;
+
+	TrainInput() : feat_num(0), binary(false) {}
+};
+
+// Specialize updates of solver to the train input once per run. Values are
+// binary as the counting pass or the in-memory load saw them, indices fit a
+// dense store covering the counted features or those hashed from text
+template<typename T>
+void select_update(FtrlSolver<T>& solver, const TrainOption& option,
+		const TrainInput& input, const InMemoryDataset<T>& train_data,
+		const char* train_file) {
+	bool binary = train_data.loaded() ? train_data.binary() : input.binary;
+	bool in_range = false;
+	if (!solver.sparse()) {
+		size_t feat_num = option.hash_bits > 0 && !is_binary_file(train_file)
+			? (size_t)1 << option.hash_bits : input.feat_num;
+		in_range = feat_num > 0 && feat_num <= solver.feat_num();
+	}
+	solver.SelectUpdate(binary, in_range);
+}
+
+// block_index receives byte offsets of blocks of a text file, see problem_cache.h,
+// binary whether all feature values are 1, false if not known
 template<typename T>
 size_t read_problem_info(
 	const char* train_file,
 	bool read_cache,
 	size_t& line_cnt,
-	size_t num_threads = 0);
+	size_t num_threads = 0,
+	std::vector<size_t>* block_index = NULL,
+	bool* binary = NULL);
 
 template<typename T, class Func>
-T evaluate_file(const char* path, const Func& func_predict, size_t num_threads = 0);
+T evaluate_file(
+	const char* path,
+	const Func& func_predict,
+	size_t num_threads = 0,
+	InMemoryDataset<T>* dataset = NULL,
+	size_t hash_bits = 0);
+
+template<typename T>
+bool load_in_memory(
+	InMemoryDataset<T>& dataset,
+	const char* path,
+	size_t num_threads,
+	size_t mem_budget,
+	size_t hash_bits = 0);
+
+template<typename T>
+FileParserBase<T>* open_data_source(
+	const char* path,
+	InMemoryDataset<T>* dataset,
+	std::unique_ptr<FileParserBase<T> >& holder,
+	size_t hash_bits = 0);
+
+template<typename T>
+void shuffle_blocks(
+	FileParserBase<T>* parser,
+	const std::vector<size_t>& block_index,
+	size_t epoch);
+
+// Print training progress, in percent when line count is known
+inline void print_progress(const char* phase, size_t count, size_t line_cnt,
+		double time, double loss, char end) {
+	if (line_cnt > 0) {
+		fprintf(stdout, "%s processed=[%.2f%%] time=[%.2f] train-loss=[%.6f]%c",
+			phase, count * 100 / static_cast<float>(line_cnt), time, loss, end);
+	} else {
+		fprintf(stdout, "%s processed=[%zu] time=[%.2f] train-loss=[%.6f]%c",
+			phase, count, time, loss, end);
+	}
+}
 
 template<typename T>
 T calc_loss(T y, T pred) {
@@ -52,6 +422,59 @@ T calc_loss(T y, T pred) {
 	return loss;
 }
 
+template<typename T>
+T calc_loss_fast(T y, T pred) {
+	T max_sigmoid = static_cast<T>(MAX_SIGMOID);
+	T min_sigmoid = static_cast<T>(MIN_SIGMOID);
+	T one = 1.;
+	pred = std::max(std::min(pred, max_sigmoid), min_sigmoid);
+	float p = static_cast<float>(y > 0 ? pred : std::max(one - pred, min_sigmoid));
+	return -fast_log(p);
+}
+
+// Train loss shown with progress. It does not steer training, so it may be
+// taken on every loss_sample-th row only and by fast_log
+template<typename T>
+class LossMeter {
+public:
+	explicit LossMeter(const TrainOption& option)
+	: sample_rows_(std::max(option.loss_sample, (size_t)1)), fast_log_(option.fast_math),
+	rows_(0), count_(0), loss_(0) {}
+
+	void Add(T y, T pred) {
+		if (++rows_ < sample_rows_) return;
+
+		rows_ = 0;
+		loss_ += fast_log_ ? calc_loss_fast(y, pred) : calc_loss(y, pred);
+		++count_;
+	}
+
+	void Merge(const LossMeter<T>& other) {
+		loss_ += other.loss_;
+		count_ += other.count_;
+	}
+
+	float mean() const { return count_ > 0 ? static_cast<float>(loss_ / count_) : 0; }
+
+private:
+	size_t sample_rows_;
+	bool fast_log_;
+	size_t rows_;
+	size_t count_;
+	T loss_;
+};
+
+// Sort (index, gradient) pairs by index and sum those of the same index
+template<typename T>
+void coalesce_gradients(std::vector<std::pair<size_t, T> >& grads);
+
+// Merge coalesced gradients a and b into out, coalesced as well
+template<typename T>
+void merge_gradients(
+	const std::vector<std::pair<size_t, T> >& a,
+	const std::vector<std::pair<size_t, T> >& b,
+	std::vector<std::pair<size_t, T> >& out);
+
 template<typename T>
 class FtrlTrainer {
 public:
@@ -61,6 +484,8 @@ public:
 
 	bool Initialize(size_t epoch, bool cache_feature_num = true);
 
+	void SetOption(const TrainOption& option) { option_ = option; }
+
 	bool Train(
 		T alpha,
 		T beta,
@@ -89,6 +514,11 @@ private:
 	size_t epoch_;
 	bool cache_feature_num_;
 	FtrlSolver<T> solver_;
+	TrainOption option_;
+	InMemoryDataset<T> train_data_;
+	InMemoryDataset<T> test_data_;
+	std::vector<size_t> block_index_;
+	TrainInput input_;
 	bool init_;
     bool read_stdin_;
 };
@@ -105,6 +535,8 @@ public:
 		size_t num_threads,
 		bool cache_feature_num = true);
 
+	void SetOption(const TrainOption& option) { option_ = option; }
+
 	bool Train(
 		T alpha,
 		T beta,
@@ -133,6 +565,11 @@ private:
 	bool cache_feature_num_;
 	FtrlSolver<T> solver_;
 	size_t num_threads_;
+	TrainOption option_;
+	InMemoryDataset<T> train_data_;
+	InMemoryDataset<T> test_data_;
+	std::vector<size_t> block_index_;
+	TrainInput input_;
 	bool init_;
 };
 
@@ -151,6 +588,8 @@ public:
 		size_t push_step = kPushStep,
 		size_t fetch_step = kFetchStep);
 
+	void SetOption(const TrainOption& option);
+
 	bool Train(
 		T alpha,
 		T beta,
@@ -183,7 +622,70 @@ private:
 
 	FtrlParamServer<T> param_server_;
 	size_t num_threads_;
+	TrainOption option_;
+	InMemoryDataset<T> train_data_;
+	InMemoryDataset<T> test_data_;
+	std::vector<size_t> block_index_;
+	TrainInput input_;
+
+	bool init_;
+};
+
+// Synchronous data-parallel trainer: samples of a mini-batch are split into
+// fixed-size shards whose gradients are taken against the weights frozen for
+// the batch, coalesced per shard, merged by a pairwise tree and applied as
+// one FTRL step per coordinate. Models only depend on batch size, not on
+// thread count or scheduling.
+template<typename T>
+class MiniBatchFtrlTrainer {
+public:
+	MiniBatchFtrlTrainer();
+
+	virtual ~MiniBatchFtrlTrainer();
+
+	bool Initialize(
+		size_t epoch,
+		size_t num_threads,
+		size_t batch_size,
+		bool cache_feature_num = true);
+
+	void SetOption(const TrainOption& option) { option_ = option; }
+
+	bool Train(
+		T alpha,
+		T beta,
+		T l1,
+		T l2,
+		T dropout,
+		const char* model_file,
+		const char* train_file,
+		const char* test_file = NULL);
+
+	bool Train(
+		const char* last_model,
+		const char* model_file,
+		const char* train_file,
+		const char* test_file = NULL);
+
+protected:
+	enum { kShardSize = 128 };
+
+	bool TrainImpl(
+		const char* model_file,
+		const char* train_file,
+		size_t line_cnt,
+		const char* test_file = NULL);
 
+private:
+	size_t epoch_;
+	bool cache_feature_num_;
+	size_t batch_size_;
+	FtrlSolver<T> solver_;
+	size_t num_threads_;
+	TrainOption option_;
+	InMemoryDataset<T> train_data_;
+	InMemoryDataset<T> test_data_;
+	std::vector<size_t> block_index_;
 	bool init_;
 };
 
@@ -224,18 +726,27 @@ bool FtrlTrainer<T>::Train(
         cache_feature_num_ = false;
     }
 	size_t line_cnt = 0;
-    if (!read_stdin_) {
-	    feat_num = read_problem_info<T>(train_file, cache_feature_num_, line_cnt);
+	if (option_.hash_bits > 0) {
+		feat_num = (size_t)1 << option_.hash_bits;
+	} else if (!read_stdin_ && !option_.sparse_params) {
+	    feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, 0, &block_index_, &input_.binary);
+		input_.feat_num = feat_num;
     }
-	if (feat_num == 0) {
+	if (feat_num == 0 && !option_.sparse_params) {
 	    printf("Usage: ./ftrl_train -f input_file -m model_file [options]\n"
 		    "options:\n"
 		    "--feat-num num : when use stdin as input_file, set feature num, default is 0\n"
+		    "--hash-bits bits : or hash features into 2^bits weights\n"
+		    "--param-store sparse : or store weights of features seen only\n"
         );
         return false;
     }
 
-	if (!solver_.Initialize(alpha, beta, l1, l2, feat_num, dropout)) {
+	if (!solver_.Initialize(alpha, beta, l1, l2,
+			option_.sparse_params ? 0 : feat_num, dropout, option_.sparse_params,
+			option_.compact_params)) {
+		report_param_alloc_failure(feat_num, option_);
 		return false;
 	}
 
@@ -256,11 +767,14 @@ bool FtrlTrainer<T>::Train(
     }
 
 	size_t line_cnt = 0;
-	if (!read_stdin_) {
-		size_t feat_num = read_problem_info<T>(train_file, cache_feature_num_, line_cnt);
-		if (feat_num == 0) return false;
+	if (!read_stdin_ && option_.count_features()) {
+		input_.feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, 0, &block_index_, &input_.binary);
+		if (input_.feat_num == 0) return false;
 	}
 
+	solver_.set_shared_state(option_.shared_state);
+	solver_.set_verify_state(option_.verify_state);
 	if (!solver_.Initialize(last_model)) {
 		return false;
 	}
@@ -275,6 +789,10 @@ bool FtrlTrainer<T>::TrainImpl(
 		size_t line_cnt,
 		const char* test_file) {
 	if (!init_) return false;
+	TrainPosition start;
+	CheckpointChain chain;
+	if (!resume_checkpoint(solver_, model_file, option_, start, chain)) return false;
+	if (!setup_solver(solver_, option_)) return false;
 
 	fprintf(
 		stdout,
@@ -290,21 +808,49 @@ bool FtrlTrainer<T>::TrainImpl(
 		return solver_.Predict(x);
 	};
 
+	// single thread load keeps samples in file order
+	size_t mem_budget = option_.mem_budget << 20;
+	if (option_.in_memory_train && !read_stdin_
+			&& load_in_memory(train_data_, train_file, 1, mem_budget, option_.hash_bits)) {
+		mem_budget -= train_data_.mem_bytes();
+	}
+	if (option_.in_memory_test && test_file) {
+		load_in_memory(test_data_, test_file, 0, mem_budget, option_.hash_bits);
+	}
+	select_update(solver_, option_, input_, train_data_, train_file);
+	report_param_alloc();
+
+	Checkpointer checkpointer;
+	checkpointer.Initialize(option_.checkpoint_seconds, option_.checkpoint_samples);
+	size_t total_cnt = 0;
+
 	StopWatch timer;
 	double last_time = 0;
-	for (size_t iter = 0; iter < epoch_; ++iter) {
-		FileParser<T> file_parser;
-		file_parser.OpenFile(train_file);
+	for (size_t iter = start.epoch; iter < epoch_; ++iter) {
+		std::unique_ptr<FileParserBase<T> > holder;
+		FileParserBase<T>* file_parser = open_data_source(
+			train_file, &train_data_, holder, option_.hash_bits);
+		if (option_.shuffle_blocks) {
+			shuffle_blocks(file_parser, block_index_, iter);
+		}
 		std::vector<std::pair<size_t, T> > x;
 		T y;
-
-		size_t cur_cnt = 0, last_cnt = 0;
-		T loss = 0;
-		while (file_parser.ReadSample(y, x)) {
-			T pred = solver_.Update(x, y);
-			loss += calc_loss(y, pred);
+		FtrlScratch<T> scratch;
+
+		size_t skipped = iter == start.epoch ? skip_samples(file_parser, start.samples) : 0;
+		size_t cur_cnt = skipped, last_cnt = skipped;
+		LossMeter<T> loss(option_);
+		while (file_parser->ReadSample(y, x)) {
+			T pred = solver_.Update(x, y, scratch);
+			loss.Add(y, pred);
 			++cur_cnt;
 
+			size_t trained = total_cnt + cur_cnt - skipped;
+			if (trained % kCheckpointPoll == 0 && checkpointer.Due(trained)) {
+				start_checkpoint(checkpointer, solver_, model_file, option_, chain,
+					iter, cur_cnt, trained, true);
+			}
+
 			if (cur_cnt - last_cnt > 100000 && timer.StopTimer() - last_time > 0.5) {
                 if (!read_stdin_ && line_cnt > 0) {
                     fprintf(
@@ -313,7 +859,7 @@ bool FtrlTrainer<T>::TrainImpl(
                         iter,
                         cur_cnt * 100 / static_cast<float>(line_cnt),
                         timer.ElapsedTime(),
-                        static_cast<float>(loss) / cur_cnt);
+                        loss.mean());
                 }
                 else {
                     fprintf(
@@ -322,7 +868,7 @@ bool FtrlTrainer<T>::TrainImpl(
                         iter,
                         cur_cnt,
                         timer.ElapsedTime(),
-                        static_cast<float>(loss) / cur_cnt);
+                        loss.mean());
                 }
 				fflush(stdout);
 				last_cnt = cur_cnt;
@@ -337,7 +883,7 @@ bool FtrlTrainer<T>::TrainImpl(
                 iter,
                 cur_cnt * 100 / static_cast<float>(line_cnt),
                 timer.ElapsedTime(),
-                static_cast<float>(loss) / cur_cnt);
+                loss.mean());
         }
         else {
             fprintf(
@@ -346,17 +892,19 @@ bool FtrlTrainer<T>::TrainImpl(
                 iter,
                 cur_cnt,
                 timer.ElapsedTime(),
-                static_cast<float>(loss) / cur_cnt);
+                loss.mean());
         }
-		file_parser.CloseFile();
+		file_parser->CloseFile();
+		total_cnt += cur_cnt - skipped;
 
 		if (test_file) {
-			T eval_loss = evaluate_file<T>(test_file, predict_func);
+			T eval_loss = evaluate_file<T>(
+				test_file, predict_func, 0, &test_data_, option_.hash_bits);
 			printf("validation-loss=[%lf]\n", static_cast<double>(eval_loss));
 		}
 	}
 
-	return solver_.SaveModelAll(model_file);
+	return save_trained(solver_, checkpointer, model_file, option_, start);
 }
 
 
@@ -395,10 +943,20 @@ bool LockFreeFtrlTrainer<T>::Train(
 	if (!init_) return false;
 
 	size_t line_cnt = 0;
-	size_t feat_num = read_problem_info<T>(train_file, cache_feature_num_, line_cnt, num_threads_);
-	if (feat_num == 0) return false;
+	size_t feat_num = 0;
+	if (option_.hash_bits > 0) {
+		feat_num = (size_t)1 << option_.hash_bits;
+	} else if (!option_.sparse_params) {
+		feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, num_threads_, &block_index_, &input_.binary);
+		if (feat_num == 0) return false;
+		input_.feat_num = feat_num;
+	}
 
-	if (!solver_.Initialize(alpha, beta, l1, l2, feat_num, dropout)) {
+	if (!solver_.Initialize(alpha, beta, l1, l2,
+			option_.sparse_params ? 0 : feat_num, dropout, option_.sparse_params,
+			option_.compact_params)) {
+		report_param_alloc_failure(feat_num, option_);
 		return false;
 	}
 
@@ -414,9 +972,14 @@ bool LockFreeFtrlTrainer<T>::Train(
 	if (!init_) return false;
 
 	size_t line_cnt = 0;
-	size_t feat_num = read_problem_info<T>(train_file, cache_feature_num_, line_cnt, num_threads_);
-	if (feat_num == 0) return false;
+	if (option_.count_features()) {
+		input_.feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, num_threads_, &block_index_, &input_.binary);
+		if (input_.feat_num == 0) return false;
+	}
 
+	solver_.set_shared_state(option_.shared_state);
+	solver_.set_verify_state(option_.verify_state);
 	if (!solver_.Initialize(last_model)) {
 		return false;
 	}
@@ -431,6 +994,10 @@ bool LockFreeFtrlTrainer<T>::TrainImpl(
 		size_t line_cnt,
 		const char* test_file) {
 	if (!init_) return false;
+	TrainPosition start;
+	CheckpointChain chain;
+	if (!resume_checkpoint(solver_, model_file, option_, start, chain)) return false;
+	if (!setup_solver(solver_, option_)) return false;
 
 	fprintf(
 		stdout,
@@ -446,66 +1013,110 @@ bool LockFreeFtrlTrainer<T>::TrainImpl(
 		return solver_.Predict(x);
 	};
 
+	size_t mem_budget = option_.mem_budget << 20;
+	if (option_.in_memory_train
+			&& load_in_memory(
+				train_data_, train_file, num_threads_, mem_budget, option_.hash_bits)) {
+		mem_budget -= train_data_.mem_bytes();
+	}
+	if (option_.in_memory_test && test_file) {
+		load_in_memory(test_data_, test_file, num_threads_, mem_budget, option_.hash_bits);
+	}
+	select_update(solver_, option_, input_, train_data_, train_file);
+	report_param_alloc();
+
+	Checkpointer checkpointer;
+	checkpointer.Initialize(option_.checkpoint_seconds, option_.checkpoint_samples);
+	size_t total_cnt = 0;
+
 	StopWatch timer;
-	for (size_t iter = 0; iter < epoch_; ++iter) {
-		FileParser<T> file_parser;
-		file_parser.OpenFile(train_file);
+	for (size_t iter = start.epoch; iter < epoch_; ++iter) {
+		std::unique_ptr<FileParserBase<T> > holder;
+		FileParserBase<T>* file_parser = open_data_source(
+			train_file, &train_data_, holder, option_.hash_bits);
+		if (option_.shuffle_blocks) {
+			shuffle_blocks(file_parser, block_index_, iter);
+		}
+		size_t skipped = iter == start.epoch ? skip_samples(file_parser, start.samples) : 0;
 
-		size_t count = 0;
-		T loss = 0;
+		size_t count = skipped;
+		// samples trained by workers, counted every kCheckpointPoll
+		std::atomic<size_t> trained(0);
+		LossMeter<T> loss(option_);
+		char phase[32];
+		snprintf(phase, sizeof(phase), "epoch=%zu", iter);
 
 		SpinLock lock;
+		BatchPrefetcher<T> prefetcher;
 		auto worker_func = [&] (size_t i) {
 			std::vector<std::pair<size_t, T> > x;
 			T y;
+			FtrlScratch<T> scratch;
 			size_t local_count = 0;
-			T local_loss = 0;
-			while (1) {
-				if (!file_parser.ReadSampleMultiThread(y, x)) {
-					break;
-				}
-
-				T pred = solver_.Update(x, y);
-				local_loss += calc_loss(y, pred);
+			LossMeter<T> local_loss(option_);
+			auto train_sample = [&] (const std::vector<std::pair<size_t, T> >& x, T y) {
+				T pred = solver_.Update(x, y, scratch);
+				local_loss.Add(y, pred);
 				++local_count;
 
+				// the position counts samples done, not a prefix of the file:
+				// samples other threads hold may be skipped on resume, and the
+				// state is copied while they train
+				if (local_count % kCheckpointPoll == 0) {
+					size_t done = trained += kCheckpointPoll;
+					if (i == 0 && checkpointer.Due(total_cnt + done)) {
+						start_checkpoint(checkpointer, solver_, model_file, option_, chain,
+							iter, skipped + done, total_cnt + done, false);
+					}
+				}
+
 				if (i == 0 && local_count % 10000 == 0) {
-					size_t tmp_cnt = std::min(local_count * num_threads_, line_cnt);
-					fprintf(
-						stdout,
-						"epoch=%zu processed=[%.2f%%] time=[%.2f] train-loss=[%.6f]\r",
-						iter,
-						tmp_cnt * 100 / static_cast<float>(line_cnt),
-						timer.StopTimer(),
-						static_cast<float>(local_loss) / local_count);
+					size_t tmp_cnt = local_count * num_threads_;
+					if (line_cnt > 0) tmp_cnt = std::min(tmp_cnt, line_cnt);
+					print_progress(phase, tmp_cnt, line_cnt, timer.StopTimer(),
+						local_loss.mean(), '\r');
 					fflush(stdout);
 				}
+			};
+
+			if (option_.parser_threads > 0) {
+				while (SampleBatch<T>* batch = prefetcher.Pop()) {
+					for (size_t k = 0; k < batch->size; ++k) {
+						train_sample(batch->x[k], batch->y[k]);
+					}
+					prefetcher.Release(batch);
+				}
+			} else {
+				while (file_parser->ReadSampleMultiThread(y, x)) {
+					train_sample(x, y);
+				}
 			} {
 				std::lock_guard<SpinLock> lockguard(lock);
 				count += local_count;
-				loss += local_loss;
+				loss.Merge(local_loss);
 			}
 		};
 
+		if (option_.parser_threads > 0) {
+			prefetcher.Start(file_parser, option_.parser_threads, option_.queue_depth);
+		}
 		util_parallel_run(worker_func, num_threads_);
+		prefetcher.Stop();
 
-		file_parser.CloseFile();
+		file_parser->CloseFile();
 
-		fprintf(
-			stdout,
-			"epoch=%zu processed=[%.2f%%] time=[%.2f] train-loss=[%.6f]\n",
-			iter,
-			count * 100 / static_cast<float>(line_cnt),
-			timer.StopTimer(),
-			static_cast<float>(loss) / count);
+		print_progress(phase, count, line_cnt, timer.StopTimer(),
+			loss.mean(), '\n');
+		total_cnt += count - skipped;
 
 		if (test_file) {
-			T eval_loss = evaluate_file<T>(test_file, predict_func);
+			T eval_loss = evaluate_file<T>(
+				test_file, predict_func, 0, &test_data_, option_.hash_bits);
 			printf("validation-loss=[%lf]\n", static_cast<double>(eval_loss));
 		}
 	}
 
-	return solver_.SaveModelAll(model_file);
+	return save_trained(solver_, checkpointer, model_file, option_, start);
 }
 
 
@@ -543,73 +1154,122 @@ bool FastFtrlTrainer<T>::Initialize(
 	return init_;
 }
 
+template<typename T>
+void FastFtrlTrainer<T>::SetOption(const TrainOption& option) {
+	option_ = option;
+	param_server_.set_group_size(option.group_size);
+	param_server_.set_lock_stripes(option.lock_stripes);
+}
+
+
+
 template<typename T>
 size_t read_problem_info(
 		const char* train_file,
 		bool read_cache,
 		size_t& line_cnt,
-		size_t num_threads) {
-	size_t feat_num = 0;
-	line_cnt = 0;
+		size_t num_threads,
+		std::vector<size_t>* block_index,
+		bool* binary) {
+	ProblemInfo info;
+	if (binary) *binary = false;
 
 	SpinLock lock;
-	FileParser<T> parser;
-
-	auto read_from_cache = [&](const char* path) {
-		std::fstream fin;
-		fin.open(path, std::ios::in);
-		fin >> line_cnt >> feat_num;
-		if (!fin || fin.eof()) {
-			feat_num = 0;
-			line_cnt = 0;
-		}
-		fin.close();
-	};
-
-	auto write_to_cache = [&](const char* path) {
-		std::fstream fout;
-		fout.open(path, std::ios::out);
-		fout << line_cnt << "\t" << feat_num << "\n";
-		fout.close();
-	};
+	std::unique_ptr<FileParserBase<T> > parser(create_file_parser<T>(train_file));
+	std::vector<size_t> feat_count;
+	std::atomic<bool> count_freq(read_cache);
 
 	auto read_problem_worker = [&](size_t i) {
 		size_t local_max_feat = 0;
 		size_t local_count = 0;
+		size_t local_nnz = 0;
+		bool local_binary = true;
+		std::vector<size_t> local_feat_count;
 		std::vector<std::pair<size_t, T> > local_x;
 		T local_y;
 		while (1) {
-			if (!parser.ReadSampleMultiThread(local_y, local_x)) break;
+			if (!parser->ReadSampleMultiThread(local_y, local_x)) break;
 			for (auto& item : local_x) {
 				if (item.first + 1 > local_max_feat) local_max_feat = item.first + 1;
+				local_binary = local_binary && item.second == 1;
 			}
+			// feature frequency is only kept in cache file
+			if (count_freq.load(std::memory_order_relaxed)) {
+				for (auto& item : local_x) {
+					if (item.first >= kMaxFreqFeatures) {
+						// too sparse an ID space to count densely
+						count_freq = false;
+						std::vector<size_t>().swap(local_feat_count);
+						break;
+					}
+					if (item.first >= local_feat_count.size()) {
+						local_feat_count.resize(item.first + 1, 0);
+					}
+					++local_feat_count[item.first];
+				}
+			}
+			local_nnz += local_x.size() - 1;
 			++local_count;
 		} {
 			std::lock_guard<SpinLock> lockguard(lock);
-			line_cnt += local_count;
-			if (local_max_feat > feat_num) feat_num = local_max_feat;
+			info.line_cnt += local_count;
+			info.nnz += local_nnz;
+			if (local_max_feat > info.feat_num) info.feat_num = local_max_feat;
+			info.binary = info.binary && local_binary;
+			if (!count_freq) local_feat_count.clear();
+			if (local_feat_count.size() > feat_count.size()) {
+				feat_count.resize(local_feat_count.size(), 0);
+			}
+			for (size_t k = 0; k < local_feat_count.size(); ++k) {
+				feat_count[k] += local_feat_count[k];
+			}
 		}
 	};
 
+	// binary files carry the counts in their header
+	if (parser->OpenFile(train_file) && parser->ReadProblemInfo(line_cnt, info.feat_num)) {
+		parser->CloseFile();
+		fprintf(stdout, "instances=[%zu] features=[%zu]\n", line_cnt, info.feat_num);
+		return info.feat_num;
+	}
+	parser->CloseFile();
+
 	std::string cache_file = std::string(train_file) + ".cache";
-	bool cache_exists = FileParserBase<T>::FileExists(cache_file.c_str());
-	if (read_cache && cache_exists) {
-		read_from_cache(cache_file.c_str());
-	} else {
-		parser.OpenFile(train_file);
+	bool cache_valid = read_cache
+		&& read_problem_cache(cache_file.c_str(), train_file, info);
+	if (!cache_valid) {
+		info = ProblemInfo();
+		info.binary = true;
+		parser->OpenFile(train_file);
 		fprintf(stdout, "loading...");
 		fflush(stdout);
 		util_parallel_run(read_problem_worker, num_threads);
-		parser.CloseFile();
+		parser->CloseFile();
+
+		info.file_size = file_size_of(train_file);
+		if (info.file_size > 0) {
+			info.block_lines = kIndexBlockLines;
+			build_block_index(train_file, info.block_lines, info.block_index);
+		}
 	}
 
-	fprintf(stdout, "\rinstances=[%zu] features=[%zu]\n", line_cnt, feat_num);
+	fprintf(stdout, "\rinstances=[%zu] features=[%zu] nnz=[%zu]\n",
+		info.line_cnt, info.feat_num, info.nnz);
 
-	if (read_cache && !cache_exists) {
-		write_to_cache(cache_file.c_str());
+	if (read_cache && !cache_valid) {
+		if (!count_freq) feat_count.clear();
+		build_feat_freq(feat_count, info.feat_freq);
+		write_problem_cache(cache_file.c_str(), info);
 	}
 
-	return feat_num;
+	line_cnt = info.line_cnt;
+	if (block_index) {
+		block_index->swap(info.block_index);
+	}
+	if (binary) {
+		*binary = info.binary && info.line_cnt > 0;
+	}
+	return info.feat_num;
 }
 
 template<typename T>
@@ -625,10 +1285,24 @@ bool FastFtrlTrainer<T>::Train(
 	if (!init_) return false;
 
 	size_t line_cnt = 0;
-	size_t feat_num = read_problem_info<T>(train_file, cache_feature_num_, line_cnt, num_threads_);
-	if (feat_num == 0) return false;
+	size_t feat_num = 0;
+	if (!option_.count_features()) {
+		if (option_.hash_bits > 0) feat_num = (size_t)1 << option_.hash_bits;
+		// burn-in is a fraction of all lines, so they are still counted
+		if (util_greater(burn_in_, (T)0)) {
+			read_problem_info<T>(train_file, false, line_cnt, num_threads_);
+		}
+	} else {
+		feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, num_threads_, &block_index_, &input_.binary);
+		if (feat_num == 0) return false;
+		input_.feat_num = feat_num;
+	}
 
-	if (!param_server_.Initialize(alpha, beta, l1, l2, feat_num, dropout)) {
+	if (!param_server_.Initialize(alpha, beta, l1, l2,
+			option_.sparse_params ? 0 : feat_num, dropout, option_.sparse_params,
+			option_.compact_params)) {
+		report_param_alloc_failure(feat_num, option_);
 		return false;
 	}
 
@@ -644,9 +1318,19 @@ bool FastFtrlTrainer<T>::Train(
 	if (!init_) return false;
 
 	size_t line_cnt = 0;
-	size_t feat_num = read_problem_info<T>(train_file, cache_feature_num_, line_cnt, num_threads_);
-	if (feat_num == 0) return false;
+	if (!option_.count_features()) {
+		// burn-in is a fraction of all lines, so they are still counted
+		if (util_greater(burn_in_, (T)0)) {
+			read_problem_info<T>(train_file, false, line_cnt, num_threads_);
+		}
+	} else {
+		input_.feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, num_threads_, &block_index_, &input_.binary);
+		if (input_.feat_num == 0) return false;
+	}
 
+	param_server_.set_shared_state(option_.shared_state);
+	param_server_.set_verify_state(option_.verify_state);
 	if (!param_server_.Initialize(last_model)) {
 		return false;
 	}
@@ -661,6 +1345,10 @@ bool FastFtrlTrainer<T>::TrainImpl(
 		size_t line_cnt,
 		const char* test_file) {
 	if (!init_) return false;
+	TrainPosition start;
+	CheckpointChain chain;
+	if (!resume_checkpoint(param_server_, model_file, option_, start, chain)) return false;
+	if (!setup_solver(param_server_, option_)) return false;
 
 	fprintf(
 		stdout,
@@ -672,76 +1360,123 @@ bool FastFtrlTrainer<T>::TrainImpl(
 		static_cast<float>(param_server_.dropout()),
 		epoch_);
 
-	FtrlWorker<T>* solvers = new FtrlWorker<T>[num_threads_];
-	for (size_t i = 0; i < num_threads_; ++i) {
-		solvers[i].Initialize(&param_server_, push_step_, fetch_step_);
-	}
-
 	auto predict_func = [&] (const std::vector<std::pair<size_t, T> >& x) {
 		return param_server_.Predict(x);
 	};
 
+	size_t mem_budget = option_.mem_budget << 20;
+	if (option_.in_memory_train
+			&& load_in_memory(
+				train_data_, train_file, num_threads_, mem_budget, option_.hash_bits)) {
+		mem_budget -= train_data_.mem_bytes();
+	}
+	if (option_.in_memory_test && test_file) {
+		load_in_memory(test_data_, test_file, num_threads_, mem_budget, option_.hash_bits);
+	}
+
+	// workers take the update selected for the server, and first touch
+	// their arrays from threads of their own
+	select_update(param_server_, option_, input_, train_data_, train_file);
+	FtrlWorker<T>* solvers = new FtrlWorker<T>[num_threads_];
+	util_parallel_run([&] (size_t i) {
+		solvers[i].Initialize(&param_server_, push_step_, fetch_step_);
+	}, num_threads_);
+	report_param_alloc();
+
+	Checkpointer checkpointer;
+	checkpointer.Initialize(option_.checkpoint_seconds, option_.checkpoint_samples);
+	size_t total_cnt = 0;
+
 	StopWatch timer;
-	for (size_t iter = 0; iter < epoch_; ++iter) {
-		FileParser<T> file_parser;
-		file_parser.OpenFile(train_file);
-		size_t count = 0;
-		T loss = 0;
+	for (size_t iter = start.epoch; iter < epoch_; ++iter) {
+		std::unique_ptr<FileParserBase<T> > holder;
+		FileParserBase<T>* file_parser = open_data_source(
+			train_file, &train_data_, holder, option_.hash_bits);
+		if (option_.shuffle_blocks) {
+			shuffle_blocks(file_parser, block_index_, iter);
+		}
+		size_t skipped = iter == start.epoch ? skip_samples(file_parser, start.samples) : 0;
+		size_t count = skipped;
+		// samples read before workers start, skipped or burnt in
+		size_t offset = skipped;
+		// samples trained by workers, counted every kCheckpointPoll
+		std::atomic<size_t> trained(0);
+		LossMeter<T> loss(option_);
+		char phase[32];
+		snprintf(phase, sizeof(phase), "epoch=%zu", iter);
 
 		SpinLock lock;
+		BatchPrefetcher<T> prefetcher;
 		auto worker_func = [&] (size_t i) {
 			std::vector<std::pair<size_t, T> > x;
 			T y;
+			FtrlScratch<T> scratch;
 			size_t local_count = 0;
-			T local_loss = 0;
-			while (1) {
-				if (!file_parser.ReadSampleMultiThread(y, x)) {
-					break;
-				}
-
-				T pred = solvers[i].Update(x, y, &param_server_);
-				local_loss += calc_loss(y, pred);
+			LossMeter<T> local_loss(option_);
+			auto train_sample = [&] (const std::vector<std::pair<size_t, T> >& x, T y) {
+				T pred = solvers[i].Update(x, y, &param_server_, scratch);
+				local_loss.Add(y, pred);
 				++local_count;
 
+				// approximate position and state, as in LockFreeFtrlTrainer
+				if (local_count % kCheckpointPoll == 0) {
+					size_t done = trained += kCheckpointPoll;
+					if (i == 0 && checkpointer.Due(total_cnt + done)) {
+						start_checkpoint(checkpointer, param_server_, model_file, option_,
+							chain, iter, offset + done, total_cnt + done, false);
+					}
+				}
+
 				if (i == 0 && local_count % 10000 == 0) {
-					size_t tmp_cnt = std::min(local_count * num_threads_, line_cnt);
-					fprintf(
-						stdout,
-						"epoch=%zu processed=[%.2f%%] time=[%.2f] train-loss=[%.6f]\r",
-						iter,
-						tmp_cnt * 100 / static_cast<float>(line_cnt),
-						timer.StopTimer(),
-						static_cast<float>(local_loss) / local_count);
+					size_t tmp_cnt = local_count * num_threads_;
+					if (line_cnt > 0) tmp_cnt = std::min(tmp_cnt, line_cnt);
+					print_progress(phase, tmp_cnt, line_cnt, timer.StopTimer(),
+						local_loss.mean(), '\r');
 					fflush(stdout);
 				}
+			};
+
+			if (option_.parser_threads > 0) {
+				while (SampleBatch<T>* batch = prefetcher.Pop()) {
+					for (size_t k = 0; k < batch->size; ++k) {
+						train_sample(batch->x[k], batch->y[k]);
+					}
+					prefetcher.Release(batch);
+				}
+			} else {
+				while (file_parser->ReadSampleMultiThread(y, x)) {
+					train_sample(x, y);
+				}
 			} {
 				std::lock_guard<SpinLock> lockguard(lock);
 				count += local_count;
-				loss += local_loss;
+				loss.Merge(local_loss);
 			}
 
 			solvers[i].PushParam(&param_server_);
 		};
 
-		if (iter == 0 && util_greater(burn_in_, (T)0)) {
+		if (iter == 0 && skipped == 0 && util_greater(burn_in_, (T)0)) {
 			size_t burn_in_cnt = (size_t) (burn_in_ * line_cnt);
 			std::vector<std::pair<size_t, T> > x;
 			T y;
-			T local_loss = 0;
+			FtrlScratch<T> scratch;
+			LossMeter<T> local_loss(option_);
 			for (size_t i = 0; i < burn_in_cnt; ++i) {
-				if (!file_parser.ReadSample(y, x)) {
+				if (!file_parser->ReadSample(y, x)) {
 					break;
 				}
+				++offset;
 
-				T pred = param_server_.Update(x, y);
-				local_loss += calc_loss(y, pred);
+				T pred = param_server_.Update(x, y, scratch);
+				local_loss.Add(y, pred);
 				if (i % 10000 == 0) {
 					fprintf(
 						stdout,
 						"burn-in processed=[%.2f%%] time=[%.2f] train-loss=[%.6f]\r",
 						(i + 1) * 100 / static_cast<float>(line_cnt),
 						timer.StopTimer(),
-						static_cast<float>(local_loss) / (i + 1));
+						local_loss.mean());
 					fflush(stdout);
 				}
 			}
@@ -751,7 +1486,7 @@ bool FastFtrlTrainer<T>::TrainImpl(
 				"burn-in processed=[%.2f%%] time=[%.2f] train-loss=[%.6f]\n",
 				burn_in_cnt * 100 / static_cast<float>(line_cnt),
 				timer.StopTimer(),
-				static_cast<float>(local_loss) / burn_in_cnt);
+				local_loss.mean());
 
 			if (util_equal(burn_in_, (T)1)) continue;
 		}
@@ -760,32 +1495,286 @@ bool FastFtrlTrainer<T>::TrainImpl(
 			solvers[i].Reset(&param_server_);
 		}
 
+		if (option_.parser_threads > 0) {
+			prefetcher.Start(file_parser, option_.parser_threads, option_.queue_depth);
+		}
 		util_parallel_run(worker_func, num_threads_);
+		prefetcher.Stop();
 
-		file_parser.CloseFile();
+		file_parser->CloseFile();
 
-		fprintf(
-			stdout,
-			"epoch=%zu processed=[%.2f%%] time=[%.2f] train-loss=[%.6f]\n",
-			iter,
-			count * 100 / static_cast<float>(line_cnt),
-			timer.StopTimer(),
-			static_cast<float>(loss) / count);
+		print_progress(phase, count, line_cnt, timer.StopTimer(),
+			loss.mean(), '\n');
+		total_cnt += count - skipped;
 
 		if (test_file) {
-			T eval_loss = evaluate_file<T>(test_file, predict_func, num_threads_);
+			T eval_loss = evaluate_file<T>(
+				test_file, predict_func, num_threads_, &test_data_, option_.hash_bits);
 			printf("validation-loss=[%lf]\n", static_cast<double>(eval_loss));
 		}
 	}
 
 	delete [] solvers;
-	return param_server_.SaveModelAll(model_file);
+	return save_trained(param_server_, checkpointer, model_file, option_, start);
+}
+
+
+
+template<typename T>
+MiniBatchFtrlTrainer<T>::MiniBatchFtrlTrainer()
+: epoch_(0), cache_feature_num_(false), batch_size_(0), num_threads_(0), init_(false) { }
+
+template<typename T>
+MiniBatchFtrlTrainer<T>::~MiniBatchFtrlTrainer() {
+}
+
+template<typename T>
+bool MiniBatchFtrlTrainer<T>::Initialize(
+		size_t epoch,
+		size_t num_threads,
+		size_t batch_size,
+		bool cache_feature_num) {
+	if (batch_size == 0) return false;
+
+	epoch_ = epoch;
+	cache_feature_num_ = cache_feature_num;
+	batch_size_ = batch_size;
+	num_threads_ = num_threads > 0 ? num_threads
+		: std::max(std::thread::hardware_concurrency(), 1u);
+
+	init_ = true;
+	return init_;
+}
+
+template<typename T>
+bool MiniBatchFtrlTrainer<T>::Train(
+		T alpha,
+		T beta,
+		T l1,
+		T l2,
+		T dropout,
+		const char* model_file,
+		const char* train_file,
+		const char* test_file) {
+	if (!init_) return false;
+
+	size_t line_cnt = 0;
+	size_t feat_num = 0;
+	if (option_.hash_bits > 0) {
+		feat_num = (size_t)1 << option_.hash_bits;
+	} else if (!option_.sparse_params) {
+		feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, num_threads_, &block_index_);
+		if (feat_num == 0) return false;
+	}
+
+	if (!solver_.Initialize(alpha, beta, l1, l2,
+			option_.sparse_params ? 0 : feat_num, dropout, option_.sparse_params,
+			option_.compact_params)) {
+		report_param_alloc_failure(feat_num, option_);
+		return false;
+	}
+
+	return TrainImpl(model_file, train_file, line_cnt, test_file);
+}
+
+template<typename T>
+bool MiniBatchFtrlTrainer<T>::Train(
+		const char* last_model,
+		const char* model_file,
+		const char* train_file,
+		const char* test_file) {
+	if (!init_) return false;
+
+	size_t line_cnt = 0;
+	if (option_.count_features()) {
+		size_t feat_num = read_problem_info<T>(
+			train_file, cache_feature_num_, line_cnt, num_threads_, &block_index_);
+		if (feat_num == 0) return false;
+	}
+
+	solver_.set_shared_state(option_.shared_state);
+	solver_.set_verify_state(option_.verify_state);
+	if (!solver_.Initialize(last_model)) {
+		return false;
+	}
+
+	return TrainImpl(model_file, train_file, line_cnt, test_file);
+}
+
+template<typename T>
+bool MiniBatchFtrlTrainer<T>::TrainImpl(
+		const char* model_file,
+		const char* train_file,
+		size_t line_cnt,
+		const char* test_file) {
+	if (!init_) return false;
+	TrainPosition start;
+	CheckpointChain chain;
+	if (!resume_checkpoint(solver_, model_file, option_, start, chain)) return false;
+	if (!setup_solver(solver_, option_)) return false;
+
+	fprintf(
+		stdout,
+		"params={alpha:%.2f, beta:%.2f, l1:%.2f, l2:%.2f, dropout:%.2f, epoch:%zu,"
+		" batch:%zu}\n",
+		static_cast<float>(solver_.alpha()),
+		static_cast<float>(solver_.beta()),
+		static_cast<float>(solver_.l1()),
+		static_cast<float>(solver_.l2()),
+		static_cast<float>(solver_.dropout()),
+		epoch_,
+		batch_size_);
+
+	auto predict_func = [&] (const std::vector<std::pair<size_t, T> >& x) {
+		return solver_.Predict(x);
+	};
+
+	// single thread load keeps samples in file order
+	size_t mem_budget = option_.mem_budget << 20;
+	if (option_.in_memory_train
+			&& load_in_memory(train_data_, train_file, 1, mem_budget, option_.hash_bits)) {
+		mem_budget -= train_data_.mem_bytes();
+	}
+	if (option_.in_memory_test && test_file) {
+		load_in_memory(test_data_, test_file, num_threads_, mem_budget, option_.hash_bits);
+	}
+	report_param_alloc();
+
+	size_t max_shards = (batch_size_ + kShardSize - 1) / kShardSize;
+	std::vector<std::vector<std::pair<size_t, T> > > batch_x(batch_size_);
+	std::vector<T> batch_y(batch_size_);
+	// coalesced gradients of shards, reduced into grads[0]
+	std::vector<std::vector<std::pair<size_t, T> > > grads(max_shards);
+	std::vector<std::vector<std::pair<size_t, T> > > merged(max_shards);
+
+	Checkpointer checkpointer;
+	checkpointer.Initialize(option_.checkpoint_seconds, option_.checkpoint_samples);
+	size_t total_cnt = 0;
+
+	StopWatch timer;
+	for (size_t iter = start.epoch; iter < epoch_; ++iter) {
+		std::unique_ptr<FileParserBase<T> > holder;
+		FileParserBase<T>* file_parser = open_data_source(
+			train_file, &train_data_, holder, option_.hash_bits);
+		if (option_.shuffle_blocks) {
+			shuffle_blocks(file_parser, block_index_, iter);
+		}
+
+		size_t skipped = iter == start.epoch ? skip_samples(file_parser, start.samples) : 0;
+		size_t count = skipped;
+		size_t batch_cnt = 0;
+		// meters of threads, published after their shards of each batch
+		std::vector<LossMeter<T> > thread_loss(num_threads_, LossMeter<T>(option_));
+		auto merged_loss = [&] () {
+			LossMeter<T> loss(option_);
+			for (size_t t = 0; t < num_threads_; ++t) loss.Merge(thread_loss[t]);
+			return loss.mean();
+		};
+		char phase[32];
+		snprintf(phase, sizeof(phase), "epoch=%zu", iter);
+
+		SpinBarrier barrier(num_threads_);
+		auto worker_func = [&] (size_t i) {
+			FtrlScratch<T> scratch;
+			// kept across shards and batches, so that --loss-sample may
+			// exceed a shard
+			LossMeter<T> local_loss(option_);
+			while (true) {
+				// samples are read in order by one thread
+				if (i == 0) {
+					batch_cnt = 0;
+					while (batch_cnt < batch_size_
+							&& file_parser->ReadSample(batch_y[batch_cnt], batch_x[batch_cnt])) {
+						++batch_cnt;
+					}
+				}
+				barrier.Wait();
+
+				// every step of the batches before is applied and none of the next
+				// batch is before thread 0 passes the barrier after the gradients,
+				// so the copy is the state at count, written while training goes on
+				if (i == 0) {
+					size_t trained = total_cnt + count - skipped;
+					if (checkpointer.Due(trained)) {
+						start_checkpoint(checkpointer, solver_, model_file, option_, chain,
+							iter, count, trained, true);
+					}
+				}
+				if (batch_cnt == 0) break;
+
+				size_t shards = (batch_cnt + kShardSize - 1) / kShardSize;
+				for (size_t s = i; s < shards; s += num_threads_) {
+					size_t begin = s * kShardSize;
+					size_t end = std::min(begin + kShardSize, batch_cnt);
+					// dropout of a sample is seeded by its position in the epoch
+					scratch.SeedDropout(((uint64_t)iter << 48) ^ (count + begin));
+
+					grads[s].clear();
+					for (size_t k = begin; k < end; ++k) {
+						T pred = solver_.Gradient(batch_x[k], batch_y[k], scratch, grads[s]);
+						local_loss.Add(batch_y[k], pred);
+					}
+					coalesce_gradients(grads[s]);
+				}
+				thread_loss[i] = local_loss;
+				barrier.Wait();
+
+				// shard s takes in s + stride at each level of the tree
+				for (size_t stride = 1; stride < shards; stride *= 2) {
+					for (size_t s = i * stride * 2; s + stride < shards;
+							s += num_threads_ * stride * 2) {
+						merge_gradients(grads[s], grads[s + stride], merged[s]);
+						grads[s].swap(merged[s]);
+					}
+					barrier.Wait();
+				}
+
+				// threads step disjoint index ranges, the next batch is
+				// only read after every thread passes the barrier above
+				size_t total = grads[0].size();
+				size_t begin = total * i / num_threads_;
+				size_t end = total * (i + 1) / num_threads_;
+				solver_.ApplyGradients(grads[0].data() + begin, end - begin, scratch);
+
+				if (i == 0) {
+					if ((count + batch_cnt) / 10000 != count / 10000) {
+						print_progress(phase, count + batch_cnt, line_cnt, timer.StopTimer(),
+							merged_loss(), '\r');
+						fflush(stdout);
+					}
+					count += batch_cnt;
+				}
+			}
+		};
+
+		util_parallel_run(worker_func, num_threads_);
+
+		file_parser->CloseFile();
+
+		print_progress(phase, count, line_cnt, timer.StopTimer(),
+			merged_loss(), '\n');
+		total_cnt += count - skipped;
+
+		if (test_file) {
+			T eval_loss = evaluate_file<T>(
+				test_file, predict_func, 0, &test_data_, option_.hash_bits);
+			printf("validation-loss=[%lf]\n", static_cast<double>(eval_loss));
+		}
+	}
+
+	return save_trained(solver_, checkpointer, model_file, option_, start);
 }
 
 template<typename T, class Func>
-T evaluate_file(const char* path, const Func& func_predict, size_t num_threads) {
-	FileParser<T> parser;
-	parser.OpenFile(path);
+T evaluate_file(
+		const char* path,
+		const Func& func_predict,
+		size_t num_threads,
+		InMemoryDataset<T>* dataset,
+		size_t hash_bits) {
+	std::unique_ptr<FileParserBase<T> > holder;
+	FileParserBase<T>* parser = open_data_source(path, dataset, holder, hash_bits);
 
 	size_t count = 0;
 	T loss = 0;
@@ -796,7 +1785,7 @@ T evaluate_file(const char* path, const Func& func_predict, size_t num_threads)
 		std::vector<std::pair<size_t, T> > local_x;
 		T local_y;
 		while (1) {
-			bool res = parser.ReadSampleMultiThread(local_y, local_x);
+			bool res = parser->ReadSampleMultiThread(local_y, local_x);
 			if (!res) break;
 
 			local_loss += calc_loss(local_y, func_predict(local_x));
@@ -810,11 +1799,109 @@ T evaluate_file(const char* path, const Func& func_predict, size_t num_threads)
 
 	util_parallel_run(predict_worker, num_threads);
 
-	parser.CloseFile();
+	parser->CloseFile();
 	if (count > 0)  loss /= count;
 	return loss;
 }
 
+template<typename T>
+bool load_in_memory(
+		InMemoryDataset<T>& dataset,
+		const char* path,
+		size_t num_threads,
+		size_t mem_budget,
+		size_t hash_bits) {
+	std::unique_ptr<FileParserBase<T> > parser(create_file_parser<T>(path, hash_bits));
+	StopWatch timer;
+	fprintf(stdout, "loading %s into memory...", path);
+	fflush(stdout);
+	if (!dataset.Load(parser.get(), path, num_threads, mem_budget)) {
+		fprintf(stdout, "\r%s does not fit memory budget, streaming from file\n", path);
+		return false;
+	}
+
+	fprintf(stdout, "\r%s in memory: instances=[%zu] memory=[%.2fMB] time=[%.2f]\n",
+		path, dataset.line_cnt(), dataset.mem_bytes() / 1048576.0, timer.StopTimer());
+	return true;
+}
+
+template<typename T>
+void shuffle_blocks(
+		FileParserBase<T>* parser,
+		const std::vector<size_t>& block_index,
+		size_t epoch) {
+	// blocks of the index do not depend on thread count, so runs repeat
+	if (!block_index.empty()) {
+		parser->SetBlockIndex(block_index);
+	}
+
+	std::vector<size_t> order(parser->BlockCount());
+	for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+
+	std::mt19937 rng(static_cast<uint32_t>(epoch + 1));
+	std::shuffle(order.begin(), order.end(), rng);
+	parser->SetBlockOrder(order);
+}
+
+template<typename T>
+void coalesce_gradients(std::vector<std::pair<size_t, T> >& grads) {
+	if (grads.empty()) return;
+
+	std::sort(grads.begin(), grads.end(),
+		[] (const std::pair<size_t, T>& a, const std::pair<size_t, T>& b) {
+			return a.first < b.first;
+		});
+
+	size_t num = 0;
+	for (size_t k = 1; k < grads.size(); ++k) {
+		if (grads[k].first == grads[num].first) {
+			grads[num].second += grads[k].second;
+		} else {
+			grads[++num] = grads[k];
+		}
+	}
+	grads.resize(num + 1);
+}
+
+template<typename T>
+void merge_gradients(
+		const std::vector<std::pair<size_t, T> >& a,
+		const std::vector<std::pair<size_t, T> >& b,
+		std::vector<std::pair<size_t, T> >& out) {
+	out.clear();
+	out.reserve(a.size() + b.size());
+
+	size_t i = 0, j = 0;
+	while (i < a.size() && j < b.size()) {
+		if (a[i].first < b[j].first) {
+			out.push_back(a[i++]);
+		} else if (b[j].first < a[i].first) {
+			out.push_back(b[j++]);
+		} else {
+			out.push_back(std::make_pair(a[i].first, a[i].second + b[j].second));
+			++i;
+			++j;
+		}
+	}
+	out.insert(out.end(), a.begin() + i, a.end());
+	out.insert(out.end(), b.begin() + j, b.end());
+}
+
+template<typename T>
+FileParserBase<T>* open_data_source(
+		const char* path,
+		InMemoryDataset<T>* dataset,
+		std::unique_ptr<FileParserBase<T> >& holder,
+		size_t hash_bits) {
+	if (dataset && dataset->OpenFile(path)) {
+		return dataset;
+	}
+
+	holder.reset(create_file_parser<T>(path, hash_bits));
+	holder->OpenFile(path);
+	return holder.get();
+}
+
 
 #endif // SRC_FTRL_TRAIN_H
 /* vim: set ts=4 sw=4 tw=0 noet :*/
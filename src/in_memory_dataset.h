@@ -0,0 +1,329 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_IN_MEMORY_DATASET_H
+#define SRC_IN_MEMORY_DATASET_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "src/file_parser.h"
+#include "src/lock.h"
+#include "src/util.h"
+
+// InMemoryDataset: parsed samples kept in CSR shards, one shard per loading
+// thread, so later epochs and validation passes skip reading and parsing.
+// It serves samples through the FileParserBase interface, OpenFile rewinds.
+// Shards whose feature values are all 1 keep indices only.
+template<typename T>
+class InMemoryDataset : public FileParserBase<T> {
+public:
+	InMemoryDataset();
+	virtual ~InMemoryDataset() {}
+
+	// Parse path with parser using num_threads threads. Fails and frees
+	// everything once the parsed data grows beyond mem_budget bytes.
+	// A single thread keeps samples in file order.
+	bool Load(FileParserBase<T>* parser, const char* path,
+		size_t num_threads, size_t mem_budget);
+	void Clear();
+
+	bool loaded() const { return loaded_; }
+	const std::string& path() const { return path_; }
+	size_t line_cnt() const { return line_cnt_; }
+	size_t mem_bytes() const { return mem_bytes_; }
+	// every feature value loaded is 1
+	bool binary() const { return binary_; }
+
+	virtual bool OpenFile(const char* path);
+	virtual bool CloseFile() { return true; }
+
+	virtual bool ReadSample(T& y, std::vector<std::pair<size_t, T> >& x);
+	virtual bool ReadSampleMultiThread(T& y, std::vector<std::pair<size_t, T> >& x);
+
+	virtual size_t BlockCount() const { return blocks_.size(); }
+	virtual bool SetBlockOrder(const std::vector<size_t>& order);
+
+protected:
+	struct Shard {
+		std::vector<T> labels;
+		std::vector<size_t> offsets;
+		std::vector<uint32_t> indices;
+		// empty while binary
+		std::vector<T> values;
+		bool binary;
+
+		Shard() : binary(true) {}
+
+		size_t bytes() const {
+			return labels.capacity() * sizeof(T) + offsets.capacity() * sizeof(size_t)
+				+ indices.capacity() * sizeof(uint32_t) + values.capacity() * sizeof(T);
+		}
+	};
+
+	// rows [row_begin, row_end) of a shard
+	struct Block {
+		const Shard* shard;
+		size_t row_begin;
+		size_t row_end;
+	};
+
+	struct Cursor {
+		size_t open_id;
+		size_t block;
+		size_t row;
+	};
+
+	bool ClaimBlock(Cursor& cursor);
+	bool NextSample(Cursor& cursor, T& y, std::vector<std::pair<size_t, T> >& x);
+
+protected:
+	enum { kBlockRows = 4096, kBudgetCheckRows = 1024 };
+
+	std::vector<std::unique_ptr<Shard> > shards_;
+	std::vector<Block> blocks_;
+	// blocks are claimed in this order if not empty
+	std::vector<size_t> order_;
+	std::string path_;
+	size_t line_cnt_;
+	size_t mem_bytes_;
+	bool loaded_;
+	bool binary_;
+
+	std::atomic<size_t> next_block_;
+	Cursor seq_;
+	size_t open_id_;
+	SpinLock lock_;
+
+	static std::atomic<size_t> open_counter_;
+	static thread_local Cursor local_;
+};
+
+
+
+template<typename T>
+std::atomic<size_t> InMemoryDataset<T>::open_counter_(0);
+
+template<typename T>
+thread_local typename InMemoryDataset<T>::Cursor InMemoryDataset<T>::local_;
+
+template<typename T>
+InMemoryDataset<T>::InMemoryDataset()
+: line_cnt_(0), mem_bytes_(0), loaded_(false), binary_(false), next_block_(0), open_id_(0) {
+	seq_.open_id = 0;
+	seq_.block = seq_.row = 0;
+}
+
+template<typename T>
+void InMemoryDataset<T>::Clear() {
+	shards_.clear();
+	blocks_.clear();
+	order_.clear();
+	path_.clear();
+	line_cnt_ = 0;
+	mem_bytes_ = 0;
+	loaded_ = false;
+	binary_ = false;
+	open_id_ = 0;
+}
+
+template<typename T>
+bool InMemoryDataset<T>::Load(FileParserBase<T>* parser, const char* path,
+		size_t num_threads, size_t mem_budget) {
+	Clear();
+	if (!parser->OpenFile(path)) {
+		return false;
+	}
+
+	if (num_threads == 0) {
+		num_threads = std::thread::hardware_concurrency();
+	}
+
+	shards_.resize(num_threads);
+	for (size_t i = 0; i < num_threads; ++i) {
+		shards_[i].reset(new Shard());
+		shards_[i]->offsets.push_back(0);
+	}
+
+	std::atomic<size_t> total_bytes(0);
+	std::atomic<bool> failed(false);
+	auto load_worker = [&](size_t i) {
+		Shard& shard = *shards_[i];
+		std::vector<std::pair<size_t, T> > x;
+		T y;
+		size_t counted_bytes = 0;
+		while (!failed.load(std::memory_order_relaxed)) {
+			bool res = num_threads == 1 ? parser->ReadSample(y, x)
+				: parser->ReadSampleMultiThread(y, x);
+			if (!res) break;
+
+			// bias term is added back on read
+			for (size_t k = 1; k < x.size(); ++k) {
+				if (x[k].first > UINT32_MAX) {
+					fprintf(stderr, "feature index %zu beyond 32 bits, not cached\n", x[k].first);
+					failed = true;
+					break;
+				}
+				shard.indices.push_back(static_cast<uint32_t>(x[k].first));
+				if (shard.binary && x[k].second != 1) {
+					// values of 1 seen so far are filled in
+					shard.binary = false;
+					shard.values.assign(shard.indices.size() - 1, (T)1);
+				}
+				if (!shard.binary) shard.values.push_back(x[k].second);
+			}
+			shard.labels.push_back(y);
+			shard.offsets.push_back(shard.indices.size());
+
+			if (shard.labels.size() % kBudgetCheckRows == 0) {
+				size_t bytes = shard.bytes();
+				size_t total = total_bytes.fetch_add(bytes - counted_bytes) + bytes - counted_bytes;
+				counted_bytes = bytes;
+				if (total > mem_budget) {
+					failed = true;
+				}
+			}
+		}
+
+		shard.labels.shrink_to_fit();
+		shard.offsets.shrink_to_fit();
+		shard.indices.shrink_to_fit();
+		shard.values.shrink_to_fit();
+		total_bytes.fetch_add(shard.bytes() - counted_bytes);
+	};
+
+	util_parallel_run(load_worker, num_threads);
+	parser->CloseFile();
+
+	if (failed || total_bytes > mem_budget) {
+		Clear();
+		return false;
+	}
+
+	binary_ = true;
+	for (auto& shard : shards_) {
+		binary_ = binary_ && shard->binary;
+		size_t rows = shard->labels.size();
+		for (size_t begin = 0; begin < rows; begin += kBlockRows) {
+			Block block;
+			block.shard = shard.get();
+			block.row_begin = begin;
+			block.row_end = std::min(begin + (size_t)kBlockRows, rows);
+			blocks_.push_back(block);
+		}
+		line_cnt_ += rows;
+	}
+
+	path_ = path;
+	mem_bytes_ = total_bytes;
+	loaded_ = true;
+	return OpenFile(path);
+}
+
+template<typename T>
+bool InMemoryDataset<T>::OpenFile(const char* path) {
+	if (!loaded_ || path_ != path) {
+		return false;
+	}
+
+	order_.clear();
+	next_block_ = 0;
+	open_id_ = ++open_counter_;
+	seq_.open_id = open_id_;
+	seq_.block = blocks_.size();
+	seq_.row = 0;
+	return true;
+}
+
+template<typename T>
+bool InMemoryDataset<T>::SetBlockOrder(const std::vector<size_t>& order) {
+	if (!FileParserBase<T>::IsBlockOrder(order, BlockCount())) {
+		return false;
+	}
+
+	order_ = order;
+	return true;
+}
+
+template<typename T>
+bool InMemoryDataset<T>::ClaimBlock(Cursor& cursor) {
+	size_t block = next_block_.fetch_add(1, std::memory_order_relaxed);
+	if (block >= blocks_.size()) {
+		return false;
+	}
+	if (!order_.empty()) {
+		block = order_[block];
+	}
+
+	cursor.block = block;
+	cursor.row = blocks_[block].row_begin;
+	return true;
+}
+
+template<typename T>
+bool InMemoryDataset<T>::NextSample(Cursor& cursor, T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	if ((cursor.block >= blocks_.size() || cursor.row >= blocks_[cursor.block].row_end)
+			&& !ClaimBlock(cursor)) {
+		return false;
+	}
+
+	const Shard& shard = *blocks_[cursor.block].shard;
+	size_t row = cursor.row++;
+
+	y = shard.labels[row];
+	x.clear();
+	// add bias term
+	x.push_back(std::make_pair((size_t)0, (T)1));
+	for (size_t k = shard.offsets[row]; k < shard.offsets[row + 1]; ++k) {
+		x.push_back(std::make_pair((size_t)shard.indices[k],
+			shard.binary ? (T)1 : shard.values[k]));
+	}
+
+	return true;
+}
+
+template<typename T>
+bool InMemoryDataset<T>::ReadSample(T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	std::lock_guard<SpinLock> lock(lock_);
+	return NextSample(seq_, y, x);
+}
+
+template<typename T>
+bool InMemoryDataset<T>::ReadSampleMultiThread(T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	if (local_.open_id != open_id_) {
+		// take over the rest of a block read by ReadSample, e.g. burn-in
+		std::lock_guard<SpinLock> lock(lock_);
+		local_ = seq_;
+		seq_.block = blocks_.size();
+	}
+
+	return NextSample(local_, y, x);
+}
+
+#endif // SRC_IN_MEMORY_DATASET_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
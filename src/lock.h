@@ -22,7 +22,10 @@
 #define SRC_LOCK_H
 
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <mutex>
+#include <thread>
 
 class SpinLock {
 public:
@@ -43,5 +46,85 @@ protected:
 	std::atomic_flag flag_;
 };
 
+// Sequence lock: writers exclude each other and make the sequence odd while
+// they change the data, readers copy it without writing anything shared and
+// copy again if the sequence moved meanwhile, so they never wait on each
+// other. A torn copy is thrown away, it must not be used before read_retry
+class SeqLock {
+public:
+	SeqLock() : seq_(0) {
+	}
+
+	void lock() {
+		for (;;) {
+			uint64_t seq = seq_.load(std::memory_order_relaxed);
+			if (!(seq & 1) && seq_.compare_exchange_weak(seq, seq + 1,
+					std::memory_order_acquire)) {
+				break;
+			}
+		}
+		// the odd sequence is seen before any change
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+	void unlock() {
+		seq_.fetch_add(1, std::memory_order_release);
+	}
+
+	// sequence a read starts at, after a writer in progress is done
+	uint64_t read_begin() const {
+		uint64_t seq;
+		while ((seq = seq_.load(std::memory_order_acquire)) & 1) {
+		}
+		return seq;
+	}
+
+	// true if a writer ran since read_begin returned seq
+	bool read_retry(uint64_t seq) const {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return seq_.load(std::memory_order_relaxed) != seq;
+	}
+
+
+protected:
+	std::atomic<uint64_t> seq_;
+};
+
+enum { kCacheLineSize = 64 };
+
+// SeqLock alone in its cache line, for arrays of locks that different
+// threads take, the array has to be aligned to a line
+class PaddedSeqLock : public SeqLock {
+protected:
+	char pad_[kCacheLineSize - sizeof(std::atomic<uint64_t>)];
+};
+
+// Reusable barrier of a fixed number of threads, waiters yield while
+// spinning so it still works with more threads than cores
+class SpinBarrier {
+public:
+	explicit SpinBarrier(size_t num) : num_(num), count_(0), generation_(0) {
+	}
+
+	void Wait() {
+		size_t generation = generation_.load(std::memory_order_acquire);
+		if (count_.fetch_add(1, std::memory_order_acq_rel) + 1 == num_) {
+			count_.store(0, std::memory_order_relaxed);
+			generation_.fetch_add(1, std::memory_order_release);
+			return;
+		}
+
+		while (generation_.load(std::memory_order_acquire) == generation) {
+			std::this_thread::yield();
+		}
+	}
+
+
+protected:
+	size_t num_;
+	std::atomic<size_t> count_;
+	std::atomic<size_t> generation_;
+};
+
 #endif // SRC_LOCK_H
 /* vim: set ts=4 sw=4 tw=0 noet :*/
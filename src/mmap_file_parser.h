@@ -0,0 +1,289 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_MMAP_FILE_PARSER_H
+#define SRC_MMAP_FILE_PARSER_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "src/file_parser.h"
+#include "src/lock.h"
+#include "src/sample_tokenizer.h"
+
+// MmapFileParser: parse LIBSVM-format file through a read-only mapping.
+// The file is split into newline-aligned chunks, every worker thread claims
+// a whole chunk at a time and parses its lines in place without any shared lock.
+template<typename T>
+class MmapFileParser : public FileParserBase<T> {
+public:
+	MmapFileParser();
+	virtual ~MmapFileParser();
+
+	virtual bool OpenFile(const char* path);
+	virtual bool CloseFile();
+
+	// Read lines in file order, thread-safe but not optimized for multi-threading
+	virtual bool ReadSample(T& y, std::vector<std::pair<size_t, T> >& x);
+
+	// Read lines from the chunk owned by calling thread, lines are
+	// returned in chunk order rather than file order
+	virtual bool ReadSampleMultiThread(T& y, std::vector<std::pair<size_t, T> >& x);
+
+	// Use offsets as chunk boundaries, e.g. a block index from the .cache file
+	virtual bool SetBlockIndex(const std::vector<size_t>& offsets);
+	virtual size_t BlockCount() const { return chunks_.empty() ? 0 : chunks_.size() - 1; }
+	virtual bool SetBlockOrder(const std::vector<size_t>& order);
+
+	size_t file_size() const { return size_; }
+
+protected:
+	struct Cursor {
+		size_t open_id;
+		const char* ptr;
+		const char* end;
+	};
+
+	bool ClaimChunk(Cursor& cursor);
+	bool NextSample(Cursor& cursor, T& y, std::vector<std::pair<size_t, T> >& x);
+
+protected:
+	enum {
+		kMinChunkSize = 1 << 16,
+		kMaxChunkSize = 1 << 22,
+		kChunksPerThread = 8
+	};
+
+	int fd_;
+	const char* data_;
+	size_t size_;
+
+	// chunk i covers [chunks_[i], chunks_[i + 1])
+	std::vector<size_t> chunks_;
+	// chunks are claimed in this order if not empty
+	std::vector<size_t> order_;
+	std::atomic<size_t> next_chunk_;
+
+	// sequential cursor of ReadSample, its leftover is handed to the
+	// first multi-thread reader so no line is lost after a burn-in
+	Cursor seq_;
+	std::atomic<bool> seq_pending_;
+	size_t open_id_;
+
+	SpinLock lock_;
+
+	static std::atomic<size_t> open_counter_;
+	static thread_local Cursor local_;
+};
+
+
+
+template<typename T>
+std::atomic<size_t> MmapFileParser<T>::open_counter_(0);
+
+template<typename T>
+thread_local typename MmapFileParser<T>::Cursor MmapFileParser<T>::local_;
+
+template<typename T>
+MmapFileParser<T>::MmapFileParser()
+: fd_(-1), data_(NULL), size_(0), next_chunk_(0), seq_pending_(false), open_id_(0) {
+	seq_.open_id = 0;
+	seq_.ptr = seq_.end = NULL;
+}
+
+template<typename T>
+MmapFileParser<T>::~MmapFileParser() {
+	CloseFile();
+}
+
+template<typename T>
+bool MmapFileParser<T>::OpenFile(const char* path) {
+	CloseFile();
+
+	fd_ = open(path, O_RDONLY);
+	if (fd_ < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd_, &st) != 0) {
+		CloseFile();
+		return false;
+	}
+
+	size_ = static_cast<size_t>(st.st_size);
+	if (size_ > 0) {
+		void* addr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+		if (addr == MAP_FAILED) {
+			CloseFile();
+			return false;
+		}
+		data_ = reinterpret_cast<const char*>(addr);
+		madvise(addr, size_, MADV_SEQUENTIAL);
+	}
+
+	size_t num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	size_t chunk_size = size_ / (num_threads * kChunksPerThread);
+	chunk_size = std::max(std::min(chunk_size, (size_t)kMaxChunkSize), (size_t)kMinChunkSize);
+
+	chunks_.clear();
+	chunks_.push_back(0);
+	size_t pos = 0;
+	while (pos < size_) {
+		pos += chunk_size;
+		if (pos >= size_) {
+			pos = size_;
+		} else {
+			const void* nl = memchr(data_ + pos, '\n', size_ - pos);
+			pos = nl ? reinterpret_cast<const char*>(nl) - data_ + 1 : size_;
+		}
+		chunks_.push_back(pos);
+	}
+
+	order_.clear();
+	next_chunk_ = 0;
+	open_id_ = ++open_counter_;
+	seq_.open_id = open_id_;
+	seq_.ptr = seq_.end = NULL;
+	seq_pending_ = false;
+	return true;
+}
+
+template<typename T>
+bool MmapFileParser<T>::CloseFile() {
+	if (data_) {
+		munmap(const_cast<char*>(data_), size_);
+		data_ = NULL;
+	}
+
+	if (fd_ >= 0) {
+		close(fd_);
+		fd_ = -1;
+	}
+
+	size_ = 0;
+	chunks_.clear();
+	order_.clear();
+	next_chunk_ = 0;
+	open_id_ = 0;
+	seq_.ptr = seq_.end = NULL;
+	seq_pending_ = false;
+	return true;
+}
+
+template<typename T>
+bool MmapFileParser<T>::SetBlockIndex(const std::vector<size_t>& offsets) {
+	if (!data_ || offsets.size() < 2 || offsets.front() != 0 || offsets.back() != size_) {
+		return false;
+	}
+
+	// every inner boundary must start a line
+	for (size_t i = 1; i < offsets.size(); ++i) {
+		if (offsets[i] <= offsets[i - 1]) return false;
+		if (i + 1 < offsets.size() && data_[offsets[i] - 1] != '\n') return false;
+	}
+
+	chunks_ = offsets;
+	order_.clear();
+	return true;
+}
+
+template<typename T>
+bool MmapFileParser<T>::SetBlockOrder(const std::vector<size_t>& order) {
+	if (!FileParserBase<T>::IsBlockOrder(order, BlockCount())) {
+		return false;
+	}
+
+	order_ = order;
+	return true;
+}
+
+template<typename T>
+bool MmapFileParser<T>::ClaimChunk(Cursor& cursor) {
+	if (&cursor != &seq_ && seq_pending_.load(std::memory_order_acquire)) {
+		std::lock_guard<SpinLock> lock(lock_);
+		if (seq_.ptr < seq_.end) {
+			cursor.ptr = seq_.ptr;
+			cursor.end = seq_.end;
+			seq_.ptr = seq_.end = NULL;
+			seq_pending_ = false;
+			return true;
+		}
+	}
+
+	size_t chunk = next_chunk_.fetch_add(1, std::memory_order_relaxed);
+	if (chunk + 1 >= chunks_.size()) {
+		return false;
+	}
+	if (!order_.empty()) {
+		chunk = order_[chunk];
+	}
+
+	cursor.ptr = data_ + chunks_[chunk];
+	cursor.end = data_ + chunks_[chunk + 1];
+	return true;
+}
+
+template<typename T>
+bool MmapFileParser<T>::NextSample(Cursor& cursor, T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	if (cursor.open_id != open_id_) {
+		cursor.open_id = open_id_;
+		cursor.ptr = cursor.end = NULL;
+	}
+
+	if (cursor.ptr >= cursor.end && !ClaimChunk(cursor)) {
+		return false;
+	}
+
+	const char* begin = cursor.ptr;
+	const char* nl = reinterpret_cast<const char*>(
+		memchr(begin, '\n', cursor.end - begin));
+	const char* end = nl ? nl : cursor.end;
+	cursor.ptr = nl ? nl + 1 : cursor.end;
+
+	return tokenize_sample(begin, end, y, x, this->hash_bits_);
+}
+
+template<typename T>
+bool MmapFileParser<T>::ReadSample(T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	std::lock_guard<SpinLock> lock(lock_);
+	bool suc = NextSample(seq_, y, x);
+	seq_pending_.store(seq_.ptr < seq_.end, std::memory_order_release);
+	return suc;
+}
+
+template<typename T>
+bool MmapFileParser<T>::ReadSampleMultiThread(T& y,
+		std::vector<std::pair<size_t, T> >& x) {
+	return NextSample(local_, y, x);
+}
+
+
+#endif // SRC_MMAP_FILE_PARSER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,305 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_MODEL_FILE_H
+#define SRC_MODEL_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "src/feature_hash.h"
+#include "src/util.h"
+
+// Binary model files, native byte order. A ModelFileHeader zero padded to
+// kModelHeaderSize is followed by the raw arrays, back to back:
+//
+//   weights (SaveModel)       dense: T[feat_num]
+//                             sparse: uint64_t index[count], T[count]
+//   state (SaveModelDetail)   dense: FtrlParam<T>[feat_num] or CompactParam[feat_num]
+//                             sparse: uint64_t index[count], FtrlParam<T>[count]
+//   delta (SaveDelta)         uint64_t index[count], FtrlParam<T>[count]
+//
+// The header size is a multiple of the page size, so that dense state is
+// mapped as is. The checksum hashes every kModelChunkBytes chunk of each
+// array, then the chunk hashes in order, so that chunks are written and
+// checked by threads in parallel.
+
+#define MODEL_WEIGHT_MAGIC "FTRLMDL2"
+#define MODEL_STATE_MAGIC "FTRLSTA2"
+
+enum { kModelFileVersion = 2, kModelHeaderSize = 4096 };
+
+enum { kModelChunkBytes = 1 << 22 };
+
+// a delta holds (index, n, z) records of coordinates changed since its base
+enum { kModelSparse = 1, kModelCompact = 2, kModelDelta = 4 };
+
+struct ModelFileHeader {
+	char magic[8];
+	uint32_t version;
+	// bytes per value, a weight or a coordinate of state, tells float,
+	// double and bf16 apart
+	uint32_t value_bytes;
+	uint64_t feat_num;
+	// values stored, feat_num unless sparse
+	uint64_t count;
+	uint32_t flags;
+	// bytes of the real type of the solver that saved it, 4 or 8, which
+	// value_bytes of a bf16 state does not tell, 0 from older builds
+	uint32_t real_bytes;
+	uint64_t checksum;
+	double alpha;
+	double beta;
+	double l1;
+	double l2;
+	double dropout;
+	// input position of a checkpoint, samples trained in epoch
+	uint64_t epoch;
+	uint64_t samples;
+	// checksum of the state a delta applies to, 0 if not known
+	uint64_t base_checksum;
+
+	bool sparse() const { return (flags & kModelSparse) != 0; }
+	bool compact() const { return (flags & kModelCompact) != 0; }
+	bool delta() const { return (flags & kModelDelta) != 0; }
+	bool is_weights() const { return memcmp(magic, MODEL_WEIGHT_MAGIC, sizeof(magic)) == 0; }
+	bool is_state() const { return memcmp(magic, MODEL_STATE_MAGIC, sizeof(magic)) == 0; }
+
+	// bytes of each array following the header
+	std::vector<size_t> sections() const {
+		std::vector<size_t> bytes;
+		if (sparse()) bytes.push_back(count * sizeof(uint64_t));
+		bytes.push_back(count * value_bytes);
+		return bytes;
+	}
+
+	size_t file_size() const {
+		size_t size = kModelHeaderSize;
+		for (size_t bytes : sections()) size += bytes;
+		return size;
+	}
+};
+
+inline ModelFileHeader make_model_header(const char* magic) {
+	ModelFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, magic, sizeof(header.magic));
+	header.version = kModelFileVersion;
+	return header;
+}
+
+// Read the header of path, false if it is not a binary model file
+inline bool read_model_header(const char* path, ModelFileHeader& header) {
+	FILE* fp = fopen(path, "rb");
+	if (!fp) return false;
+
+	bool res = fread(&header, sizeof(header), 1, fp) == 1
+		&& (header.is_weights() || header.is_state())
+		&& header.version == kModelFileVersion;
+	fclose(fp);
+	return res;
+}
+
+// Chunk of a model file array, at offset of the file
+struct ModelChunk {
+	size_t section;
+	size_t begin;
+	size_t bytes;
+	size_t offset;
+};
+
+inline std::vector<ModelChunk> model_chunks(const std::vector<size_t>& sections) {
+	std::vector<ModelChunk> chunks;
+	size_t offset = kModelHeaderSize;
+	for (size_t i = 0; i < sections.size(); ++i) {
+		for (size_t begin = 0; begin < sections[i]; begin += kModelChunkBytes) {
+			ModelChunk chunk = {i, begin,
+				std::min<size_t>(kModelChunkBytes, sections[i] - begin), offset + begin};
+			chunks.push_back(chunk);
+		}
+		offset += sections[i];
+	}
+	return chunks;
+}
+
+inline uint64_t combine_chunk_hashes(const std::vector<uint64_t>& hashes) {
+	return hash_bytes(reinterpret_cast<const char*>(hashes.data()),
+		hashes.size() * sizeof(uint64_t));
+}
+
+// Threads for num_chunks chunks, num_threads = 0 for every core
+inline size_t model_io_threads(size_t num_chunks, size_t num_threads) {
+	if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+	return std::max<size_t>(1, std::min(num_threads, num_chunks));
+}
+
+// Checksum of the arrays at data, laid out as header gives them
+inline uint64_t model_checksum(const ModelFileHeader& header, const char* data,
+		size_t num_threads = 0) {
+	std::vector<ModelChunk> chunks = model_chunks(header.sections());
+	std::vector<uint64_t> hashes(chunks.size());
+	size_t threads = model_io_threads(chunks.size(), num_threads);
+	util_parallel_run([&] (size_t tid) {
+		for (size_t i = tid; i < chunks.size(); i += threads) {
+			const ModelChunk& chunk = chunks[i];
+			hashes[i] = hash_bytes(data + chunk.offset - kModelHeaderSize, chunk.bytes);
+		}
+	}, threads);
+	return combine_chunk_hashes(hashes);
+}
+
+// fill(section, begin, bytes, buf) returns bytes [begin, begin + bytes) of
+// array section, built in buf of kModelChunkBytes or found elsewhere
+typedef std::function<const char*(size_t, size_t, size_t, char*)> ModelFill;
+
+inline bool write_full(int fd, const char* data, size_t bytes, size_t offset) {
+	while (bytes > 0) {
+		ssize_t res = pwrite(fd, data, bytes, offset);
+		if (res <= 0) return false;
+		data += res;
+		bytes -= res;
+		offset += res;
+	}
+	return true;
+}
+
+// Write the arrays of header by threads in parallel chunks, then the
+// header with their checksum. The file is written aside and renamed, path
+// may still be mapped copy-on-write
+inline bool write_model_file(const char* path, ModelFileHeader& header,
+		const ModelFill& fill, size_t num_threads = 0) {
+	std::string tmp_path = std::string(path) + ".tmp";
+	int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return false;
+
+	std::vector<ModelChunk> chunks = model_chunks(header.sections());
+	std::vector<uint64_t> hashes(chunks.size());
+	std::atomic<bool> suc(ftruncate(fd, header.file_size()) == 0);
+	size_t threads = model_io_threads(chunks.size(), num_threads);
+	util_parallel_run([&] (size_t tid) {
+		std::vector<char> buf;
+		for (size_t i = tid; i < chunks.size() && suc; i += threads) {
+			const ModelChunk& chunk = chunks[i];
+			if (buf.empty()) buf.resize(kModelChunkBytes);
+			const char* data = fill(chunk.section, chunk.begin, chunk.bytes, buf.data());
+			hashes[i] = hash_bytes(data, chunk.bytes);
+			if (!write_full(fd, data, chunk.bytes, chunk.offset)) suc = false;
+		}
+	}, threads);
+
+	char page[kModelHeaderSize];
+	memset(page, 0, sizeof(page));
+	header.checksum = combine_chunk_hashes(hashes);
+	memcpy(page, &header, sizeof(header));
+	bool res = suc && write_full(fd, page, sizeof(page), 0);
+	res = close(fd) == 0 && res;
+	if (!res || rename(tmp_path.c_str(), path) != 0) {
+		remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Set the checksum in the header of path, for arrays changed in place
+inline bool update_model_checksum(const char* path, uint64_t checksum) {
+	int fd = open(path, O_WRONLY);
+	if (fd < 0) return false;
+	bool res = write_full(fd, reinterpret_cast<const char*>(&checksum), sizeof(checksum),
+		offsetof(ModelFileHeader, checksum));
+	return close(fd) == 0 && res;
+}
+
+// Read-only mapping of a whole binary model file, checked against its
+// header and checksum
+class ModelFileMap {
+public:
+	ModelFileMap() : base_(NULL), bytes_(0) {}
+	~ModelFileMap() { Close(); }
+
+	bool Open(const char* path, size_t num_threads = 0) {
+		Close();
+		int fd = open(path, O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < kModelHeaderSize) {
+			close(fd);
+			return false;
+		}
+
+		void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED) return false;
+		base_ = static_cast<const char*>(addr);
+		bytes_ = st.st_size;
+
+		memcpy(&header_, base_, sizeof(header_));
+		if (!(header_.is_weights() || header_.is_state())
+				|| header_.version != kModelFileVersion
+				|| header_.file_size() != bytes_) {
+			fprintf(stderr, "%s is not a complete model file of version %d\n",
+				path, kModelFileVersion);
+			Close();
+			return false;
+		}
+
+		if (model_checksum(header_, data(), num_threads) != header_.checksum) {
+			fprintf(stderr, "%s fails its checksum\n", path);
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	void Close() {
+		if (base_) munmap(const_cast<char*>(base_), bytes_);
+		base_ = NULL;
+		bytes_ = 0;
+	}
+
+	const ModelFileHeader& header() const { return header_; }
+
+	// arrays following the header
+	const char* data() const { return base_ + kModelHeaderSize; }
+
+	// sparse index array and value array
+	const uint64_t* index() const { return reinterpret_cast<const uint64_t*>(data()); }
+	const char* values() const {
+		return header_.sparse() ? data() + header_.count * sizeof(uint64_t) : data();
+	}
+
+private:
+	ModelFileHeader header_;
+	const char* base_;
+	size_t bytes_;
+};
+
+#endif // SRC_MODEL_FILE_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
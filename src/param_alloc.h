@@ -0,0 +1,285 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_PARAM_ALLOC_H
+#define SRC_PARAM_ALLOC_H
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+// Memory of large parameter arrays. Arrays of kHugePageSize bytes or more
+// are mapped, aligned to huge pages and placed by the policy of the process:
+//   pages: transparent huge pages by madvise, or explicit ones of the
+//          hugetlb pool by MAP_HUGETLB, which falls back to transparent
+//   numa:  interleave pages over all nodes, for arrays shared by threads,
+//          or leave them untouched until their first write (first-touch),
+//          so that a node-local owner thread places them
+// Every step falls back to plain pages when the system refuses it, what
+// was actually done is counted and told by param_alloc_report().
+// Smaller arrays, and all arrays under the default policy, come from the
+// heap as before.
+
+enum ParamPages { kPagesDefault = 0, kPagesTransparent, kPagesExplicit };
+enum ParamNuma { kNumaDefault = 0, kNumaInterleave, kNumaFirstTouch };
+
+enum { kHugePageSize = 2 << 20, kParamAllocAlign = 64 };
+
+struct ParamAllocPolicy {
+	ParamPages pages;
+	ParamNuma numa;
+
+	ParamAllocPolicy() : pages(kPagesDefault), numa(kNumaDefault) {}
+
+	bool is_default() const { return pages == kPagesDefault && numa == kNumaDefault; }
+};
+
+// Set before solvers are initialized, arrays allocated keep their policy
+inline ParamAllocPolicy& param_alloc_policy() {
+	static ParamAllocPolicy policy;
+	return policy;
+}
+
+// Parse "off", "thp" or "explicit" / "off", "interleave" or "first-touch"
+inline bool parse_param_pages(const char* name, ParamPages& pages) {
+	if (strcmp(name, "off") == 0) {
+		pages = kPagesDefault;
+	} else if (strcmp(name, "thp") == 0) {
+		pages = kPagesTransparent;
+	} else if (strcmp(name, "explicit") == 0) {
+		pages = kPagesExplicit;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+inline bool parse_param_numa(const char* name, ParamNuma& numa) {
+	if (strcmp(name, "off") == 0) {
+		numa = kNumaDefault;
+	} else if (strcmp(name, "interleave") == 0) {
+		numa = kNumaInterleave;
+	} else if (strcmp(name, "first-touch") == 0) {
+		numa = kNumaFirstTouch;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Bytes allocated so far by the backing they got
+struct ParamAllocStats {
+	std::atomic<size_t> heap;
+	std::atomic<size_t> mapped;
+	std::atomic<size_t> explicit_huge;
+	std::atomic<size_t> transparent_huge;
+	std::atomic<size_t> interleaved;
+	// requests the system refused, served by the next fallback
+	std::atomic<size_t> explicit_failed;
+	std::atomic<size_t> interleave_failed;
+
+	ParamAllocStats()
+	: heap(0), mapped(0), explicit_huge(0), transparent_huge(0), interleaved(0),
+	explicit_failed(0), interleave_failed(0) {}
+};
+
+inline ParamAllocStats& param_alloc_stats() {
+	static ParamAllocStats stats;
+	return stats;
+}
+
+// Sizes of mapped arrays by address, so that they start on a page
+// boundary, heap arrays are not listed
+struct ParamMappings {
+	std::mutex lock;
+	std::unordered_map<void*, size_t> sizes;
+};
+
+inline ParamMappings& param_mappings() {
+	static ParamMappings mappings;
+	return mappings;
+}
+
+// Nodes of /sys/devices/system/node/online as a mask, 0 if unknown
+inline uint64_t param_numa_nodes() {
+	FILE* fp = fopen("/sys/devices/system/node/online", "r");
+	if (!fp) return 0;
+
+	uint64_t mask = 0;
+	unsigned first = 0, last = 0;
+	char sep = 0;
+	while (fscanf(fp, "%u", &first) == 1) {
+		last = first;
+		if (fscanf(fp, "%c", &sep) == 1 && sep == '-') {
+			if (fscanf(fp, "%u", &last) != 1) break;
+			if (fscanf(fp, "%c", &sep) != 1) sep = 0;
+		}
+		for (unsigned node = first; node <= last && node < 64; ++node) {
+			mask |= (uint64_t)1 << node;
+		}
+		if (sep != ',') break;
+	}
+	fclose(fp);
+	return mask;
+}
+
+// Interleave pages of [addr, addr + bytes) over nodes, before first touch
+inline bool param_interleave(void* addr, size_t bytes) {
+#if defined(__linux__) && defined(SYS_mbind)
+	enum { kMpolInterleave = 3 };
+	static const uint64_t nodes = param_numa_nodes();
+	if (nodes == 0) return false;
+	return syscall(SYS_mbind, addr, bytes, kMpolInterleave, &nodes, 64, 0) == 0;
+#else
+	return false;
+#endif
+}
+
+// Map bytes aligned to kHugePageSize, NULL on failure. huge tells whether
+// the pages came from the hugetlb pool
+inline void* param_map(size_t bytes, bool explicit_huge, bool& huge) {
+	huge = false;
+#if defined(MAP_HUGETLB)
+	if (explicit_huge) {
+		void* addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED) {
+			huge = true;
+			return addr;
+		}
+	}
+#endif
+
+	// over-map by a huge page and trim both ends to align
+	size_t span = bytes + kHugePageSize;
+	void* addr = mmap(NULL, span, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) return NULL;
+
+	uintptr_t begin = reinterpret_cast<uintptr_t>(addr);
+	uintptr_t aligned = (begin + kHugePageSize - 1) & ~(uintptr_t)(kHugePageSize - 1);
+	if (aligned > begin) munmap(addr, aligned - begin);
+	size_t tail = begin + span - (aligned + bytes);
+	if (tail > 0) munmap(reinterpret_cast<void*>(aligned + bytes), tail);
+	return reinterpret_cast<void*>(aligned);
+}
+
+// Zeroed bytes aligned to kParamAllocAlign, NULL on failure. Mapped memory
+// starts on a huge page and is not touched here, so first-touch leaves
+// placement to the first writer
+inline void* param_alloc(size_t bytes) {
+	const ParamAllocPolicy& policy = param_alloc_policy();
+	ParamAllocStats& stats = param_alloc_stats();
+	size_t total = std::max(bytes, (size_t)1);
+
+	if (policy.is_default() || total < (size_t)kHugePageSize) {
+		total = (total + kParamAllocAlign - 1) & ~(size_t)(kParamAllocAlign - 1);
+		void* ptr = NULL;
+		if (posix_memalign(&ptr, kParamAllocAlign, total) != 0) return NULL;
+		memset(ptr, 0, total);
+		stats.heap += total;
+		return ptr;
+	}
+
+	total = (total + kHugePageSize - 1) & ~(size_t)(kHugePageSize - 1);
+	bool huge = false;
+	void* addr = param_map(total, policy.pages == kPagesExplicit, huge);
+	if (!addr) return NULL;
+	stats.mapped += total;
+
+	if (huge) {
+		stats.explicit_huge += total;
+	} else {
+		if (policy.pages == kPagesExplicit) ++stats.explicit_failed;
+#if defined(MADV_HUGEPAGE)
+		if (policy.pages != kPagesDefault && madvise(addr, total, MADV_HUGEPAGE) == 0) {
+			stats.transparent_huge += total;
+		}
+#endif
+	}
+
+	if (policy.numa == kNumaInterleave) {
+		if (param_interleave(addr, total)) {
+			stats.interleaved += total;
+		} else {
+			++stats.interleave_failed;
+		}
+	}
+
+	ParamMappings& mappings = param_mappings();
+	std::lock_guard<std::mutex> guard(mappings.lock);
+	mappings.sizes[addr] = total;
+	return addr;
+}
+
+inline void param_free(void* ptr) {
+	if (!ptr) return;
+
+	size_t mapped = 0;
+	{
+		ParamMappings& mappings = param_mappings();
+		std::lock_guard<std::mutex> guard(mappings.lock);
+		auto it = mappings.sizes.find(ptr);
+		if (it != mappings.sizes.end()) {
+			mapped = it->second;
+			mappings.sizes.erase(it);
+		}
+	}
+
+	if (mapped > 0) {
+		munmap(ptr, mapped);
+	} else {
+		free(ptr);
+	}
+}
+
+// Policy in effect and how the memory allocated so far is backed
+inline std::string param_alloc_report() {
+	static const char* pages_names[] = {"off", "thp", "explicit"};
+	static const char* numa_names[] = {"off", "interleave", "first-touch"};
+	const ParamAllocPolicy& policy = param_alloc_policy();
+	const ParamAllocStats& stats = param_alloc_stats();
+
+	char buf[512];
+	snprintf(buf, sizeof(buf),
+		"param-alloc pages=[%s] numa=[%s] heap=[%.1f MB] mapped=[%.1f MB]"
+		" explicit-huge=[%.1f MB] thp-advised=[%.1f MB] interleaved=[%.1f MB]%s%s",
+		pages_names[policy.pages], numa_names[policy.numa],
+		stats.heap / 1048576.0, stats.mapped / 1048576.0,
+		stats.explicit_huge / 1048576.0, stats.transparent_huge / 1048576.0,
+		stats.interleaved / 1048576.0,
+		stats.explicit_failed > 0 ? " (no hugetlb pages, fell back to thp)" : "",
+		stats.interleave_failed > 0 ? " (interleave refused, default placement)" : "");
+	return buf;
+}
+
+#endif // SRC_PARAM_ALLOC_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
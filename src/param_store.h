@@ -0,0 +1,667 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_PARAM_STORE_H
+#define SRC_PARAM_STORE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include "src/fast_random.h"
+#include "src/lock.h"
+#include "src/param_alloc.h"
+
+enum { kParamAlignment = kParamAllocAlign };
+
+// Dirty marks of changed coordinates: a byte per group of 2^kDirtyShift of
+// them, or per hashed slot of such groups in sparse store, with a bit per
+// consumer of deltas. Writers set every bit after a change, a consumer
+// clears its bit before it reads the group, so a change may be taken twice
+// but is never missed.
+enum { kDirtyShift = 6, kSparseDirtyBits = 20, kSparseDirtySlots = 1 << kSparseDirtyBits };
+enum { kDirtyCheckpoint = 1, kDirtyExport = 2, kDirtyAll = 0xff };
+
+// Per-coordinate FTRL state. n and z are interleaved so a coordinate costs
+// one cache miss, the power-of-two size keeps an entry within one line
+template<typename T>
+struct FtrlParam {
+	T n;
+	T z;
+};
+
+// Coordinate state of compact store, n and z in bfloat16
+struct CompactParam {
+	uint16_t n;
+	uint16_t z;
+};
+
+// Zero-initialized, cache-line aligned parameter array by param_alloc,
+// NULL on failure
+template<class Param>
+Param* alloc_params(size_t num);
+
+template<class Param>
+void free_params(Param* params);
+
+// bfloat16 is the upper half of a float. dither is added to the lower half
+// before it is cut: 0x8000 rounds to nearest, uniform random bits round
+// stochastically so that increments below the precision survive on average
+inline uint16_t bf16_encode(float x, uint32_t dither) {
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	if ((bits & 0x7f800000u) == 0x7f800000u) {
+		return static_cast<uint16_t>(bits >> 16);
+	}
+	return static_cast<uint16_t>((bits + (dither & 0xffffu)) >> 16);
+}
+
+inline float bf16_decode(uint16_t h) {
+	uint32_t bits = static_cast<uint32_t>(h) << 16;
+	float x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+enum { kBf16RoundNearest = 0x8000 };
+
+// SparseParamTable: open-addressing hash table from feature index to
+// FtrlParam, split into shards with a SpinLock each so threads touching
+// different shards never contend. A shard doubles when 70% full.
+template<typename T>
+class SparseParamTable {
+public:
+	SparseParamTable();
+	~SparseParamTable();
+
+	bool Initialize(size_t capacity);
+
+	bool Get(size_t idx, FtrlParam<T>& param);
+
+	template<class Func>
+	bool Modify(size_t idx, const Func& func);
+
+	// Visit all entries in no particular order, func may not touch the table
+	template<class Func>
+	void ForEach(const Func& func);
+
+	void Clear();
+
+	size_t size() const { return size_; }
+	size_t max_index() const { return max_index_; }
+
+	// index reserved for empty slots
+	static size_t empty_key() { return ~(size_t)0; }
+
+private:
+	enum { kShardBits = 8, kShardNum = 1 << kShardBits, kMinShardCapacity = 16 };
+
+	struct Entry {
+		size_t key;
+		FtrlParam<T> param;
+	};
+
+	struct Shard {
+		SpinLock lock;
+		Entry* entries;
+		size_t mask;
+		size_t size;
+	};
+
+	static uint64_t HashKey(size_t idx) {
+		uint64_t h = idx;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static Entry* AllocEntries(size_t capacity);
+	bool Grow(Shard& shard);
+
+	// slot holding idx, or the empty slot where it belongs
+	Entry* Probe(const Shard& shard, size_t idx, uint64_t hash) const {
+		size_t pos = (hash >> kShardBits) & shard.mask;
+		while (shard.entries[pos].key != idx && shard.entries[pos].key != empty_key()) {
+			pos = (pos + 1) & shard.mask;
+		}
+		return &shard.entries[pos];
+	}
+
+private:
+	Shard* shards_;
+	std::atomic<size_t> size_;
+	std::atomic<size_t> max_index_;
+};
+
+// FtrlParamStore: parameter storage of solvers, either a dense array sized
+// to the feature count or a SparseParamTable holding only coordinates seen.
+// A compact dense array keeps n and z in bfloat16 at half the memory, state
+// is computed in T and written back with stochastic rounding.
+template<typename T>
+class FtrlParamStore {
+public:
+	FtrlParamStore();
+	~FtrlParamStore();
+
+	bool InitializeDense(size_t num, bool compact = false);
+	bool InitializeSparse(size_t capacity = 0);
+	// Dense store of num coordinates at offset of file path, a multiple of
+	// the page size. Pages are read on first use. A private mapping copies
+	// them on write and leaves the file as is, a shared one writes through
+	bool InitializeMapped(const char* path, size_t offset, size_t num,
+		bool compact, bool shared);
+	void Clear();
+
+	bool sparse() const { return sparse_ != NULL; }
+	bool compact() const { return compact_ != NULL; }
+
+	// dense: array size, sparse: largest index stored + 1
+	size_t feat_num() const {
+		return sparse_ ? (sparse_->size() > 0 ? sparse_->max_index() + 1 : 0) : dense_size_;
+	}
+
+	// number of coordinates stored
+	size_t size() const { return sparse_ ? sparse_->size() : dense_size_; }
+
+	bool InRange(size_t idx) const {
+		return sparse_ ? idx != SparseParamTable<T>::empty_key() : idx < dense_size_;
+	}
+
+	// Copy state of idx, zeros and false if it is not stored
+	bool Get(size_t idx, FtrlParam<T>& param) const {
+		if (sparse_) return sparse_->Get(idx, param);
+
+		if (idx < dense_size_) {
+			param = dense_ ? dense_[idx] : Decode(compact_[idx]);
+			return true;
+		}
+		param.n = param.z = 0;
+		return false;
+	}
+
+	// Apply func(FtrlParam<T>&) to idx, a sparse store creates it first
+	template<class Func>
+	bool Modify(size_t idx, const Func& func) {
+		if (sparse_) {
+			if (!sparse_->Modify(idx, func)) return false;
+			MarkDirty(idx);
+			return true;
+		}
+
+		if (idx >= dense_size_) return false;
+		if (dense_) {
+			func(dense_[idx]);
+			MarkDirty(idx);
+			return true;
+		}
+
+		FtrlParam<T> param = Decode(compact_[idx]);
+		func(param);
+		compact_[idx] = Encode(param, Dither());
+		MarkDirty(idx);
+		return true;
+	}
+
+	// compact store rounds param to nearest, so saved state loads back as is
+	bool Set(size_t idx, const FtrlParam<T>& param) {
+		if (compact_) {
+			if (idx >= dense_size_) return false;
+			compact_[idx] = Encode(param, kBf16RoundNearest | (kBf16RoundNearest << 16));
+			MarkDirty(idx);
+			return true;
+		}
+		return Modify(idx, [&param] (FtrlParam<T>& p) { p = param; });
+	}
+
+	// Visit func(idx, param), index order for dense store. Changes by func
+	// are lost on compact store
+	template<class Func>
+	void ForEach(const Func& func) {
+		if (sparse_) {
+			sparse_->ForEach(func);
+		} else if (dense_) {
+			for (size_t i = 0; i < dense_size_; ++i) func(i, dense_[i]);
+		} else {
+			for (size_t i = 0; i < dense_size_; ++i) {
+				FtrlParam<T> param = Decode(compact_[i]);
+				func(i, param);
+			}
+		}
+	}
+
+	// Copy [start, end) of src, a dense store of the same layout
+	void CopyRange(const FtrlParamStore<T>& src, size_t start, size_t end) {
+		if (dense_) {
+			std::copy(src.dense_ + start, src.dense_ + end, dense_ + start);
+		} else {
+			std::copy(src.compact_ + start, src.compact_ + end, compact_ + start);
+		}
+	}
+
+	// Add [start, end) of delta, a dense store of the same layout, and
+	// zero it there
+	void AddRange(FtrlParamStore<T>& delta, size_t start, size_t end) {
+		if (dense_) {
+			for (size_t i = start; i < end; ++i) {
+				dense_[i].n += delta.dense_[i].n;
+				dense_[i].z += delta.dense_[i].z;
+				delta.dense_[i].n = 0;
+				delta.dense_[i].z = 0;
+			}
+			if (dirty_ && start < end) {
+				for (size_t g = start >> kDirtyShift; g <= (end - 1) >> kDirtyShift; ++g) {
+					dirty_[g].store(kDirtyAll, std::memory_order_release);
+				}
+			}
+			return;
+		}
+
+		for (size_t i = start; i < end; ++i) {
+			const FtrlParam<T> inc = Decode(delta.compact_[i]);
+			if (inc.n == 0 && inc.z == 0) continue;
+			Modify(i, [&inc] (FtrlParam<T>& param) {
+				param.n += inc.n;
+				param.z += inc.z;
+			});
+			delta.compact_[i].n = 0;
+			delta.compact_[i].z = 0;
+		}
+	}
+
+	// raw array of dense store, NULL for sparse and compact
+	FtrlParam<T>* dense() { return dense_; }
+
+	// coordinate array of a dense store as InitializeMapped maps it, NULL
+	// for sparse
+	const char* raw() const {
+		return dense_ ? reinterpret_cast<const char*>(dense_)
+			: reinterpret_cast<const char*>(compact_);
+	}
+
+	// path is the file of a shared mapping
+	bool MapsShared(const char* path) const {
+		struct stat st;
+		return map_base_ && map_shared_ && stat(path, &st) == 0
+			&& st.st_dev == map_dev_ && st.st_ino == map_ino_;
+	}
+
+	// Flush a shared mapping to its file
+	bool Sync() {
+		return map_base_ && map_shared_ && msync(map_base_, map_bytes_, MS_SYNC) == 0;
+	}
+
+	// Mark changes from now on, after the store is initialized
+	bool TrackDirty();
+	bool tracks_dirty() const { return dirty_ != NULL; }
+	size_t dirty_slots() const { return dirty_size_; }
+
+	size_t DirtySlot(size_t idx) const {
+		uint64_t group = idx >> kDirtyShift;
+		if (!sparse_) return group;
+		return (group * 0x9e3779b97f4a7c15ULL) >> (64 - kSparseDirtyBits);
+	}
+
+	// Clear bit of slot, true if it was set
+	bool TakeDirty(size_t slot, uint8_t bit) {
+		if (!(dirty_[slot].load(std::memory_order_acquire) & bit)) return false;
+		return (dirty_[slot].fetch_and(~bit) & bit) != 0;
+	}
+
+	void ClearDirty(uint8_t bit) {
+		for (size_t i = 0; i < dirty_size_; ++i) dirty_[i].fetch_and(~bit);
+	}
+
+private:
+	// stored after the change, so that it is seen once the mark is cleared
+	void MarkDirty(size_t idx) {
+		if (dirty_) dirty_[DirtySlot(idx)].store(kDirtyAll, std::memory_order_release);
+	}
+
+	static FtrlParam<T> Decode(const CompactParam& c) {
+		FtrlParam<T> param;
+		param.n = bf16_decode(c.n);
+		param.z = bf16_decode(c.z);
+		return param;
+	}
+
+	// dither has the bits for n in its lower and for z in its upper half
+	static CompactParam Encode(const FtrlParam<T>& param, uint32_t dither) {
+		CompactParam c;
+		c.n = bf16_encode(static_cast<float>(param.n), dither);
+		c.z = bf16_encode(static_cast<float>(param.z), dither >> 16);
+		return c;
+	}
+
+	// rounding noise, a xorshift stream per thread, seeded in the order
+	// threads first draw so that their errors are not correlated
+	static uint32_t Dither() {
+		static thread_local uint64_t state = DitherSeed();
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return static_cast<uint32_t>(state >> 32);
+	}
+
+private:
+	// never 0, which xorshift would never leave
+	static uint64_t DitherSeed() {
+		static std::atomic<uint64_t> seq(0);
+		uint64_t state = seq++;
+		uint64_t seed = splitmix64(state);
+		return seed != 0 ? seed : 1;
+	}
+
+private:
+	FtrlParam<T>* dense_;
+	CompactParam* compact_;
+	size_t dense_size_;
+	SparseParamTable<T>* sparse_;
+
+	// mapping backing dense_ or compact_, NULL if allocated
+	void* map_base_;
+	size_t map_bytes_;
+	bool map_shared_;
+	dev_t map_dev_;
+	ino_t map_ino_;
+
+	// dirty marks, NULL unless tracked
+	std::atomic<uint8_t>* dirty_;
+	size_t dirty_size_;
+};
+
+
+
+template<class Param>
+Param* alloc_params(size_t num) {
+	// all bits zero is n = z = 0 for float, double and bfloat16
+	return reinterpret_cast<Param*>(param_alloc(std::max(num, (size_t)1) * sizeof(Param)));
+}
+
+template<class Param>
+void free_params(Param* params) {
+	param_free(params);
+}
+
+
+
+template<typename T>
+SparseParamTable<T>::SparseParamTable() : shards_(NULL), size_(0), max_index_(0) {}
+
+template<typename T>
+SparseParamTable<T>::~SparseParamTable() {
+	Clear();
+}
+
+template<typename T>
+typename SparseParamTable<T>::Entry* SparseParamTable<T>::AllocEntries(size_t capacity) {
+	Entry* entries = reinterpret_cast<Entry*>(param_alloc(capacity * sizeof(Entry)));
+	if (!entries) {
+		return NULL;
+	}
+
+	for (size_t i = 0; i < capacity; ++i) {
+		entries[i].key = empty_key();
+		entries[i].param.n = 0;
+		entries[i].param.z = 0;
+	}
+	return entries;
+}
+
+template<typename T>
+bool SparseParamTable<T>::Initialize(size_t capacity) {
+	Clear();
+
+	size_t shard_capacity = kMinShardCapacity;
+	while (shard_capacity * kShardNum * 7 < capacity * 10) shard_capacity <<= 1;
+
+	shards_ = new Shard[kShardNum];
+	for (size_t i = 0; i < kShardNum; ++i) {
+		shards_[i].entries = AllocEntries(shard_capacity);
+		shards_[i].mask = shard_capacity - 1;
+		shards_[i].size = 0;
+		if (!shards_[i].entries) {
+			Clear();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+template<typename T>
+void SparseParamTable<T>::Clear() {
+	if (shards_) {
+		for (size_t i = 0; i < kShardNum; ++i) {
+			param_free(shards_[i].entries);
+		}
+		delete [] shards_;
+		shards_ = NULL;
+	}
+
+	size_ = 0;
+	max_index_ = 0;
+}
+
+template<typename T>
+bool SparseParamTable<T>::Grow(Shard& shard) {
+	size_t capacity = (shard.mask + 1) * 2;
+	Entry* entries = AllocEntries(capacity);
+	if (!entries) return false;
+
+	Shard grown;
+	grown.entries = entries;
+	grown.mask = capacity - 1;
+	for (size_t i = 0; i <= shard.mask; ++i) {
+		const Entry& entry = shard.entries[i];
+		if (entry.key == empty_key()) continue;
+		*Probe(grown, entry.key, HashKey(entry.key)) = entry;
+	}
+
+	param_free(shard.entries);
+	shard.entries = entries;
+	shard.mask = grown.mask;
+	return true;
+}
+
+template<typename T>
+bool SparseParamTable<T>::Get(size_t idx, FtrlParam<T>& param) {
+	uint64_t hash = HashKey(idx);
+	Shard& shard = shards_[hash & (kShardNum - 1)];
+
+	std::lock_guard<SpinLock> lock(shard.lock);
+	const Entry* entry = Probe(shard, idx, hash);
+	if (entry->key != idx) {
+		param.n = param.z = 0;
+		return false;
+	}
+
+	param = entry->param;
+	return true;
+}
+
+template<typename T>
+template<class Func>
+bool SparseParamTable<T>::Modify(size_t idx, const Func& func) {
+	if (idx == empty_key()) return false;
+
+	uint64_t hash = HashKey(idx);
+	Shard& shard = shards_[hash & (kShardNum - 1)];
+
+	std::lock_guard<SpinLock> lock(shard.lock);
+	Entry* entry = Probe(shard, idx, hash);
+	if (entry->key != idx) {
+		if ((shard.size + 1) * 10 > (shard.mask + 1) * 7) {
+			if (!Grow(shard)) return false;
+			entry = Probe(shard, idx, hash);
+		}
+
+		entry->key = idx;
+		++shard.size;
+		++size_;
+
+		size_t max_index = max_index_.load(std::memory_order_relaxed);
+		while (idx > max_index && !max_index_.compare_exchange_weak(max_index, idx)) {}
+	}
+
+	func(entry->param);
+	return true;
+}
+
+template<typename T>
+template<class Func>
+void SparseParamTable<T>::ForEach(const Func& func) {
+	for (size_t s = 0; s < kShardNum; ++s) {
+		Shard& shard = shards_[s];
+		std::lock_guard<SpinLock> lock(shard.lock);
+		for (size_t i = 0; i <= shard.mask; ++i) {
+			Entry& entry = shard.entries[i];
+			if (entry.key != empty_key()) func(entry.key, entry.param);
+		}
+	}
+}
+
+
+
+template<typename T>
+FtrlParamStore<T>::FtrlParamStore()
+: dense_(NULL), compact_(NULL), dense_size_(0), sparse_(NULL),
+map_base_(NULL), map_bytes_(0), map_shared_(false), map_dev_(0), map_ino_(0),
+dirty_(NULL), dirty_size_(0) {}
+
+template<typename T>
+FtrlParamStore<T>::~FtrlParamStore() {
+	Clear();
+}
+
+template<typename T>
+bool FtrlParamStore<T>::InitializeDense(size_t num, bool compact) {
+	Clear();
+	if (compact) {
+		compact_ = alloc_params<CompactParam>(num);
+		if (!compact_) return false;
+	} else {
+		dense_ = alloc_params<FtrlParam<T> >(num);
+		if (!dense_) return false;
+	}
+
+	dense_size_ = num;
+	return true;
+}
+
+template<typename T>
+bool FtrlParamStore<T>::InitializeMapped(const char* path, size_t offset, size_t num,
+		bool compact, bool shared) {
+	Clear();
+	int fd = open(path, shared ? O_RDWR : O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	size_t bytes = offset + num * (compact ? sizeof(CompactParam) : sizeof(FtrlParam<T>));
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < bytes) {
+		close(fd);
+		return false;
+	}
+
+	void* addr = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) return false;
+
+	map_base_ = addr;
+	map_bytes_ = bytes;
+	map_shared_ = shared;
+	map_dev_ = st.st_dev;
+	map_ino_ = st.st_ino;
+	char* params = static_cast<char*>(addr) + offset;
+	if (compact) {
+		compact_ = reinterpret_cast<CompactParam*>(params);
+	} else {
+		dense_ = reinterpret_cast<FtrlParam<T>*>(params);
+	}
+	dense_size_ = num;
+	return true;
+}
+
+template<typename T>
+bool FtrlParamStore<T>::InitializeSparse(size_t capacity) {
+	Clear();
+	sparse_ = new SparseParamTable<T>();
+	if (!sparse_->Initialize(capacity)) {
+		Clear();
+		return false;
+	}
+
+	return true;
+}
+
+template<typename T>
+bool FtrlParamStore<T>::TrackDirty() {
+	if (dirty_) return true;
+
+	size_t num = sparse_ ? (size_t)kSparseDirtySlots
+		: (dense_size_ + ((size_t)1 << kDirtyShift) - 1) >> kDirtyShift;
+	dirty_ = new (std::nothrow) std::atomic<uint8_t>[num];
+	if (!dirty_) return false;
+	for (size_t i = 0; i < num; ++i) dirty_[i].store(0, std::memory_order_relaxed);
+	dirty_size_ = num;
+	return true;
+}
+
+template<typename T>
+void FtrlParamStore<T>::Clear() {
+	delete [] dirty_;
+	dirty_ = NULL;
+	dirty_size_ = 0;
+
+	if (map_base_) {
+		munmap(map_base_, map_bytes_);
+		map_base_ = NULL;
+		map_bytes_ = 0;
+		dense_ = NULL;
+		compact_ = NULL;
+	}
+	if (dense_) {
+		free_params(dense_);
+		dense_ = NULL;
+	}
+	if (compact_) {
+		free_params(compact_);
+		compact_ = NULL;
+	}
+	dense_size_ = 0;
+
+	if (sparse_) {
+		delete sparse_;
+		sparse_ = NULL;
+	}
+}
+
+#endif // SRC_PARAM_STORE_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,52 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_PARSER_FACTORY_H
+#define SRC_PARSER_FACTORY_H
+
+#include <sys/stat.h>
+#include <cstring>
+#include "src/binary_file_parser.h"
+#include "src/file_parser.h"
+#include "src/mmap_file_parser.h"
+
+// Create parser for path: binary parser for files written by ftrl_convert,
+// mapped parser for other regular files, stream parser for stdin and pipes.
+// Text parsers hash feature names when hash_bits > 0
+template<typename T>
+FileParserBase<T>* create_file_parser(const char* path, size_t hash_bits = 0) {
+	FileParserBase<T>* parser = NULL;
+	struct stat st;
+	if (strcmp(path, "stdin") != 0 && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (is_binary_file(path)) {
+			parser = new BinaryFileParser<T>();
+		} else {
+			parser = new MmapFileParser<T>();
+		}
+	} else {
+		parser = new FileParser<T>();
+	}
+
+	parser->SetHashBits(hash_bits);
+	return parser;
+}
+
+#endif // SRC_PARSER_FACTORY_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,185 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_PROBLEM_CACHE_H
+#define SRC_PROBLEM_CACHE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Lines per block of the block index
+enum { kIndexBlockLines = 1 << 16 };
+
+// feat_freq is left empty for indices beyond this
+enum { kMaxFreqFeatures = 1 << 28 };
+
+// Everything learnt from one scan of a training file, kept in <file>.cache.
+// The first line "line_cnt\tfeat_num" is unchanged from older versions,
+// the other sections follow as "key\tvalues" lines:
+//   file_size  size               cache is ignored if file size changed
+//   nnz        nnz                non-zero features, bias excluded
+//   feat_freq  n c_0 .. c_n-1     c_k features occur in [2^k, 2^(k+1)) lines
+//   block_index lines n           followed by n offsets, one per line,
+//                                 first 0 and last file_size
+//   binary     0 or 1             all feature values are 1
+struct ProblemInfo {
+	size_t line_cnt;
+	size_t feat_num;
+	size_t file_size;
+	size_t nnz;
+	std::vector<size_t> feat_freq;
+	size_t block_lines;
+	std::vector<size_t> block_index;
+	bool binary;
+
+	ProblemInfo()
+	: line_cnt(0), feat_num(0), file_size(0), nnz(0), block_lines(0), binary(false) {}
+};
+
+inline size_t file_size_of(const char* path) {
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+	return static_cast<size_t>(st.st_size);
+}
+
+// Byte offset of every block_lines-th line of a text file, plus its size
+inline bool build_block_index(const char* path, size_t block_lines,
+		std::vector<size_t>& offsets) {
+	offsets.clear();
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	size_t size = static_cast<size_t>(st.st_size);
+	void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) return false;
+	madvise(addr, size, MADV_SEQUENTIAL);
+
+	const char* data = reinterpret_cast<const char*>(addr);
+	size_t pos = 0;
+	size_t lines = 0;
+	offsets.push_back(0);
+	while (pos < size) {
+		const void* nl = memchr(data + pos, '\n', size - pos);
+		pos = nl ? reinterpret_cast<const char*>(nl) - data + 1 : size;
+		if (++lines % block_lines == 0 && pos < size) {
+			offsets.push_back(pos);
+		}
+	}
+	offsets.push_back(size);
+
+	munmap(addr, size);
+	return true;
+}
+
+// Histogram of per-feature line counts in log2 buckets
+inline void build_feat_freq(const std::vector<size_t>& counts,
+		std::vector<size_t>& feat_freq) {
+	feat_freq.clear();
+	for (size_t count : counts) {
+		if (count == 0) continue;
+
+		size_t k = 0;
+		while (count >> (k + 1)) ++k;
+		if (k >= feat_freq.size()) feat_freq.resize(k + 1, 0);
+		++feat_freq[k];
+	}
+}
+
+// Read cache file of data_path, false if missing or written for other content
+inline bool read_problem_cache(const char* cache_path, const char* data_path,
+		ProblemInfo& info) {
+	std::fstream fin;
+	fin.open(cache_path, std::ios::in);
+	fin >> info.line_cnt >> info.feat_num;
+	if (!fin || fin.eof()) {
+		info = ProblemInfo();
+		return false;
+	}
+
+	std::string key;
+	while (fin >> key) {
+		if (key == "file_size") {
+			fin >> info.file_size;
+		} else if (key == "nnz") {
+			fin >> info.nnz;
+		} else if (key == "feat_freq") {
+			size_t n = 0;
+			fin >> n;
+			info.feat_freq.resize(n);
+			for (size_t i = 0; i < n; ++i) fin >> info.feat_freq[i];
+		} else if (key == "block_index") {
+			size_t n = 0;
+			fin >> info.block_lines >> n;
+			info.block_index.resize(n);
+			for (size_t i = 0; i < n; ++i) fin >> info.block_index[i];
+		} else if (key == "binary") {
+			fin >> info.binary;
+		} else {
+			break;
+		}
+	}
+	bool suc = !fin.bad() && (fin.eof() || fin);
+	fin.close();
+
+	// caches of older versions carry no size and are rebuilt
+	if (!suc || info.file_size == 0 || info.file_size != file_size_of(data_path)
+			|| (!info.block_index.empty() && info.block_index.back() != info.file_size)) {
+		info = ProblemInfo();
+		return false;
+	}
+
+	return true;
+}
+
+inline bool write_problem_cache(const char* cache_path, const ProblemInfo& info) {
+	std::fstream fout;
+	fout.open(cache_path, std::ios::out);
+	fout << info.line_cnt << "\t" << info.feat_num << "\n";
+	fout << "file_size\t" << info.file_size << "\n";
+	fout << "nnz\t" << info.nnz << "\n";
+
+	fout << "feat_freq\t" << info.feat_freq.size();
+	for (size_t count : info.feat_freq) fout << "\t" << count;
+	fout << "\n";
+
+	fout << "block_index\t" << info.block_lines << "\t" << info.block_index.size() << "\n";
+	for (size_t offset : info.block_index) fout << offset << "\n";
+	fout << "binary\t" << (info.binary ? 1 : 0) << "\n";
+
+	bool suc = static_cast<bool>(fout);
+	fout.close();
+	return suc;
+}
+
+#endif // SRC_PROBLEM_CACHE_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
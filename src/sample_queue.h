@@ -0,0 +1,273 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_SAMPLE_QUEUE_H
+#define SRC_SAMPLE_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "src/file_parser.h"
+
+// Bounded lock-free multi-producer multi-consumer ring buffer
+// (Dmitry Vyukov's sequence-numbered cells), capacity is rounded up to 2^k
+template<typename E>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity);
+	~BoundedQueue();
+
+	bool TryPush(const E& e);
+	bool TryPop(E& e);
+
+private:
+	enum { kCacheLineSize = 64 };
+
+	struct Cell {
+		std::atomic<size_t> seq;
+		E data;
+	};
+
+	Cell* cells_;
+	size_t mask_;
+
+	// keep producers and consumers on separate cache lines
+	char pad0_[kCacheLineSize];
+	std::atomic<size_t> head_;
+	char pad1_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> tail_;
+	char pad2_[kCacheLineSize - sizeof(std::atomic<size_t>)];
+};
+
+// Fixed-size batch of parsed samples, buffers are reused across fills
+template<typename T>
+struct SampleBatch {
+	size_t size;
+	std::vector<T> y;
+	std::vector<std::vector<std::pair<size_t, T> > > x;
+};
+
+// BatchPrefetcher: dedicated parser threads fill pooled batches from a
+// parser and hand them to trainer threads through a BoundedQueue
+template<typename T>
+class BatchPrefetcher {
+public:
+	BatchPrefetcher();
+	~BatchPrefetcher();
+
+	// queue_depth bounds number of batches alive, i.e. parsed samples buffered
+	bool Start(FileParserBase<T>* parser, size_t parser_threads, size_t queue_depth);
+	void Stop();
+
+	// Pop a filled batch, block until one is ready. NULL at end of input
+	SampleBatch<T>* Pop();
+
+	// Return a batch popped by Pop to the pool
+	void Release(SampleBatch<T>* batch);
+
+public:
+	enum { kBatchSize = 256 };
+
+private:
+	void ParseWorker();
+
+private:
+	FileParserBase<T>* parser_;
+	std::vector<SampleBatch<T> > batches_;
+	BoundedQueue<SampleBatch<T>*>* free_;
+	BoundedQueue<SampleBatch<T>*>* ready_;
+	std::vector<std::thread> threads_;
+	std::atomic<size_t> running_;
+	std::atomic<bool> done_;
+};
+
+
+
+template<typename E>
+BoundedQueue<E>::BoundedQueue(size_t capacity) : head_(0), tail_(0) {
+	size_t size = 2;
+	while (size < capacity) size <<= 1;
+
+	cells_ = new Cell[size];
+	mask_ = size - 1;
+	for (size_t i = 0; i < size; ++i) {
+		cells_[i].seq.store(i, std::memory_order_relaxed);
+	}
+}
+
+template<typename E>
+BoundedQueue<E>::~BoundedQueue() {
+	delete [] cells_;
+}
+
+template<typename E>
+bool BoundedQueue<E>::TryPush(const E& e) {
+	size_t pos = tail_.load(std::memory_order_relaxed);
+	while (1) {
+		Cell& cell = cells_[pos & mask_];
+		size_t seq = cell.seq.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+		if (diff == 0) {
+			if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				cell.data = e;
+				cell.seq.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = tail_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+template<typename E>
+bool BoundedQueue<E>::TryPop(E& e) {
+	size_t pos = head_.load(std::memory_order_relaxed);
+	while (1) {
+		Cell& cell = cells_[pos & mask_];
+		size_t seq = cell.seq.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+		if (diff == 0) {
+			if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+				e = cell.data;
+				cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+				return true;
+			}
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = head_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+
+
+template<typename T>
+BatchPrefetcher<T>::BatchPrefetcher()
+: parser_(NULL), free_(NULL), ready_(NULL), running_(0), done_(true) {}
+
+template<typename T>
+BatchPrefetcher<T>::~BatchPrefetcher() {
+	Stop();
+}
+
+template<typename T>
+bool BatchPrefetcher<T>::Start(FileParserBase<T>* parser,
+		size_t parser_threads, size_t queue_depth) {
+	Stop();
+	if (!parser || parser_threads == 0) return false;
+
+	// every parser thread needs a batch to fill, plus one in the queue
+	queue_depth = std::max(queue_depth, parser_threads + 1);
+
+	parser_ = parser;
+	batches_.resize(queue_depth);
+	free_ = new BoundedQueue<SampleBatch<T>*>(queue_depth);
+	ready_ = new BoundedQueue<SampleBatch<T>*>(queue_depth);
+	for (size_t i = 0; i < queue_depth; ++i) {
+		batches_[i].size = 0;
+		batches_[i].y.resize(kBatchSize);
+		batches_[i].x.resize(kBatchSize);
+		free_->TryPush(&batches_[i]);
+	}
+
+	done_ = false;
+	running_ = parser_threads;
+	for (size_t i = 0; i < parser_threads; ++i) {
+		threads_.push_back(std::thread(&BatchPrefetcher<T>::ParseWorker, this));
+	}
+	return true;
+}
+
+template<typename T>
+void BatchPrefetcher<T>::Stop() {
+	for (auto& thread : threads_) {
+		thread.join();
+	}
+	threads_.clear();
+
+	delete free_;
+	delete ready_;
+	free_ = ready_ = NULL;
+	batches_.clear();
+	parser_ = NULL;
+	done_ = true;
+}
+
+template<typename T>
+void BatchPrefetcher<T>::ParseWorker() {
+	bool eof = false;
+	while (!eof) {
+		SampleBatch<T>* batch = NULL;
+		while (!free_->TryPop(batch)) {
+			std::this_thread::yield();
+		}
+
+		batch->size = 0;
+		while (batch->size < kBatchSize) {
+			if (!parser_->ReadSampleMultiThread(batch->y[batch->size], batch->x[batch->size])) {
+				eof = true;
+				break;
+			}
+			++batch->size;
+		}
+
+		if (batch->size == 0) {
+			free_->TryPush(batch);
+			break;
+		}
+
+		while (!ready_->TryPush(batch)) {
+			std::this_thread::yield();
+		}
+	}
+
+	if (running_.fetch_sub(1) == 1) {
+		done_.store(true, std::memory_order_release);
+	}
+}
+
+template<typename T>
+SampleBatch<T>* BatchPrefetcher<T>::Pop() {
+	SampleBatch<T>* batch = NULL;
+	while (1) {
+		if (ready_->TryPop(batch)) return batch;
+		if (done_.load(std::memory_order_acquire)) {
+			return ready_->TryPop(batch) ? batch : NULL;
+		}
+		std::this_thread::yield();
+	}
+}
+
+template<typename T>
+void BatchPrefetcher<T>::Release(SampleBatch<T>* batch) {
+	while (!free_->TryPush(batch)) {
+		std::this_thread::yield();
+	}
+}
+
+
+#endif // SRC_SAMPLE_QUEUE_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -0,0 +1,313 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_SAMPLE_TOKENIZER_H
+#define SRC_SAMPLE_TOKENIZER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+#include "src/feature_hash.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+// first include of a translation unit may be this one, see ftrl_kernel.h
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+#endif
+
+// Tokenizer for LIBSVM lines working on [begin, end) ranges, so lines can be
+// parsed directly from a file mapping without copying or NUL-termination.
+
+inline bool is_token_delim(char c) {
+	return c == ' ' || c == '\t' || c == ':' || c == '\n';
+}
+
+inline bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n'
+		|| c == '\v' || c == '\f';
+}
+
+// Find first of ' ', '\t', ':', '\n' in [p, end), return end if not found
+inline const char* find_token_delim(const char* p, const char* end) {
+#if defined(__AVX2__)
+	const __m256i space32 = _mm256_set1_epi8(' ');
+	const __m256i tab32 = _mm256_set1_epi8('\t');
+	const __m256i colon32 = _mm256_set1_epi8(':');
+	const __m256i newline32 = _mm256_set1_epi8('\n');
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, space32), _mm256_cmpeq_epi8(v, tab32)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, colon32), _mm256_cmpeq_epi8(v, newline32)));
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(m));
+		if (mask) return p + __builtin_ctz(mask);
+		p += 32;
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i space16 = _mm_set1_epi8(' ');
+	const __m128i tab16 = _mm_set1_epi8('\t');
+	const __m128i colon16 = _mm_set1_epi8(':');
+	const __m128i newline16 = _mm_set1_epi8('\n');
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, space16), _mm_cmpeq_epi8(v, tab16)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, colon16), _mm_cmpeq_epi8(v, newline16)));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+		if (mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	while (p < end && !is_token_delim(*p)) ++p;
+	return p;
+}
+
+// Parse decimal feature index in [begin, end): optional '+', digits only,
+// up to 2^64 - 2 so 64-bit IDs can go to a sparse parameter store
+inline bool parse_index(const char* begin, const char* end, size_t& k) {
+	const char* p = begin;
+	if (p < end && *p == '+') ++p;
+	if (p == end) return false;
+
+	const uint64_t max_index = std::numeric_limits<uint64_t>::max() - 1;
+	uint64_t v = 0;
+	for (; p < end; ++p) {
+		unsigned d = static_cast<unsigned>(*p - '0');
+		if (d > 9) return false;
+		if (v > (max_index - d) / 10) return false;
+		v = v * 10 + d;
+	}
+
+	k = static_cast<size_t>(v);
+	return true;
+}
+
+template<typename T>
+T string_to_real(const char *nptr, char **endptr);
+
+template<>
+inline float string_to_real<float> (const char *nptr, char **endptr) {
+	return strtof(nptr, endptr);
+}
+
+template<>
+inline double string_to_real<double> (const char *nptr, char **endptr) {
+	return strtod(nptr, endptr);
+}
+
+// Largest mantissa and power of ten for which mantissa * 10^e is computed
+// exactly rounded by one IEEE multiplication or division (Clinger's fast path)
+template<typename T> struct FastRealLimits;
+
+template<> struct FastRealLimits<float> {
+	static uint64_t max_mantissa() { return (uint64_t)1 << 24; }
+	static int max_exp10() { return 10; }
+};
+
+template<> struct FastRealLimits<double> {
+	static uint64_t max_mantissa() { return (uint64_t)1 << 53; }
+	static int max_exp10() { return 22; }
+};
+
+template<typename T>
+inline T exact_pow10(int e) {
+	static const T table[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	return table[e];
+}
+
+// Parse real number starting at begin, set *stop to first unparsed char.
+// Plain decimals are converted on the fast path, everything else (long
+// mantissas, large exponents, inf/nan, hex) goes through strtod/strtof,
+// so the result is always correctly rounded.
+template<typename T>
+bool parse_real(const char* begin, const char* end, T& value, const char** stop) {
+	const char* p = begin;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		++p;
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exp10 = 0;
+	const char* digits_begin = p;
+	for (; p < end; ++p) {
+		unsigned d = static_cast<unsigned>(*p - '0');
+		if (d > 9) break;
+		if (mantissa != 0 || d != 0) ++digits;
+		mantissa = mantissa * 10 + d;
+		if (digits > 19) break;
+	}
+	bool has_digits = p != digits_begin;
+
+	if (digits <= 19 && p < end && *p == '.') {
+		const char* frac_begin = ++p;
+		for (; p < end; ++p) {
+			unsigned d = static_cast<unsigned>(*p - '0');
+			if (d > 9) break;
+			if (mantissa != 0 || d != 0) ++digits;
+			mantissa = mantissa * 10 + d;
+			--exp10;
+			if (digits > 19) break;
+		}
+		has_digits = has_digits || p != frac_begin;
+	}
+
+	if (digits <= 19 && has_digits && p < end && (*p == 'e' || *p == 'E')) {
+		const char* q = p + 1;
+		bool exp_negative = false;
+		if (q < end && (*q == '-' || *q == '+')) {
+			exp_negative = *q == '-';
+			++q;
+		}
+		int e = 0;
+		const char* exp_begin = q;
+		for (; q < end && static_cast<unsigned>(*q - '0') <= 9; ++q) {
+			if (e < 10000) e = e * 10 + (*q - '0');
+		}
+		if (q != exp_begin) {
+			exp10 += exp_negative ? -e : e;
+			p = q;
+		}
+	}
+
+	bool fast = has_digits && digits <= 19
+		&& mantissa <= FastRealLimits<T>::max_mantissa()
+		&& exp10 >= -FastRealLimits<T>::max_exp10()
+		&& exp10 <= FastRealLimits<T>::max_exp10()
+		&& (p == end || is_blank(*p) || *p == ':');
+
+	if (fast) {
+		T v = static_cast<T>(mantissa);
+		if (exp10 < 0) {
+			v /= exact_pow10<T>(-exp10);
+		} else if (exp10 > 0) {
+			v *= exact_pow10<T>(exp10);
+		}
+		value = negative ? -v : v;
+		*stop = p;
+		return true;
+	}
+
+	// slow path on a NUL-terminated copy of the token
+	const char* token_end = begin;
+	while (token_end < end && !is_blank(*token_end) && *token_end != ':') ++token_end;
+	char local[64];
+	std::string heap;
+	char* buf = local;
+	size_t len = token_end - begin;
+	if (len + 1 > sizeof(local)) {
+		heap.assign(begin, len);
+		buf = &heap[0];
+	} else {
+		memcpy(local, begin, len);
+		local[len] = '\0';
+	}
+
+	char* endptr = NULL;
+	value = string_to_real<T>(buf, &endptr);
+	if (endptr == buf) return false;
+	*stop = begin + (endptr - buf);
+	return true;
+}
+
+// Parse one LIBSVM line in [begin, end) to <x, y>. Returns false if the
+// label is missing or malformed; malformed idx:val tokens are skipped.
+// With hash_bits > 0 an index may be any name without blanks or ':', it is
+// hashed by hash_feature, and a bare name stands for name:1.
+template<typename T>
+bool tokenize_sample(const char* begin, const char* end, T& y,
+		std::vector<std::pair<size_t, T> >& x, size_t hash_bits = 0) {
+	const char* p = begin;
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n')) ++p;
+	if (p == end) return false;
+
+	const char* label_end = p;
+	while (label_end < end && *label_end != ' ' && *label_end != '\t'
+			&& *label_end != '\n') {
+		++label_end;
+	}
+
+	const char* stop = NULL;
+	if (!parse_real<T>(p, label_end, y, &stop) || stop != label_end) return false;
+	if (y < 0) y = 0;
+
+	x.clear();
+	// add bias term
+	x.push_back(std::make_pair((size_t)0, (T)1));
+
+	p = label_end;
+	while (p < end) {
+		while (p < end && is_blank(*p)) ++p;
+		if (p == end) break;
+
+		const char* idx_end = find_token_delim(p, end);
+		if (idx_end == end || *idx_end != ':') {
+			// no value for this token, skip it unless it names a hashed feature
+			if (hash_bits > 0) {
+				x.push_back(std::make_pair(hash_feature(p, idx_end, hash_bits), (T)1));
+			}
+			p = idx_end;
+			continue;
+		}
+
+		const char* val = idx_end + 1;
+		const char* val_end = find_token_delim(val, end);
+		while (val_end < end && *val_end == ':') {
+			val_end = find_token_delim(val_end + 1, end);
+		}
+
+		size_t k = 0;
+		T v = 0;
+		bool error_found = false;
+		if (hash_bits > 0) {
+			k = hash_feature(p, idx_end, hash_bits);
+		} else {
+			error_found = !parse_index(p, idx_end, k);
+		}
+		if (!error_found && (!parse_real<T>(val, val_end, v, &stop)
+				|| (stop != val_end && !is_blank(*stop)))) {
+			error_found = true;
+		}
+
+		if (!error_found) {
+			x.push_back(std::make_pair(k, v));
+		}
+
+		p = val_end;
+	}
+
+	return true;
+}
+
+#endif // SRC_SAMPLE_TOKENIZER_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
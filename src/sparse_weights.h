@@ -0,0 +1,122 @@
+// Copyright (c) 2014-2015 The AsyncFTRL Project
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SRC_SPARSE_WEIGHTS_H
+#define SRC_SPARSE_WEIGHTS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// SparseWeights: read-only weights of a sparse model, the non-zero
+// (index, weight) pairs in two arrays sorted by index. A directory on the
+// high bits of the index narrows a lookup to a bucket of a few entries,
+// so that it takes about two cache misses at 8 + sizeof(T) bytes per
+// weight plus 4 per bucket, rather than a node of a hash map.
+template<typename T>
+class SparseWeights {
+public:
+	SparseWeights() : shift_(0) {}
+
+	// pairs are sorted by index here, the last of equal indices is kept
+	void Initialize(std::vector<std::pair<uint64_t, T> >& pairs);
+
+	// num pairs sorted by index
+	void Initialize(const uint64_t* index, const T* weights, size_t num);
+
+	T Get(uint64_t idx) const {
+		uint64_t bucket = idx >> shift_;
+		if (bucket + 1 >= bucket_.size()) return 0;
+
+		const uint64_t* begin = index_.data() + bucket_[bucket];
+		const uint64_t* end = index_.data() + bucket_[bucket + 1];
+		const uint64_t* iter = std::lower_bound(begin, end, idx);
+		return iter != end && *iter == idx ? weights_[iter - index_.data()] : 0;
+	}
+
+	size_t size() const { return index_.size(); }
+	// one past the largest index
+	uint64_t end_index() const { return index_.empty() ? 0 : index_.back() + 1; }
+
+	size_t memory_bytes() const {
+		return index_.size() * (sizeof(uint64_t) + sizeof(T))
+			+ bucket_.size() * sizeof(uint32_t);
+	}
+
+private:
+	void BuildDirectory();
+
+private:
+	std::vector<uint64_t> index_;
+	std::vector<T> weights_;
+	// first entry of each bucket of 2^shift_ indices, plus the end, so at
+	// most 2^32 weights
+	std::vector<uint32_t> bucket_;
+	unsigned shift_;
+};
+
+
+
+template<typename T>
+void SparseWeights<T>::Initialize(std::vector<std::pair<uint64_t, T> >& pairs) {
+	std::stable_sort(pairs.begin(), pairs.end(),
+		[] (const std::pair<uint64_t, T>& a, const std::pair<uint64_t, T>& b) {
+			return a.first < b.first;
+		});
+
+	index_.clear();
+	weights_.clear();
+	index_.reserve(pairs.size());
+	weights_.reserve(pairs.size());
+	for (auto& item : pairs) {
+		if (!index_.empty() && index_.back() == item.first) {
+			weights_.back() = item.second;
+			continue;
+		}
+		index_.push_back(item.first);
+		weights_.push_back(item.second);
+	}
+	BuildDirectory();
+}
+
+template<typename T>
+void SparseWeights<T>::Initialize(const uint64_t* index, const T* weights, size_t num) {
+	index_.assign(index, index + num);
+	weights_.assign(weights, weights + num);
+	BuildDirectory();
+}
+
+template<typename T>
+void SparseWeights<T>::BuildDirectory() {
+	// about two entries per bucket
+	uint64_t max_index = index_.empty() ? 0 : index_.back();
+	size_t buckets = std::max<size_t>(1, index_.size() / 2);
+	shift_ = 0;
+	while (shift_ < 63 && (max_index >> shift_) >= buckets) ++shift_;
+
+	size_t num = static_cast<size_t>(max_index >> shift_) + 1;
+	bucket_.assign(num + 1, 0);
+	for (uint64_t idx : index_) ++bucket_[(idx >> shift_) + 1];
+	for (size_t i = 1; i <= num; ++i) bucket_[i] += bucket_[i - 1];
+}
+
+#endif // SRC_SPARSE_WEIGHTS_H
+/* vim: set ts=4 sw=4 tw=0 noet :*/
@@ -23,7 +23,9 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <future>
 #include <limits>
 #include <vector>
@@ -32,6 +34,13 @@
 #define MIN_SIGMOID (10e-15)
 #define MAX_SIGMOID (1. - 10e-15)
 
+// build with -DFTRL_FAST_MATH to make fast_sigmoid and fast_log the default
+#ifdef FTRL_FAST_MATH
+#define FTRL_FAST_MATH_DEFAULT true
+#else
+#define FTRL_FAST_MATH_DEFAULT false
+#endif
+
 
 template<class Func>
 void util_parallel_run(const Func& func, size_t num_threads = 0) {
@@ -115,5 +124,70 @@ inline T sigmoid(T x) {
 	return one / (one + safe_exp(-x));
 }
 
+// 2^n for n in the normal exponent range, the first argument picks the type
+inline float util_pow2i(float, int n) {
+	uint32_t bits = static_cast<uint32_t>(n + 127) << 23;
+	float x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+inline double util_pow2i(double, int n) {
+	uint64_t bits = static_cast<uint64_t>(n + 1023) << 52;
+	double x;
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+// exp on the range of safe_exp, inlined and branch free. x = n ln2 + r with
+// |r| <= ln2 / 2, e^r by its Taylor polynomial of degree 6, relative error
+// below 2e-7 in double and 4e-7 in float
+template<typename T>
+inline T fast_exp(T x) {
+	T max_exp = static_cast<T>(MAX_EXP_NUM);
+	x = std::max(std::min(x, max_exp), -max_exp);
+
+	T n = std::floor(x * static_cast<T>(1.4426950408889634) + static_cast<T>(0.5));
+	T r = x - n * static_cast<T>(0.6931471805599453);
+	T p = static_cast<T>(1. / 720);
+	p = p * r + static_cast<T>(1. / 120);
+	p = p * r + static_cast<T>(1. / 24);
+	p = p * r + static_cast<T>(1. / 6);
+	p = p * r + static_cast<T>(0.5);
+	p = p * r + static_cast<T>(1);
+	p = p * r + static_cast<T>(1);
+	return p * util_pow2i(x, static_cast<int>(n));
+}
+
+// sigmoid by fast_exp, absolute error below 1e-7
+template<typename T>
+inline T fast_sigmoid(T x) {
+	T one = 1.;
+	return one / (one + fast_exp(-x));
+}
+
+// log of a positive normal float. x = m 2^e with m in [sqrt(1/2), sqrt(2)),
+// log(m) = 2 atanh(s) for s = (m - 1) / (m + 1), whose series is cut after
+// s^7, relative error below 2e-7
+inline float fast_log(float x) {
+	uint32_t bits;
+	memcpy(&bits, &x, sizeof(bits));
+	int e = static_cast<int>((bits >> 23) & 0xff) - 127;
+	bits = (bits & 0x7fffff) | 0x3f800000;
+	float m;
+	memcpy(&m, &bits, sizeof(m));
+	if (m > 1.41421356f) {
+		m *= 0.5f;
+		++e;
+	}
+
+	float s = (m - 1) / (m + 1);
+	float s2 = s * s;
+	float p = s2 * (1.f / 7) + 1.f / 5;
+	p = p * s2 + 1.f / 3;
+	p = p * s2 + 1;
+	return 2 * s * p + e * 0.6931471805599453f;
+}
+
 #endif // SRC_UTIL_H
 /* vim: set ts=4 sw=4 tw=0 noet :*/